@@ -2,6 +2,7 @@
 #include <vector>
 #include <string>
 #include <iostream>
+#include <queue>
 #include "VulkanSystem.h"
 
 //Class to load and handle a file of headless events
@@ -9,7 +10,7 @@ enum EventsType {
 	EV_PLAY,
 	EV_AVAILABLE,
 	EV_MARK,
-	EV_SAVE, // IMPLEMENT LAST!
+	EV_SAVE,
 	EV_NONE
 };
 
@@ -27,13 +28,15 @@ struct Event
 	PlaybackInfo playbackInfo;
 	std::string saveName; //filename.ppm
 	std::string markDescription;
-	bool completed = false;
-	Event(const Event& e) {
-		time = e.time;
-		type = e.type;
-		time = e.time;
-	};
-	Event() {};
+	size_t order = 0; //Position in the events file, breaks ties between equal timestamps
+};
+
+//Orders the queue so the earliest event is on top
+struct EventLater {
+	bool operator()(const Event& a, const Event& b) const {
+		if (a.time != b.time) return a.time > b.time;
+		return a.order > b.order;
+	}
 };
 
 //Class to handle events
@@ -43,42 +46,76 @@ public:
 	HeadlessEvents(VulkanSystem* vulkanSystem) {
 		vulkanSystemP = vulkanSystem;
 	};
-	std::vector<Event> eventsQueue;
-	//Given a frame time, when the next event is reached, handle it accordingly
-	void handleEventsQueue(float delta) {
+	//Min heap on timestamp, so files that are out of order or hold tens of
+	//thousands of events cost O(log n) per event
+	std::priority_queue<Event, std::vector<Event>, EventLater> eventsQueue;
+	void addEvent(Event event) {
+		event.order = eventCount++;
+		eventsQueue.push(event);
+	};
+	//Simulation time in ms, only ever advanced to event timestamps
+	int simTime = 0;
+	//Timestamp of the next unhandled event
+	int nextEventTime() {
+		if (done()) return simTime;
+		return eventsQueue.top().time;
+	};
+	//Handle every event that is due by the given time. Consecutive PLAY events
+	//only apply the last one. Returns true if the playback time was changed
+	bool handleEventsQueue(int time) {
 		if (vulkanSystemP == nullptr) {
 			throw std::runtime_error("ERROR: Vulkan System pointer must be set before handling an events queue.");
 		}
-		int msDelta = delta * 1000;
-		if (!eventsQueue[currentEvent].completed) return;
-		if (currentEvent == eventsQueue.size() - 1 || eventsQueue[currentEvent + 1].time > msDelta) return;
-		currentEvent++;
-		switch (eventsQueue[currentEvent].type)
-		{
-		case EV_AVAILABLE:
-			vulkanSystemP->headlessGuard = false;
-			eventsQueue[currentEvent].completed = true;
-			break;
-		case EV_MARK:
-			std::cout << eventsQueue[currentEvent].markDescription << std::endl;
-			eventsQueue[currentEvent].completed = true;
-			break;
-		case EV_PLAY:
-			vulkanSystemP->playbackSpeed = eventsQueue[currentEvent].playbackInfo.rate;
-			vulkanSystemP->setDriverRuntime(eventsQueue[currentEvent].playbackInfo.time);
-			eventsQueue[currentEvent].completed = true;
-			break;
-		case EV_SAVE:
-			eventsQueue[currentEvent].completed = true;
-			std::cout << "Saving to image not yet supported in Events." << std::endl;
-			break;
-		default:
-			eventsQueue[currentEvent].completed = true;
-			break;
-		};
+		bool played = false;
+		bool playPending = false;
+		PlaybackInfo playback{};
+		while (!done() && eventsQueue.top().time <= time) {
+			const Event& event = eventsQueue.top();
+			if (event.type == EV_PLAY) {
+				playback = event.playbackInfo;
+				playPending = true;
+				eventsQueue.pop();
+				continue;
+			}
+			if (playPending) {
+				applyPlayback(playback);
+				playPending = false;
+				played = true;
+			}
+			switch (event.type)
+			{
+			case EV_AVAILABLE:
+				vulkanSystemP->headlessGuard = false;
+				break;
+			case EV_MARK:
+				std::cout << event.markDescription << std::endl;
+				break;
+			case EV_SAVE:
+				vulkanSystemP->requestSave(event.saveName);
+				break;
+			default:
+				break;
+			};
+			eventsQueue.pop();
+		}
+		if (playPending) {
+			applyPlayback(playback);
+			played = true;
+		}
+		return played;
+	};
+	//Headless runs end once every event has been handled
+	bool done() {
+		return eventsQueue.empty();
 	};
-	int currentEvent = 0;
 	//Gives event handler direct access to vulkan to handle events and
 	//in turn get info back from vulkan
 	VulkanSystem* vulkanSystemP;
+
+private:
+	size_t eventCount = 0;
+	void applyPlayback(PlaybackInfo playback) {
+		vulkanSystemP->playbackSpeed = playback.rate;
+		vulkanSystemP->setDriverRuntime(playback.time);
+	};
 };
\ No newline at end of file
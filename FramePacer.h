@@ -0,0 +1,46 @@
+#pragma once
+#include <chrono>
+#include <thread>
+
+//Limits the main loop to a target frame rate without spinning a core for the whole frame.
+//Sleeps until shortly before the deadline, since sleeps can overshoot by a scheduler tick,
+//then spins for the remainder. A target rate of 0 leaves the loop uncapped.
+class FramePacer {
+public:
+	float targetRate = 60.f;
+	//Portion of the frame left to spinning, covers the sleep granularity of the OS
+	std::chrono::microseconds spinMargin = std::chrono::microseconds(2000);
+
+	void reset() {
+		lastFrame = std::chrono::high_resolution_clock::now();
+		deadline = lastFrame;
+	}
+
+	//Wait for the next frame, returning seconds since the last one
+	float wait() {
+		std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
+		if (targetRate > 0) {
+			std::chrono::high_resolution_clock::duration period =
+				std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(
+					std::chrono::duration<float>(1.f / targetRate));
+			deadline += period;
+			//Fell more than a frame behind, restart the schedule instead of bursting to catch up
+			if (now > deadline + period) deadline = now;
+			if (deadline - now > spinMargin) {
+				std::this_thread::sleep_for(deadline - now - spinMargin);
+			}
+			now = std::chrono::high_resolution_clock::now();
+			while (now < deadline) {
+				std::this_thread::yield();
+				now = std::chrono::high_resolution_clock::now();
+			}
+		}
+		float delta = std::chrono::duration<float>(now - lastFrame).count();
+		lastFrame = now;
+		return delta;
+	}
+
+private:
+	std::chrono::high_resolution_clock::time_point lastFrame;
+	std::chrono::high_resolution_clock::time_point deadline;
+};
@@ -54,9 +54,16 @@ int main(int argc, char* argv[])
 	int headlessArg = 0;
 	int shaderArg = 0;
 	int poolArg = 0;
+	int traceArg = 0;
+	int frameRateArg = 0;
+	int presentModeArg = 0;
 	bool instancing = false;
 	bool verbose = false;
 	bool culling = false;
+	bool packedVertices = false;
+	bool overdrawOrder = false;
+	bool meshlets = false;
+	bool lods = false;
 	bool animate = true;
 	bool listPhysicalDevices = false;
 	if (argc < 2) throw std::runtime_error("Please specify a scene (.s72 file) to load the program using --scene ____.");
@@ -88,6 +95,15 @@ int main(int argc, char* argv[])
 			else if (std::string(argv[arg]).compare("--pool-size") == 0) {
 				poolArg = arg + 1;
 			}
+			else if (std::string(argv[arg]).compare("--trace") == 0) {
+				traceArg = arg + 1;
+			}
+			else if (std::string(argv[arg]).compare("--frame-rate") == 0) {
+				frameRateArg = arg + 1;
+			}
+			else if (std::string(argv[arg]).compare("--present-mode") == 0) {
+				presentModeArg = arg + 1;
+			}
 		}
 		else if (std::string(argv[arg]).compare("--list-physical-devices") == 0) {
 			listPhysicalDevices = true;
@@ -98,6 +114,18 @@ int main(int argc, char* argv[])
 		else if (std::string(argv[arg]).compare("--culling") == 0) {
 			culling = true;
 		}
+		else if (std::string(argv[arg]).compare("--packed-vertices") == 0) {
+			packedVertices = true;
+		}
+		else if (std::string(argv[arg]).compare("--overdraw-order") == 0) {
+			overdrawOrder = true;
+		}
+		else if (std::string(argv[arg]).compare("--meshlets") == 0) {
+			meshlets = true;
+		}
+		else if (std::string(argv[arg]).compare("--lods") == 0) {
+			lods = true;
+		}
 		else if (std::string(argv[arg]).compare("--verbose") == 0) {
 			verbose = true;
 		}
@@ -151,10 +179,10 @@ int main(int argc, char* argv[])
 	}
 	//Headless: Optional
 	std::string headlessFile;
-	if (headlessArg != 0 && (drawingSizeArgH || drawingSizeArgW)) {
+	if (headlessArg != 0 && (drawingSizeArgH == 0 || drawingSizeArgW == 0)) {
 		throw std::runtime_error("A specified drawing size is required to run in headless mode. Please do so using the argument --drawing-size.");
 	}
-	else {
+	else if (headlessArg != 0) {
 		headlessFile = std::string(argv[headlessArg]);
 	}
 	//Shader path: required
@@ -177,8 +205,32 @@ int main(int argc, char* argv[])
 	graphMode.verbose = verbose;
 	//Culling: optional
 	graphMode.culling = culling;
+	//Packed vertices: optional
+	graphMode.packedVertices = packedVertices;
+	//Overdraw order: optional
+	graphMode.overdrawOrder = overdrawOrder;
+	//Meshlets: optional
+	graphMode.meshlets = meshlets;
+	//LODs: optional
+	graphMode.lods = lods;
 	//Animate: optional
 	graphMode.animate = animate;
+	//Trace: optional
+	if (traceArg != 0) {
+		graphMode.traceFile = std::string(argv[traceArg]);
+	}
+	//Frame rate: optional, 0 = uncapped
+	if (frameRateArg != 0) {
+		graphMode.frameRate = (float)atof(argv[frameRateArg]);
+	}
+	//Present mode: optional
+	if (presentModeArg != 0) {
+		std::string presentMode = std::string(argv[presentModeArg]);
+		if (presentMode.compare("fifo") == 0) graphMode.presentMode = VK_PRESENT_MODE_FIFO_KHR;
+		else if (presentMode.compare("mailbox") == 0) graphMode.presentMode = VK_PRESENT_MODE_MAILBOX_KHR;
+		else if (presentMode.compare("immediate") == 0) graphMode.presentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+		else throw std::runtime_error("Present mode must be one of fifo, mailbox or immediate.");
+	}
 
 	//Create windows and graph modes
 	HRESULT hResult = CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE);
@@ -1125,6 +1125,17 @@ template<typename T> struct mat44 {
 		);
 	}
 
+	//Same depth convention as perspective, centered on the view axis
+	static mat44<T> orthographic(T halfWidth, T halfHeight, T nearP, T farP) {
+		T n = nearP; T f = farP;
+		return mat44<T>(
+			1 / halfWidth, 0, 0, 0,
+			0, 1 / halfHeight, 0, 0,
+			0, 0, -1 / (f - n), 0,
+			0, 0, -n / (f - n), 1
+		);
+	}
+
 	//ROW MAJOR
 	static mat33<T> submatrixRow(mat44<T> m, int i, int j) {
 		mat33<T> subM;
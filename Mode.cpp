@@ -4,6 +4,8 @@
 #include "VulkanSystem.h"
 #include "Parser.h"
 #include "Events.h"
+#include "Profiler.h"
+#include <future>
 
 //Handle each distinct type of window event
 //Track delta over a frame, and change in x and y over a frame, and act on that
@@ -11,6 +13,7 @@ void Mode::handleMouseMove(int x, int y) {
 	if(mouseEventActive){ //Only handle mouse movement while mouse is being moved
 		std::pair<int, int> newDelta = std::make_pair(x - lastMousePos.first, y - lastMousePos.second);
 		if (newDelta.first == 0 && newDelta.second == 0) return;
+		std::lock_guard<std::mutex> lock(inputMutex);
 		moveStatus.mouseDelta.first += newDelta.first;
 		moveStatus.mouseDelta.second += newDelta.second;
 		lastMousePos = std::make_pair(x, y);
@@ -23,6 +26,7 @@ void Mode::handleScrollEvent(int delta) {
 
 //Handle keyboard input
 void Mode::handleButtonEvent(ButtonEvent event) {
+	std::unique_lock<std::mutex> lock(inputMutex);
 	//Move
 	if (event.button == KEY_W) { 
 		moveStatus.forward = event.pressed;
@@ -44,27 +48,28 @@ void Mode::handleButtonEvent(ButtonEvent event) {
 	}
 	//Change camera mode
 	if (event.button == KEY_0 && event.pressed) {
-		vulkanSystem.movementMode = MOVE_DEBUG;
+		moveStatus.movementMode = MOVE_DEBUG;
 	}
 	if (event.button == KEY_1 && event.pressed) {
-		vulkanSystem.movementMode = MOVE_USER;
+		moveStatus.movementMode = MOVE_USER;
 	}
 	if (event.button == KEY_2 && event.pressed) {
-		vulkanSystem.movementMode = MOVE_STATIC;
+		moveStatus.movementMode = MOVE_STATIC;
 	}
 	//Control animation
 	if (event.button == KEY_LEFT && event.pressed) {
-		vulkanSystem.forwardAnimation = false;
+		moveStatus.forwardAnimation = false;
 	}
 	if (event.button == KEY_RIGHT && event.pressed) {
-		vulkanSystem.forwardAnimation = true;
+		moveStatus.forwardAnimation = true;
 	}
 	if (event.button == KEY_DOWN && event.pressed) {
-		vulkanSystem.playingAnimation = false;
+		moveStatus.playingAnimation = false;
 	}
 	if (event.button == KEY_UP && event.pressed) {
-		vulkanSystem.playingAnimation = true;
+		moveStatus.playingAnimation = true;
 	}
+	lock.unlock();
 
 	//Control camera via left click
 	if (event.button == LEFTBUTTON && event.pressed) {
@@ -103,79 +108,137 @@ void Mode::handleinputEvent(InputEvent inputEvent) {
 }
 
 
-//Main render loop
+//Simulation loop for window mode, runs on its own thread alongside rendering.
+//Samples input and advances drivers, then publishes the result as a frame snapshot.
 //Camera implementation guided by https://learnopengl.com/Getting-started/Camera
-void Mode::mainLoop(SceneGraph* graph) {
-	int framecount = 0;
-	float mscount = 0;
-	vulkanSystem.activeP = &active;
+void Mode::simLoop(SceneGraph* graph) {
+	Profiler::nameThread("simulation");
+	FramePacer simPacer;
+	simPacer.targetRate = frameRate;
+	simPacer.reset();
 	float yaw = 0; float pitch = 0;
 	float yawDebug = 0; float pitchDebug = 0;
-	while (active) {
+	FrameSnapshot state;
+	state.moveVec = vulkanSystem.moveVec;
+	state.dirVec = vulkanSystem.dirVec;
+	state.debugMoveVec = vulkanSystem.debugMoveVec;
+	state.debugDirVec = vulkanSystem.debugDirVec;
+	while (simRunning) {
+		//Uncapped, simulating ahead of rendering would only spin a core on skipped snapshots
+		if (simPacer.targetRate <= 0) {
+			std::unique_lock<std::mutex> lock(snapshotMutex);
+			snapshotTaken.wait(lock, [&]() { return !snapshots.pending() || !simRunning; });
+		}
+		float delta = simPacer.wait();
+		TRACE_SCOPE("simulate");
+		//Take the input gathered since the last step
+		MoveStatus input;
+		{
+			std::lock_guard<std::mutex> lock(inputMutex);
+			input = moveStatus;
+			moveStatus.mouseDelta = std::make_pair(0, 0);
+		}
 		//Process user input for the current frame
-		float delta = 0;
-		std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
-		while (delta < 1 / 60.f) {
-			now = std::chrono::high_resolution_clock::now();
-			delta = std::chrono::duration<float>(now - lastFrame).count();
+		state.movementMode = input.movementMode;
+		float_3 moveVec = state.movementMode == MOVE_DEBUG ? state.debugMoveVec : state.moveVec;
+		if (state.movementMode != MOVE_STATIC) {
+			float x = (input.left * 1 + input.right * -1) * delta * speed;
+			float z = (input.forward * 1 + input.backward * -1) * delta * speed;
+			float y = (input.up * 1 + input.down * -1) * delta * speed;
+			moveVec = moveVec + float_3(x, y, z);
 		}
-		lastFrame = now;
-		if (vulkanSystem.renderToWindow) {
-			float_3 moveVec = vulkanSystem.movementMode == MOVE_DEBUG ? vulkanSystem.debugMoveVec : vulkanSystem.moveVec;
-			if (vulkanSystem.movementMode != MOVE_STATIC) {
-				float x = (moveStatus.left * 1 + moveStatus.right * -1) * delta * speed;
-				float z = (moveStatus.forward * 1 + moveStatus.backward * -1) * delta * speed;
-				float y = (moveStatus.up * 1 + moveStatus.down * -1) * delta * speed;
-				moveVec = moveVec + float_3(x, y, z);
-			}
 
-			float_3 dirVec;
-			if (vulkanSystem.movementMode == MOVE_DEBUG) {
+		float_3 dirVec;
+		if (state.movementMode == MOVE_DEBUG) {
+			float moveFactor = 10;
+			yawDebug += delta * input.mouseDelta.first * moveFactor;
+			pitchDebug -= delta * input.mouseDelta.second * moveFactor;
+			if (pitchDebug > 179.9) pitchDebug = 179.9; if (pitchDebug < -179.9) pitchDebug = -179.9;
+			if (yawDebug > 89.9) yawDebug = 89.9; if (yawDebug < -89.9) yawDebug = -89.9;
+			float dirX = cos(radians(yawDebug)) * cos(radians(pitchDebug));
+			float dirY = sin(radians(pitchDebug));
+			float dirZ = sin(radians(yawDebug)) * cos(radians(pitchDebug));
+			dirVec = float_3(dirX, dirY, dirZ);
+		}
+		else{
+			if (state.movementMode == MOVE_USER) {
 				float moveFactor = 10;
-				yawDebug += delta * moveStatus.mouseDelta.first * moveFactor;
-				pitchDebug -= delta * moveStatus.mouseDelta.second * moveFactor;
-				if (pitchDebug > 179.9) pitchDebug = 179.9; if (pitchDebug < -179.9) pitchDebug = -179.9;
-				if (yawDebug > 89.9) yawDebug = 89.9; if (yawDebug < -89.9) yawDebug = -89.9;
-				float dirX = cos(radians(yawDebug)) * cos(radians(pitchDebug));
-				float dirY = sin(radians(pitchDebug));
-				float dirZ = sin(radians(yawDebug)) * cos(radians(pitchDebug));
-				dirVec = float_3(dirX, dirY, dirZ);
-				moveStatus.mouseDelta.first = 0;
-				moveStatus.mouseDelta.second = 0;
-			}
-			else{
-				if (vulkanSystem.movementMode == MOVE_USER) {
-					float moveFactor = 10;
-					yaw += delta * moveStatus.mouseDelta.first * moveFactor;
-					pitch -= delta * moveStatus.mouseDelta.second * moveFactor;
-					if (pitch > 89.9) pitch = 89.9; if (pitch < -89.9) pitch = -89.9;
-					if (yaw > 89.9) yaw = 89.9; if (yaw < -89.9) yaw = -89.9;
-				}
-				float dirX = cos(radians(yaw)) * cos(radians(pitch));
-				float dirY = sin(radians(pitch));
-				float dirZ = sin(radians(yaw)) * cos(radians(pitch));
-				dirVec = float_3(dirX, dirY, dirZ);
-				moveStatus.mouseDelta.first = 0;
-				moveStatus.mouseDelta.second = 0;
+				yaw += delta * input.mouseDelta.first * moveFactor;
+				pitch -= delta * input.mouseDelta.second * moveFactor;
+				if (pitch > 89.9) pitch = 89.9; if (pitch < -89.9) pitch = -89.9;
+				if (yaw > 89.9) yaw = 89.9; if (yaw < -89.9) yaw = -89.9;
 			}
-			if (vulkanSystem.movementMode == MOVE_DEBUG) {
-				vulkanSystem.debugDirVec = dirVec;
-				vulkanSystem.debugMoveVec = moveVec;
-			}
-			else {
-				vulkanSystem.moveVec = moveVec;
-				vulkanSystem.dirVec = dirVec;
+			float dirX = cos(radians(yaw)) * cos(radians(pitch));
+			float dirY = sin(radians(pitch));
+			float dirZ = sin(radians(yaw)) * cos(radians(pitch));
+			dirVec = float_3(dirX, dirY, dirZ);
+		}
+		if (state.movementMode == MOVE_DEBUG) {
+			state.debugDirVec = dirVec;
+			state.debugMoveVec = moveVec;
+		}
+		else {
+			state.moveVec = moveVec;
+			state.dirVec = dirVec;
+		}
+
+		//Animate, a navigated draw list is shared by every snapshot until the next one.
+		//While windowed the drivers and animation controls are only touched by this thread.
+		vulkanSystem.playingAnimation = input.playingAnimation;
+		vulkanSystem.forwardAnimation = input.forwardAnimation;
+		if (animate && vulkanSystem.advanceDrivers(delta, graph, true)) {
+			TRACE_SCOPE("navigate");
+			state.scene = std::make_shared<const DrawList>(graph->navigateSceneGraph(false, poolSize));
+			state.sceneVersion++;
+		}
+		snapshots.back() = state;
+		snapshots.publish();
+	}
+}
+
+//Main render loop
+void Mode::mainLoop(SceneGraph* graph) {
+	int framecount = 0;
+	float mscount = 0;
+	vulkanSystem.activeP = &active;
+	//Headless stays on one thread so runs remain deterministic
+	std::thread simThread;
+	if (vulkanSystem.renderToWindow) {
+		simRunning = true;
+		simThread = std::thread(&Mode::simLoop, this, graph);
+	}
+	while (active) {
+		float delta = 0;
+		if (vulkanSystem.renderToWindow) {
+			delta = pacer.wait();
+			vulkanSystem.waitForFrame();
+			//Draw the newest snapshot, or the last one again if the simulation has not caught up
+			if (snapshots.update()) {
+				vulkanSystem.applySnapshot(snapshots.front());
+				//Taking the lock orders the update before a waiting simulation checks it
+				{ std::lock_guard<std::mutex> lock(snapshotMutex); }
+				snapshotTaken.notify_one();
 			}
 		}
 		else {
-			events.handleEventsQueue(delta);
+			//Headless time jumps straight to the next event instead of following the wall clock,
+			//so animation and saved frames only depend on the events file
+			if (events.done()) break;
+			int nextTime = events.nextEventTime();
+			delta = (nextTime - events.simTime) / 1000.f;
+			events.simTime = nextTime;
+			if (animate) vulkanSystem.runDrivers(delta, graph, true);
+			//Re-evaluate drivers at a newly set playback time before drawing
+			if (events.handleEventsQueue(events.simTime) && animate) vulkanSystem.runDrivers(0, graph, true);
 		}
 		//Update frame
 
 		std::chrono::high_resolution_clock::time_point start =
 			std::chrono::high_resolution_clock::now();
-		vulkanSystem.drawFrame();
-		if(animate) vulkanSystem.runDrivers(1 / 60.f, graph, true);
+		{
+			TRACE_SCOPE("frame");
+			vulkanSystem.drawFrame();
+		}
 		std::chrono::high_resolution_clock::time_point end =
 			std::chrono::high_resolution_clock::now();
 		mscount += std::chrono::duration_cast<std::chrono::milliseconds>(
@@ -184,15 +247,35 @@ void Mode::mainLoop(SceneGraph* graph) {
 		if (verbose && framecount == 1000) {
 			std::cout << "MEASURE frametime (avg of 1000 frames): " << (float)
 				mscount / 1000.f << "ms" << std::endl;
+			for (size_t light = 0; light < vulkanSystem.lightPool.size(); light++) {
+				if (vulkanSystem.lightPool[light].shadowRes == 0) continue;
+				std::cout << "MEASURE shadow map " << light << " renders (of 1000 frames): " <<
+					vulkanSystem.shadowRenders[light] << (vulkanSystem.shadowDirty[light] ? " (dirty)" : " (cached)") << 
+					", visible casters: " << vulkanSystem.shadowCasters[light] << std::endl;
+				vulkanSystem.shadowRenders[light] = 0;
+			}
+			vulkanSystem.reportFrameStats();
+			vulkanSystem.reportGpuTimings();
 			mscount = 0;
 			framecount = 0;
 		}
 	}
+	active = false;
+	if (simThread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(snapshotMutex);
+			simRunning = false;
+		}
+		snapshotTaken.notify_one();
+		simThread.join();
+	}
 
 	vulkanSystem.idle();
 }
 
 int Mode::modeMain() {
+	if (traceFile.size() > 0) Profiler::start(traceFile);
+	Profiler::nameThread("render");
 	Texture defaultCube;
 	defaultCube.doFree = false;
 	defaultCube.realY = 6;
@@ -221,15 +304,39 @@ int Mode::modeMain() {
 	const unsigned char shadowArr[] = { char255,char255,char255,char255 };
 	defaultShadow.data = shadowArr;
 
-	//Parse and initialize user requested .s72 scene graph file
+	//Parse and navigate the user requested .s72 scene graph file in the background,
+	//2D textures are only decoded once the first frames are up
 	Parser parser;
-	SceneGraph graph = parser.parseJson(sceneName, verbose);
+	SceneGraph graph;
+	Texture lut;
+	std::future<DrawList> sceneLoad = std::async(std::launch::async, [&]() {
+		Profiler::nameThread("scene load");
+		TRACE_SCOPE("load scene");
+		graph = parser.parseJson(sceneName, verbose);
+		graph.optimizeMeshes(overdrawOrder, verbose);
+		if (lods) graph.buildMeshLods(verbose);
+		graph.useInstancing = useInstancing;
+		lut = Texture::parseTexture("Textures/LUT.png", false);
+		return graph.navigateSceneGraph(verbose, poolSize);
+	});
 
-	graph.useInstancing = useInstancing;
-	Texture lut = Texture::parseTexture("Textures/LUT.png", false);
-	vulkanSystem.LUT = lut;
+	//Meanwhile set up everything that does not depend on the scene
+	vulkanSystem.shaderDir = shaderDir;
+	vulkanSystem.mainWindow = mainWindow;
+	vulkanSystem.deviceName = deviceName;
+	vulkanSystem.verbose = verbose;
+	vulkanSystem.platform = platform;
+	//Without an events file everything is drawn to the window
+	vulkanSystem.renderToWindow = eventName.empty();
+	vulkanSystem.preferredPresentMode = presentMode;
+	vulkanSystem.initDevice();
 
-	DrawList drawList = graph.navigateSceneGraph(verbose, poolSize);
+	DrawList drawList;
+	{
+		TraceScope scope("wait for scene", verbose);
+		drawList = sceneLoad.get();
+	}
+	vulkanSystem.LUT = lut;
 	if (drawList.cubeMaps.size() == 0) {
 		drawList.cubeMaps.push_back(defaultCube);
 	}
@@ -237,26 +344,24 @@ int Mode::modeMain() {
 		drawList.textureMaps.push_back(defaultShadow);
 	}
 	
-	//Initialize Vulkan System
-	vulkanSystem.shaderDir = shaderDir;
+	//Initialize the scene in the Vulkan System
 	vulkanSystem.useInstancing = drawList.instancedTransformPools.size() > 0 && useInstancing;
-	vulkanSystem.mainWindow = mainWindow;
-	vulkanSystem.deviceName = deviceName;
 	vulkanSystem.useCulling = culling;
+	vulkanSystem.packVertices = packedVertices;
+	vulkanSystem.useMeshlets = meshlets;
+	vulkanSystem.useLods = lods;
 	vulkanSystem.poolSize = poolSize;
-	vulkanSystem.platform = platform;
 	vulkanSystem.defaultShadowTex = defaultShadow;
 
-	std::chrono::high_resolution_clock::time_point initFirst = std::chrono::high_resolution_clock::now();
-	vulkanSystem.initVulkan(drawList, cameraName);
-	std::chrono::high_resolution_clock::time_point initLast = std::chrono::high_resolution_clock::now();
-	if (verbose) std::cout << "MEASURE init vulkan: " << (float)
-		std::chrono::duration_cast<std::chrono::milliseconds>(
-			initLast - initFirst).count() << "ms" << std::endl;
-	lastFrame = std::chrono::high_resolution_clock::now();
+	{
+		TraceScope scope("init vulkan", verbose);
+		vulkanSystem.initScene(drawList, cameraName);
+	}
+	pacer.targetRate = frameRate;
+	pacer.reset();
 	movementMode = MOVE_USER;
 	vulkanSystem.movementMode = movementMode;
-	vulkanSystem.renderToWindow = true;
+	moveStatus.movementMode = movementMode;
 
 	//Handle headless mode
 	if (!vulkanSystem.renderToWindow) {
@@ -267,6 +372,16 @@ int Mode::modeMain() {
 	//Begin running main loop
 	mainLoop(&graph);
 
+	//Flush frames still in flight and their saves
+	vulkanSystem.finishHeadless();
+	vulkanSystem.stopTextureStreaming();
+
+	//Persist pipelines for the next launch
+	vulkanSystem.idle();
+	vulkanSystem.savePipelineCache();
+
+	Profiler::stop();
+
 	//Clean up vulkan
 	//vulkanSystem.cleanup();
 	return 0;
@@ -4,6 +4,12 @@
 #include "VulkanSystem.h"
 #include "chrono"
 #include "Events.h"
+#include "FramePacer.h"
+#include "TripleBuffer.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+//Input state, written by window events and read by the simulation thread
 struct MoveStatus {
 	bool up = false;
 	bool down = false;
@@ -12,6 +18,9 @@ struct MoveStatus {
 	bool forward = false;
 	bool backward = false;
 	std::pair<int, int> mouseDelta;
+	MovementMode movementMode = MOVE_USER;
+	bool playingAnimation = true;
+	bool forwardAnimation = true;
 };
 class Mode : ProgramMode
 {
@@ -32,6 +41,10 @@ public:
 	bool useInstancing = false;
 	bool verbose = false;
 	bool culling = true;
+	bool packedVertices = false; //Quantized vertex encoding, smaller but lossy
+	bool overdrawOrder = false; //Sort triangle clusters outside in when optimizing meshes
+	bool meshlets = false; //Cull meshlets individually and draw them indirectly
+	bool lods = false; //Simplify meshes and draw coarser levels at a distance
 	int poolSize = MAX_POOL;
 	bool animate = true;
 	std::string sceneName;
@@ -39,13 +52,23 @@ public:
 	std::string deviceName;
 	std::string eventName;
 	std::string shaderDir;
+	std::string traceFile; //Chrome trace output, empty = profiler disabled
+	float frameRate = 60.f; //0 = uncapped
+	VkPresentModeKHR presentMode = VK_PRESENT_MODE_MAILBOX_KHR;
 	
 	HeadlessEvents events;
 private:
 	VulkanSystem vulkanSystem;
 	void mainLoop(SceneGraph* graph);
+	void simLoop(SceneGraph* graph);
+	TripleBuffer<FrameSnapshot> snapshots;
 	MoveStatus moveStatus;
-	std::chrono::high_resolution_clock::time_point lastFrame;
+	std::mutex inputMutex; //Guards moveStatus
+	std::atomic<bool> simRunning{ false };
+	//Uncapped, the simulation waits for rendering to take each snapshot
+	std::mutex snapshotMutex;
+	std::condition_variable snapshotTaken;
+	FramePacer pacer;
 	std::pair<int, int> lastMousePos;
 	bool mouseEventActive = false;
 
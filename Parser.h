@@ -2,6 +2,7 @@
 #include "SceneGraph.h"
 #include "FileHelp.h"
 #include "Events.h"
+#include "Profiler.h"
 
 
 std::string parseName(std::string nameString) {
@@ -44,7 +45,7 @@ private:
 
 	//Helper functions
 	std::vector<uint32_t> parseIndices(std::string indiciesString);
-	std::vector<SceneVertex> parseAttributes(std::vector<std::string> attributeStrings);
+	std::vector<SceneVertex> parseAttributes(std::vector<std::string> attributeStrings, uint32_t& attributes);
 	std::vector<float_4> parseAttribute4(std::string attributeString, bool bit_32, int stride);
 	std::vector<float_2> parseAttribute2(std::string attributeString, int stride);
 	std::map<std::string, int> nameToTexture;
@@ -79,7 +80,8 @@ PartialMaterialData Parser::parseMaterialData(std::string objectString, bool par
 	else if (objectString.size() > 3 && objectString.at(3) == 's') {
 		parsedData.type = PART_TEX;
 		std::string texName = objectString.substr(9, objectString.size() - 10);
-		Texture parsedTex = Texture::parseTexture(texName, parseAsCube);
+		//2D textures are decoded while the first frames are already drawing
+		Texture parsedTex = parseAsCube ? Texture::parseTexture(texName, true) : Texture::deferTexture(texName);
 		std::pair<Texture, std::string> texData = std::make_pair(parsedTex, texName);
 		parsedData.texture = texData;
 	}
@@ -141,11 +143,11 @@ MaterialInt Parser::parseMaterial(std::vector<std::string> jsonObject) {
 		}
 		else if (objLen > 21 && !compString.compare("no")) {
 			std::string texName = objectString.substr(21, objLen - 23);
-			parsedMaterial.normalMap = std::make_pair(Texture::parseTexture(texName,false), texName);
+			parsedMaterial.normalMap = std::make_pair(Texture::deferTexture(texName), texName);
 		}
 		else if (objLen > 27 && !compString.compare("di")) {
 			std::string texName = objectString.substr((27, objLen - 30));
-			parsedMaterial.displacementMap = std::make_pair(Texture::parseTexture(texName,false), texName);
+			parsedMaterial.displacementMap = std::make_pair(Texture::deferTexture(texName), texName);
 		}
 		else if (objLen > 3 && !compString.compare("pb")) {
 			parsedMaterial.type = MAT_PBR;
@@ -505,7 +507,7 @@ std::vector<uint32_t> Parser::parseIndices(std::string indiciesString) {
 }
 
 
-std::vector<SceneVertex> Parser::parseAttributes(std::vector<std::string> attributeStrings) {
+std::vector<SceneVertex> Parser::parseAttributes(std::vector<std::string> attributeStrings, uint32_t& attributes) {
 
 
 	int stride = 0;
@@ -556,6 +558,13 @@ std::vector<SceneVertex> Parser::parseAttributes(std::vector<std::string> attrib
 	if (colorString.has_value()) {
 		colors = parseAttribute4(*colorString, false, stride);
 	}
+	//Record which attributes were found, this decides the layout the mesh is drawn with
+	attributes = 0;
+	if (positionString.has_value()) attributes |= ATTRIBUTE_POSITION;
+	if (normalString.has_value()) attributes |= ATTRIBUTE_NORMAL;
+	if (tangentString.has_value()) attributes |= ATTRIBUTE_TANGENT;
+	if (texcoordsString.has_value()) attributes |= ATTRIBUTE_TEXCOORD;
+	if (colorString.has_value()) attributes |= ATTRIBUTE_COLOR;
 	//Create vertices and insert into vertex pool
 	std::vector<SceneVertex> vertices(positions.size());
 	for (size_t vert = 0; vert < vertices.size(); vert++) {
@@ -715,10 +724,14 @@ std::vector<std::vector<std::string>> Parser::parseToObjects(std::vector<char> r
 
 //Given a desired .s72 file, parse the json file into a SceneGraph structure
 SceneGraph Parser::parseJson(std::string fileName, bool verbose) {
-	std::chrono::high_resolution_clock::time_point start =
-		std::chrono::high_resolution_clock::now();
-	std::vector<char> rawString = readFile(fileName);
-	std::vector<std::vector<std::string>> objects = parseToObjects(rawString);
+	TraceScope parseScope("parse .s72 file", verbose);
+	std::vector<char> rawString;
+	std::vector<std::vector<std::string>> objects;
+	{
+		TRACE_SCOPE("read and split json");
+		rawString = readFile(fileName);
+		objects = parseToObjects(rawString);
+	}
 	SceneGraph parsedGraph;
 	parsedGraph.graphNodes = std::vector<GraphNode>();
 	int id = 0;
@@ -730,6 +743,7 @@ SceneGraph Parser::parseJson(std::string fileName, bool verbose) {
 	std::map<int, int> jsonIdToLightId;
 
 	//Parsed into json objects, handle each object in order
+	TraceScope objectsScope("parse json objects");
 	for (std::vector<std::string> jsonObject : objects) {
 		id++;
 		//Find and parse by type
@@ -783,7 +797,7 @@ SceneGraph Parser::parseJson(std::string fileName, bool verbose) {
 			for (; attributeInd < jsonObject.size() && jsonObject[attributeInd].substr(1, 2).compare("ma"); attributeInd++) {
 				attributeStrings.push_back(jsonObject[attributeInd]);
 			}
-			std::vector<SceneVertex> vertices = parseAttributes(attributeStrings);
+			std::vector<SceneVertex> vertices = parseAttributes(attributeStrings, mesh.attributes);
 			//Parse material
 			if (attributeInd < jsonObject.size()) {
 				mesh.material = atoi(jsonObject[attributeInd].substr(11, jsonObject[attributeInd].size() - 11).c_str());
@@ -905,6 +919,8 @@ SceneGraph Parser::parseJson(std::string fileName, bool verbose) {
 			parsedGraph.environmentMap = Texture::parseTexture(fileName, true);
 		}
 	}
+	objectsScope.stop();
+	TraceScope referencesScope("resolve references");
 	//Reformat reference ids
 	//This could maybe done more efficiently by saving the mapping from json
 	//object order to mesh, node, camera, etc. order
@@ -985,11 +1001,10 @@ SceneGraph Parser::parseJson(std::string fileName, bool verbose) {
 		}
 	}
 
-	std::chrono::high_resolution_clock::time_point end =
-		std::chrono::high_resolution_clock::now();
-	if (verbose) std::cout << "MEASURE parse .s72 file: " << (float)
-		std::chrono::duration_cast<std::chrono::milliseconds>(
-			end - start).count() << "ms" << std::endl;
+	referencesScope.stop();
+	parsedGraph.weldMeshes(verbose);
+	parsedGraph.computeMeshBounds();
+	parseScope.stop();
 	return parsedGraph;
 }
 
@@ -1030,7 +1045,6 @@ HeadlessEvents Parser::parseEvents(std::string fileName) {
 	std::vector<std::string> rawStrings = parseIntoStrings(rawString, false);
 	rawStrings = ensureFormatting(rawStrings);
 	HeadlessEvents events;
-	events.currentEvent = 0;
 	for (std::string eventString : rawStrings) {
 		std::vector<std::string> eventTokens = tokenizeString(eventString);
 		if (eventTokens.size() < 2) {
@@ -1043,7 +1057,7 @@ HeadlessEvents Parser::parseEvents(std::string fileName) {
 			Event newEvent;
 			newEvent.type = EV_AVAILABLE;
 			newEvent.time = time;
-			events.eventsQueue.push_back(newEvent);
+			events.addEvent(newEvent);
 		}
 		else if (typeSize == 4 && !typeString.compare("PLAY")) {
 			if (eventTokens.size() < 4) {
@@ -1056,7 +1070,7 @@ HeadlessEvents Parser::parseEvents(std::string fileName) {
 			newEvent.time = time;
 			newEvent.playbackInfo.time = playbackTime;
 			newEvent.playbackInfo.rate = playbackTrate;
-			events.eventsQueue.push_back(newEvent);
+			events.addEvent(newEvent);
 		}
 		else if (typeSize == 4 && !typeString.compare("SAVE")) {
 			if (eventTokens.size() < 3) {
@@ -1066,7 +1080,7 @@ HeadlessEvents Parser::parseEvents(std::string fileName) {
 			newEvent.type = EV_SAVE;
 			newEvent.time = time;
 			newEvent.saveName = eventTokens[2];
-			events.eventsQueue.push_back(newEvent);
+			events.addEvent(newEvent);
 		}
 		else if (typeSize == 4 && !typeString.compare("MARK")) {
 			if(eventTokens.size() < 3) {
@@ -1080,7 +1094,7 @@ HeadlessEvents Parser::parseEvents(std::string fileName) {
 			newEvent.type = EV_MARK;
 			newEvent.markDescription = description;
 			newEvent.time = time;
-			events.eventsQueue.push_back(newEvent);
+			events.addEvent(newEvent);
 		}
 		else {
 			std::cout << "WARNING: Unsupported event found when parsing events file in Parser." << std::endl;
@@ -0,0 +1,152 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//Scoped CPU profiler that writes Chrome trace event json, open the output in
+//chrome://tracing or ui.perfetto.dev. While disabled a scope costs one flag check.
+//Each thread records into its own buffer, so worker threads show up as their own rows.
+//A buffer's lock is only contended while stop reads it.
+
+struct TraceEvent {
+	std::string name;
+	long long start; //Microseconds since the profiler was started
+	long long duration;
+};
+
+struct TraceThread {
+	uint32_t id;
+	std::string name; //Empty until named, then shown as a worker
+	std::mutex eventsMutex;
+	std::vector<TraceEvent> events;
+};
+
+class Profiler {
+public:
+	static void start(std::string file) {
+		traceFile = file;
+		origin = std::chrono::high_resolution_clock::now();
+		enabled.store(true, std::memory_order_relaxed);
+	}
+
+	static bool isEnabled() {
+		return enabled.load(std::memory_order_relaxed);
+	}
+
+	//Label the calling thread's row in the trace
+	static void nameThread(std::string name) {
+		if (!isEnabled()) return;
+		TraceThread& thread = localThread();
+		std::lock_guard<std::mutex> eventsLock(thread.eventsMutex);
+		thread.name = name;
+	}
+
+	static void record(const char* name, std::chrono::high_resolution_clock::time_point first,
+		std::chrono::high_resolution_clock::time_point last) {
+		TraceEvent event;
+		event.name = name;
+		event.start = std::chrono::duration_cast<std::chrono::microseconds>(first - origin).count();
+		event.duration = std::chrono::duration_cast<std::chrono::microseconds>(last - first).count();
+		TraceThread& thread = localThread();
+		std::lock_guard<std::mutex> eventsLock(thread.eventsMutex);
+		thread.events.push_back(event);
+	}
+
+	//Write every recorded event and disable
+	static void stop() {
+		if (!isEnabled()) return;
+		enabled.store(false, std::memory_order_relaxed);
+		std::lock_guard<std::mutex> lock(threadsMutex);
+		std::ofstream file(traceFile, std::ios::trunc);
+		if (!file.is_open()) {
+			std::cout << "Unable to write trace file " << traceFile << std::endl;
+			return;
+		}
+		file << "{\"traceEvents\":[" << std::endl;
+		bool first = true;
+		for (std::shared_ptr<TraceThread> thread : threads) {
+			std::lock_guard<std::mutex> eventsLock(thread->eventsMutex);
+			if (!first) file << "," << std::endl;
+			first = false;
+			file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread->id <<
+				",\"args\":{\"name\":\"" << escape(thread->name.empty() ? "worker " + std::to_string(thread->id) : thread->name) << "\"}}";
+			for (TraceEvent& event : thread->events) {
+				file << "," << std::endl << "{\"name\":\"" << escape(event.name) << "\",\"cat\":\"cpu\",\"ph\":\"X\",\"ts\":" <<
+					event.start << ",\"dur\":" << event.duration << ",\"pid\":1,\"tid\":" << thread->id << "}";
+			}
+			thread->events.clear();
+		}
+		file << std::endl << "]}" << std::endl;
+		file.close();
+	}
+
+private:
+	static inline std::atomic<bool> enabled{ false };
+	static inline std::chrono::high_resolution_clock::time_point origin;
+	static inline std::string traceFile;
+	static inline std::mutex threadsMutex;
+	static inline std::vector<std::shared_ptr<TraceThread>> threads;
+
+	//Buffers are shared with the thread list so they outlive their thread
+	static TraceThread& localThread() {
+		thread_local std::shared_ptr<TraceThread> local;
+		if (!local) {
+			std::lock_guard<std::mutex> lock(threadsMutex);
+			local = std::make_shared<TraceThread>();
+			local->id = static_cast<uint32_t>(threads.size());
+			threads.push_back(local);
+		}
+		return *local;
+	}
+
+	static std::string escape(const std::string& name) {
+		std::string escaped;
+		for (char c : name) {
+			if (c == '"' || c == '\\') escaped.push_back('\\');
+			escaped.push_back(c);
+		}
+		return escaped;
+	}
+};
+
+//Records the lifetime of the scope, optionally also printing it as a verbose MEASURE line
+class TraceScope {
+public:
+	TraceScope(const char* scopeName, bool measure = false) {
+		name = scopeName;
+		print = measure;
+		active = print || Profiler::isEnabled();
+		if (active) first = std::chrono::high_resolution_clock::now();
+	}
+	~TraceScope() {
+		stop();
+	}
+	//End the scope early, for phases that do not map to a block
+	void stop() {
+		if (!active) return;
+		active = false;
+		std::chrono::high_resolution_clock::time_point last = std::chrono::high_resolution_clock::now();
+		if (Profiler::isEnabled()) Profiler::record(name, first, last);
+		if (print) std::cout << "MEASURE " << name << ": " << (float)
+			std::chrono::duration_cast<std::chrono::milliseconds>(
+				last - first).count() << "ms" << std::endl;
+	}
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+	const char* name;
+	bool print;
+	bool active;
+	std::chrono::high_resolution_clock::time_point first;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
@@ -9,8 +9,14 @@
 #include <algorithm>
 #include <chrono>
 #include <cassert>
+#include <cstring>
+#include <thread>
+#include <functional>
+#include <unordered_map>
+#include <queue>
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+#include "Profiler.h"
 
 
 
@@ -38,41 +44,125 @@ Texture Texture::parseTexture(std::string path, bool cube) {
 	return tex;
 }
 
-//Given a pool of vertices produce a simple bounding sphere: center and radius
-std::pair<float_3, float> DrawNode::produceBoundingSphere(std::vector<Vertex> vertices) {
-	//Find Mesh Center
-	std::pair<float,float> xDomain = std::make_pair(INFINITY,-INFINITY);
-	std::pair<float,float> yDomain = std::make_pair(INFINITY, -INFINITY);
-	std::pair<float,float> zDomain = std::make_pair(INFINITY, -INFINITY);
-	for (Vertex vert : vertices) {
-		if (vert.pos.x < xDomain.first) xDomain.first = vert.pos.x;
-		if (vert.pos.y < yDomain.first) yDomain.first = vert.pos.y;
-		if (vert.pos.z < zDomain.first) zDomain.first = vert.pos.z;
-	}
-	for (Vertex vert : vertices) {
-		if (vert.pos.x > xDomain.second) xDomain.second = vert.pos.x;
-		if (vert.pos.y > yDomain.second) yDomain.second = vert.pos.y;
-		if (vert.pos.z > zDomain.second) zDomain.second = vert.pos.z;
-	}
-	float_3 center = float_3(
-		xDomain.first + (xDomain.second - xDomain.first) / 2.0,
-		yDomain.first + (yDomain.second - yDomain.first) / 2.0,
-		zDomain.first + (zDomain.second - zDomain.first) / 2.0
-	);
-	//Find radius
-	float radius = 0;
-	for (Vertex vert : vertices) {
-		float_3 distVec = vert.pos - center;
-		float dist = distVec.norm();
-		if (dist > radius) radius = dist;
-	}
-	return std::make_pair(center, radius);
+//Read only the header of a 2D texture, the pixels are decoded later by the renderer
+Texture Texture::deferTexture(std::string path) {
+	Texture tex;
+	tex.format = Texture::FORM_LIN;
+	tex.type = Texture::TYPE_2D;
+	int x, y, n;
+	if (!stbi_info(path.c_str(), &x, &y, &n)) {
+		throw std::runtime_error("ERROR: Unable to load texture at path " + path);
+	}
+	tex.x = x;
+	tex.y = y;
+	tex.realY = y;
+	tex.mipLevels = std::floor(std::log2(std::max(x, y))) + 1;
+	tex.path = path;
+	return tex;
+}
+
+//Convert a mesh's parsed vertices into layout V and append them to the pool for that layout
+template <typename V>
+void appendMeshVertices(const std::vector<SceneVertex>& sceneVertices, std::vector<V>& pool) {
+	std::vector<V> meshVertices(sceneVertices.size());
+	for (size_t vert = 0; vert < sceneVertices.size(); vert++) {
+		const SceneVertex& sceneVertex = sceneVertices[vert];
+		meshVertices[vert] = makeVertex<V>(sceneVertex.pos, sceneVertex.normal,
+			sceneVertex.tangent, sceneVertex.texcoord, sceneVertex.color);
+	}
+	pool.reserve(pool.size() + meshVertices.size());
+	pool.insert(pool.end(), meshVertices.begin(), meshVertices.end());
+}
+
+//Split a mesh's triangles, in their cache optimized order, into meshlets of at most
+//MESHLET_TRIANGLES triangles and MESHLET_VERTICES vertices, with bounds and normal cones
+//in mesh space. indexStart is where the mesh's indices begin in their index pool.
+static void appendMeshlets(const std::vector<SceneVertex>& meshVertices, const std::vector<uint32_t>& meshIndices,
+	int indexStart, std::vector<Meshlet>& meshlets) {
+	if (meshIndices.size() % 3 != 0) return;
+	for (uint32_t index : meshIndices) {
+		if (index >= meshVertices.size()) return;
+	}
+	size_t triangleCount = meshIndices.size() / 3;
+	std::vector<size_t> usedBy(meshVertices.size(), SIZE_MAX);
+	size_t first = 0;
+	while (first < triangleCount) {
+		//Grow the meshlet until either limit is reached, usedBy marks vertices with the meshlet's first triangle
+		size_t last = first;
+		std::vector<SceneVertex> clusterVertices;
+		while (last < triangleCount && last - first < MESHLET_TRIANGLES) {
+			size_t added = 0;
+			for (size_t corner = 0; corner < 3; corner++) {
+				uint32_t vert = meshIndices[last * 3 + corner];
+				if (usedBy[vert] != first) {
+					bool repeated = false;
+					for (size_t other = 0; other < corner; other++) {
+						if (meshIndices[last * 3 + other] == vert) repeated = true;
+					}
+					if (!repeated) added++;
+				}
+			}
+			if (clusterVertices.size() + added > MESHLET_VERTICES) break;
+			for (size_t corner = 0; corner < 3; corner++) {
+				uint32_t vert = meshIndices[last * 3 + corner];
+				if (usedBy[vert] == first) continue;
+				usedBy[vert] = first;
+				clusterVertices.push_back(meshVertices[vert]);
+			}
+			last++;
+		}
+
+		Meshlet meshlet;
+		meshlet.indexStart = indexStart + static_cast<int>(first * 3);
+		meshlet.indexCount = static_cast<int>((last - first) * 3);
+		meshlet.boundingSphere = DrawNode::produceBoundingSphere(clusterVertices);
+
+		//The cone axis averages the triangle normals, the cutoff covers the one furthest from it
+		std::vector<float_3> normals;
+		float_3 axis = float_3(0, 0, 0);
+		for (size_t triangle = first; triangle < last; triangle++) {
+			float_3 a = meshVertices[meshIndices[triangle * 3]].pos;
+			float_3 b = meshVertices[meshIndices[triangle * 3 + 1]].pos;
+			float_3 c = meshVertices[meshIndices[triangle * 3 + 2]].pos;
+			float_3 edge = b - a;
+			float_3 normal = edge.cross(c - a);
+			float length = normal.norm();
+			if (length == 0) continue;
+			normal = normal * (1.f / length);
+			normals.push_back(normal);
+			axis = axis + normal;
+		}
+		float axisLength = axis.norm();
+		meshlet.coneAxis = axisLength > 0 ? axis * (1.f / axisLength) : float_3(0, 0, 1);
+		meshlet.coneCutoff = 1;
+		if (axisLength > 0) {
+			float minDot = 1;
+			for (float_3 normal : normals) minDot = fminf(minDot, meshlet.coneAxis.dot(normal));
+			if (minDot > 0) meshlet.coneCutoff = sqrtf(1 - minDot * minDot);
+		}
+		meshlets.push_back(meshlet);
+		first = last;
+	}
+}
+
+//Transform from a node's local space to its parent's
+static mat44<float> nodeLocalTransform(const GraphNode& graphNode) {
+	float_3 scale = graphNode.scale;
+	float_3 translate = graphNode.translate;
+	mat44 scaleMat = mat44<float>(scale.x, 0, 0, 0, 0, scale.y, 0, 0, 0, 0, scale.z, 0, 0, 0, 0, 1);
+	mat44<float> rotScaled = quaternion<float>::rotate(scaleMat, graphNode.rotation);
+	rotScaled.data[3][0] = translate.x;
+	rotScaled.data[3][1] = translate.y;
+	rotScaled.data[3][2] = translate.z;
+	return rotScaled;
 }
 
 //The main recursive function that navigates the scene graphs. Paramaters are as follows
 //cameras - a reference to a vector of all processed draw cameras found in the graph
 //vertices - a reference to the new vertex pool
-//indicies - a referece to the new index pool
+//simpleVertices - a reference to the new vertex pool for meshes without tangents or texcoords
+//indicies - a referece to the new index pool, for meshes too large for 16 bit indices
+//shortIndices - a reference to the new 16 bit index pool
 //node - current node index
 //toWorld - the recursively calculated PARENT transforms from the current node
 //		space to world space
@@ -85,13 +175,17 @@ std::pair<float_3, float> DrawNode::produceBoundingSphere(std::vector<Vertex> ve
 //instancedTransforms - For instanced mesh #x, directly put transform into
 //		instanced transform pool, skipping the need to add to the draw list
 //instancedNormalTransforms - Above but for nromals
+//groupPlacements - For instance group #x, the parent transform of each place its
+//		subtree is reached, which is not navigated any further
 //drawNodes - a reference to the final list of draw nodes. Using a reference
 //		should eliminate "stack" size when not using instances
 void SceneGraph::recurseSceneGraph(
 	std::vector<DrawCamera>& drawCameras,
 	std::vector<Light>& drawLights,
 	std::vector<Vertex>& vertices, 
+	std::vector<SimpleVertex>& simpleVertices,
 	std::vector<uint32_t> & indices,
+	std::vector<uint16_t>& shortIndices,
 	int node, 
 	mat44<float> toWorld, 
 	mat44<float> fromWorld, 
@@ -100,23 +194,24 @@ void SceneGraph::recurseSceneGraph(
 	std::vector<Driver>& cameraDrivers,
 	std::vector<std::vector<mat44<float>>>& instancedTransforms,
 	std::vector<std::vector<mat44<float>>>& instancedNormalTransforms,
+	std::vector<std::vector<mat44<float>>>& groupPlacements,
 	std::vector<DrawNode>& drawNodes) {
 	//Get graph node and related transform information
 	if (node >= graphNodes.size()) {
 		throw std::runtime_error("ERROR: invalid node index in Scene Graph.");
 	}
+	//Grouped subtrees were flattened ahead of time, only where they are placed is needed
+	if (useInstancing && static_cast<size_t>(node) < nodeGroups.size() && nodeGroups[node] >= 0) {
+		groupPlacements[nodeGroups[node]].push_back(toWorld);
+		return;
+	}
 	GraphNode graphNode = graphNodes[node];
 	float_3 scale = graphNode.scale;
 	float_3 translate = graphNode.translate;
 	quaternion<float> rotation = graphNode.rotation;
 	
 	//Transform from local space to world space
-	mat44 scaleMat = mat44<float>(scale.x, 0, 0, 0, 0, scale.y, 0, 0, 0, 0, scale.z, 0, 0, 0, 0, 1);
-	mat44<float> rotScaled = quaternion<float>::rotate(scaleMat, rotation);
-	rotScaled.data[3][0] = translate.x;
-	rotScaled.data[3][1] = translate.y;
-	rotScaled.data[3][2] = translate.z;
-	mat44<float> local = rotScaled;
+	mat44<float> local = nodeLocalTransform(graphNode);
 	mat44 localToWorld = toWorld * local;
 
 	//Produce inverse matrix;
@@ -214,45 +309,80 @@ void SceneGraph::recurseSceneGraph(
 			draw.forAnimate.scale = scale;
 			draw.forAnimate.parent = toWorld;
 			draw.count = mesh.count;
-			draw.start = vertices.size();
-			draw.indexStart = indices.size();
 			if (mesh.material.has_value()) {
 				draw.material = materials[*mesh.material];
 			}
 
-			//Important: Vertices AND indices need to be added in THE ORDER TRAVERSED for the later pooling code to work!
-			//Load vertices and indicies into draw pools
-			//Get vertices
-			std::vector<SceneVertex> meshSceneVertices(vertexPool.begin() + mesh.vertexOffset, vertexPool.begin() + mesh.vertexOffset + draw.count);
-			std::vector<Vertex> meshVertices(meshSceneVertices.size());
-			for (size_t vert = 0; vert < meshSceneVertices.size(); vert++) {
-				meshVertices[vert].color = meshSceneVertices[vert].color;
-				meshVertices[vert].pos = meshSceneVertices[vert].pos;
-				meshVertices[vert].normal = meshSceneVertices[vert].normal;
-				meshVertices[vert].tangent = meshSceneVertices[vert].tangent;
-				meshVertices[vert].texcoord = meshSceneVertices[vert].texcoord;
-				meshVertices[vert].node = drawNode;
-			}
-			vertices.reserve(vertices.size() + meshVertices.size());
-			vertices.insert(vertices.end(), meshVertices.begin(), meshVertices.end());
-			draw.boundingSphere = draw.produceBoundingSphere(meshVertices);
-
-			//Get indices
-			std::vector<uint32_t> meshIndices = std::vector<uint32_t>(mesh.indicies.has_value() ? (uint32_t)mesh.indicies->size() : (uint32_t)mesh.count);
-			if (mesh.indicies.has_value()) {
+			//Each mesh is loaded into the shared pools once, later nodes only reference its range
+			auto range = meshRanges.find(*graphNode.mesh);
+			if (range == meshRanges.end()) {
+				MeshRange meshRange;
+				meshRange.layout = layoutForAttributes(mesh.attributes);
+				//Get vertices in the smallest layout holding the mesh's attributes
+				std::vector<SceneVertex> meshSceneVertices(vertexPool.begin() + mesh.vertexOffset, vertexPool.begin() + mesh.vertexOffset + mesh.count);
+				if (meshRange.layout == LAYOUT_SIMPLE) {
+					meshRange.start = simpleVertices.size();
+					appendMeshVertices(meshSceneVertices, simpleVertices);
+				}
+				else {
+					meshRange.start = vertices.size();
+					appendMeshVertices(meshSceneVertices, vertices);
+				}
 
-				for (int index = 0; index < mesh.indicies->size(); index++) {
-					meshIndices[index] = (*mesh.indicies)[index] + draw.start;
+				//Indices are relative to the mesh, its start is the base vertex of each draw,
+				//so any mesh with up to 2^16 vertices fits 16 bit indices
+				std::vector<uint32_t> meshIndices;
+				if (mesh.indicies.has_value()) {
+					meshIndices = *mesh.indicies;
 				}
-			}
-			else {
-				for (int index = 0; index < mesh.count; index++) {
-					meshIndices[index] = draw.start + index;
+				else {
+					meshIndices.resize(mesh.count);
+					for (int index = 0; index < mesh.count; index++) {
+						meshIndices[index] = index;
+					}
+				}
+				//Simplified levels index the same vertices and follow the full mesh
+				meshRange.lodCount = 1 + static_cast<int>(mesh.lods.size());
+				meshRange.lodIndexCount[0] = meshIndices.size();
+				for (size_t level = 0; level < mesh.lods.size(); level++) {
+					meshRange.lodIndexCount[level + 1] = mesh.lods[level].size();
+					meshIndices.insert(meshIndices.end(), mesh.lods[level].begin(), mesh.lods[level].end());
+				}
+				meshRange.shortIndices = mesh.count <= 65536;
+				if (meshRange.shortIndices) {
+					meshRange.indexStart = shortIndices.size();
+					shortIndices.reserve(shortIndices.size() + meshIndices.size());
+					for (uint32_t index : meshIndices) {
+						shortIndices.push_back(static_cast<uint16_t>(index));
+					}
+				}
+				else {
+					meshRange.indexStart = indices.size();
+					indices.insert(indices.end(), meshIndices.begin(), meshIndices.end());
 				}
+				meshRange.indexCount = meshRange.lodIndexCount[0];
+				meshRange.lodIndexStart[0] = meshRange.indexStart;
+				for (int level = 1; level < meshRange.lodCount; level++) {
+					meshRange.lodIndexStart[level] = meshRange.lodIndexStart[level - 1] + meshRange.lodIndexCount[level - 1];
+				}
+				meshIndices.resize(meshRange.indexCount);
+				meshRange.meshletStart = meshlets.size();
+				appendMeshlets(meshSceneVertices, meshIndices, meshRange.indexStart, meshlets);
+				meshRange.meshletCount = meshlets.size() - meshRange.meshletStart;
+				range = meshRanges.emplace(*graphNode.mesh, meshRange).first;
 			}
-			indices.reserve(indices.size() + meshIndices.size());
-			indices.insert(indices.end(), meshIndices.begin(), meshIndices.end());
-			draw.indexCount = indices.size() - draw.indexStart;
+			draw.layout = range->second.layout;
+			draw.start = range->second.start;
+			draw.indexStart = range->second.indexStart;
+			draw.indexCount = range->second.indexCount;
+			draw.shortIndices = range->second.shortIndices;
+			draw.meshletStart = range->second.meshletStart;
+			draw.meshletCount = range->second.meshletCount;
+			draw.lodCount = range->second.lodCount;
+			memcpy(draw.lodIndexStart, range->second.lodIndexStart, sizeof(draw.lodIndexStart));
+			memcpy(draw.lodIndexCount, range->second.lodIndexCount, sizeof(draw.lodIndexCount));
+			draw.boundingSphere = mesh.boundingSphere;
+			draw.boundingBox = mesh.boundingBox;
 			//insert node into draw list
 			drawNodes.push_back(draw);
 			drawNode++;
@@ -270,7 +400,9 @@ void SceneGraph::recurseSceneGraph(
 			drawCameras, 
 			drawLights,
 			vertices, 
+			simpleVertices,
 			indices, 
+			shortIndices,
 			child, 
 			localToWorld, 
 			worldToLocal, 
@@ -279,26 +411,554 @@ void SceneGraph::recurseSceneGraph(
 			cameraDrivers,
 			instancedTransforms,
 			instancedNormalTransforms,
+			groupPlacements,
 			drawNodes);
 	}
 }
 
 
+//Hash and compare every attribute bit for bit, so only exact duplicates are welded
+struct SceneVertexHash {
+	size_t operator()(const SceneVertex& vertex) const {
+		const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&vertex);
+		uint64_t hash = 14695981039346656037ull;
+		for (size_t byte = 0; byte < sizeof(SceneVertex); byte++) {
+			hash = (hash ^ bytes[byte]) * 1099511628211ull;
+		}
+		return static_cast<size_t>(hash);
+	}
+};
+struct SceneVertexEqual {
+	bool operator()(const SceneVertex& a, const SceneVertex& b) const {
+		return memcmp(&a, &b, sizeof(SceneVertex)) == 0;
+	}
+};
+
+//Split independent per mesh work across threads, returns the number of threads used
+static size_t forEachMeshParallel(size_t meshCount, const char* traceName, const std::function<void(size_t)>& work) {
+	size_t threadCount = std::thread::hardware_concurrency();
+	if (threadCount == 0) threadCount = 1;
+	if (threadCount > meshCount) threadCount = meshCount;
+	std::vector<std::thread> threads;
+	for (size_t thread = 0; thread < threadCount; thread++) {
+		size_t first = meshCount * thread / threadCount;
+		size_t last = meshCount * (thread + 1) / threadCount;
+		threads.push_back(std::thread([first, last, traceName, &work]() {
+			TRACE_SCOPE(traceName);
+			for (size_t meshIdx = first; meshIdx < last; meshIdx++) {
+				work(meshIdx);
+			}
+		}));
+	}
+	for (size_t thread = 0; thread < threads.size(); thread++) {
+		threads[thread].join();
+	}
+	return threadCount;
+}
+
+//Meshes without indices repeat every shared vertex. Deduplicate them and generate
+//index lists once after parsing, so every draw list built from the graph reuses the result.
+//Meshes are independent and split across threads, then the vertex pool is rebuilt in order.
+void SceneGraph::weldMeshes(bool verbose) {
+	TraceScope weldScope("weld meshes", verbose);
+	bool anyUnindexed = false;
+	for (const Mesh& mesh : meshes) {
+		if (!mesh.indicies.has_value()) anyUnindexed = true;
+	}
+	if (!anyUnindexed) return;
+
+	std::vector<std::vector<SceneVertex>> weldedVertices(meshes.size());
+	auto weldMesh = [this, &weldedVertices](size_t meshIdx) {
+		Mesh& mesh = meshes[meshIdx];
+		std::vector<SceneVertex>& welded = weldedVertices[meshIdx];
+		if (mesh.indicies.has_value()) {
+			welded.assign(vertexPool.begin() + mesh.vertexOffset, vertexPool.begin() + mesh.vertexOffset + mesh.count);
+			return;
+		}
+		std::unordered_map<SceneVertex, uint32_t, SceneVertexHash, SceneVertexEqual> unique;
+		unique.reserve(mesh.count);
+		std::vector<uint32_t> indices(mesh.count);
+		for (int vert = 0; vert < mesh.count; vert++) {
+			const SceneVertex& vertex = vertexPool[mesh.vertexOffset + vert];
+			auto found = unique.emplace(vertex, static_cast<uint32_t>(welded.size()));
+			if (found.second) welded.push_back(vertex);
+			indices[vert] = found.first->second;
+		}
+		mesh.indicies = indices;
+	};
+
+	size_t threadCount = forEachMeshParallel(meshes.size(), "weld mesh batch", weldMesh);
+
+	size_t before = vertexPool.size();
+	std::vector<SceneVertex> newPool;
+	for (size_t meshIdx = 0; meshIdx < meshes.size(); meshIdx++) {
+		meshes[meshIdx].vertexOffset = newPool.size();
+		meshes[meshIdx].count = weldedVertices[meshIdx].size();
+		newPool.insert(newPool.end(), weldedVertices[meshIdx].begin(), weldedVertices[meshIdx].end());
+	}
+	vertexPool = std::move(newPool);
+	if (verbose) {
+		std::cout << "MEASURE welded vertices: " << before << " to " << vertexPool.size() <<
+			" across " << meshes.size() << " meshes on " << threadCount << " threads" << std::endl;
+	}
+}
+
+//Bounds of every mesh's vertices, so placing a mesh never rescans them. Welding and
+//reordering only drop duplicates and renumber, so these stay valid through both.
+void SceneGraph::computeMeshBounds() {
+	auto computeBounds = [this](size_t meshIdx) {
+		Mesh& mesh = meshes[meshIdx];
+		const SceneVertex* meshVertices = vertexPool.data() + mesh.vertexOffset;
+		mesh.boundingSphere = DrawNode::produceBoundingSphere(meshVertices, mesh.count);
+		if (mesh.count <= 0) {
+			mesh.boundingBox = std::make_pair(float_3(0, 0, 0), float_3(0, 0, 0));
+			return;
+		}
+		float_3 boundsMin = meshVertices[0].pos;
+		float_3 boundsMax = meshVertices[0].pos;
+		for (int vert = 1; vert < mesh.count; vert++) {
+			float_3 pos = meshVertices[vert].pos;
+			boundsMin = float_3(fminf(boundsMin.x, pos.x), fminf(boundsMin.y, pos.y), fminf(boundsMin.z, pos.z));
+			boundsMax = float_3(fmaxf(boundsMax.x, pos.x), fmaxf(boundsMax.y, pos.y), fmaxf(boundsMax.z, pos.z));
+		}
+		mesh.boundingBox = std::make_pair(boundsMin, boundsMax);
+	};
+	forEachMeshParallel(meshes.size(), "mesh bounds batch", computeBounds);
+}
+
+//Size of the FIFO vertex cache the reordering targets and the statistics model
+static const size_t VERTEX_CACHE_SIZE = 16;
+
+//Average cache miss ratio (misses per triangle) and average transform to vertex ratio
+//(misses per referenced vertex) of an index list run through a FIFO vertex cache
+static std::pair<float, float> vertexCacheStats(const std::vector<uint32_t>& indices, size_t vertexCount) {
+	std::vector<size_t> insertedAt(vertexCount, 0);
+	std::vector<bool> referenced(vertexCount, false);
+	size_t time = VERTEX_CACHE_SIZE + 1;
+	size_t misses = 0;
+	size_t unique = 0;
+	for (uint32_t index : indices) {
+		if (!referenced[index]) {
+			referenced[index] = true;
+			unique++;
+		}
+		if (time - insertedAt[index] > VERTEX_CACHE_SIZE) {
+			insertedAt[index] = time++;
+			misses++;
+		}
+	}
+	size_t triangles = indices.size() / 3;
+	return std::make_pair(triangles == 0 ? 0.f : (float)misses / triangles, unique == 0 ? 0.f : (float)misses / unique);
+}
+
+//Tipsify (Sander, Nehab and Barczak 2007): fan around a vertex, then continue from the
+//candidate that will stay longest in the cache. Triangle order is written to triangleOrder,
+//and the first triangle of each point where locality was lost to clusterStarts.
+static void tipsify(const std::vector<uint32_t>& indices, size_t vertexCount,
+	std::vector<uint32_t>& triangleOrder, std::vector<uint32_t>& clusterStarts) {
+	size_t triangleCount = indices.size() / 3;
+	//Vertex to triangle adjacency
+	std::vector<uint32_t> live(vertexCount, 0);
+	for (uint32_t index : indices) live[index]++;
+	std::vector<uint32_t> adjacencyStart(vertexCount + 1, 0);
+	for (size_t vert = 0; vert < vertexCount; vert++) adjacencyStart[vert + 1] = adjacencyStart[vert] + live[vert];
+	std::vector<uint32_t> adjacency(indices.size());
+	std::vector<uint32_t> adjacencyFill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+	for (size_t index = 0; index < indices.size(); index++) {
+		adjacency[adjacencyFill[indices[index]]++] = static_cast<uint32_t>(index / 3);
+	}
+
+	std::vector<size_t> cacheTime(vertexCount, 0);
+	std::vector<bool> emitted(triangleCount, false);
+	std::vector<uint32_t> deadEnd;
+	std::vector<uint32_t> candidates;
+	size_t time = VERTEX_CACHE_SIZE + 1;
+	size_t cursor = 0;
+	int64_t fanning = vertexCount > 0 ? 0 : -1;
+	bool newCluster = true;
+	triangleOrder.clear();
+	clusterStarts.clear();
+	while (fanning >= 0) {
+		candidates.clear();
+		for (uint32_t adjacent = adjacencyStart[fanning]; adjacent < adjacencyStart[fanning + 1]; adjacent++) {
+			uint32_t triangle = adjacency[adjacent];
+			if (emitted[triangle]) continue;
+			if (newCluster) {
+				clusterStarts.push_back(static_cast<uint32_t>(triangleOrder.size()));
+				newCluster = false;
+			}
+			for (size_t corner = 0; corner < 3; corner++) {
+				uint32_t vert = indices[triangle * 3 + corner];
+				deadEnd.push_back(vert);
+				candidates.push_back(vert);
+				live[vert]--;
+				if (time - cacheTime[vert] > VERTEX_CACHE_SIZE) cacheTime[vert] = time++;
+			}
+			emitted[triangle] = true;
+			triangleOrder.push_back(triangle);
+		}
+
+		//Prefer the candidate with triangles left that stays in the cache the longest
+		int64_t next = -1;
+		int64_t best = -1;
+		for (uint32_t vert : candidates) {
+			if (live[vert] == 0) continue;
+			int64_t priority = 0;
+			if (time - cacheTime[vert] + 2 * live[vert] <= VERTEX_CACHE_SIZE) priority = time - cacheTime[vert];
+			if (priority > best) {
+				best = priority;
+				next = vert;
+			}
+		}
+		//Dead end, fall back to recently used vertices, then to input order
+		if (next == -1) {
+			newCluster = true;
+			while (!deadEnd.empty() && next == -1) {
+				uint32_t vert = deadEnd.back();
+				deadEnd.pop_back();
+				if (live[vert] > 0) next = vert;
+			}
+			while (cursor < vertexCount && next == -1) {
+				if (live[cursor] > 0) next = cursor;
+				cursor++;
+			}
+		}
+		fanning = next;
+	}
+}
+
+//Reorder each mesh's triangles for post-transform cache locality with Tipsify, optionally
+//sort the resulting clusters outside in to reduce overdraw, then renumber vertices in
+//order of first use so vertex fetches stay sequential.
+void SceneGraph::optimizeMeshes(bool overdraw, bool verbose) {
+	TraceScope optimizeScope("optimize meshes", verbose);
+	std::vector<std::string> reports(meshes.size());
+	auto optimizeMesh = [this, overdraw, verbose, &reports](size_t meshIdx) {
+		Mesh& mesh = meshes[meshIdx];
+		if (!mesh.indicies.has_value() || mesh.indicies->size() % 3 != 0 || mesh.count <= 0) return;
+		std::vector<uint32_t>& indices = *mesh.indicies;
+		size_t vertexCount = mesh.count;
+		for (uint32_t index : indices) {
+			if (index >= vertexCount) return;
+		}
+		std::pair<float, float> before = vertexCacheStats(indices, vertexCount);
+
+		std::vector<uint32_t> triangleOrder;
+		std::vector<uint32_t> clusterStarts;
+		tipsify(indices, vertexCount, triangleOrder, clusterStarts);
+
+		//Clusters facing away from the mesh center are drawn first, they tend to occlude the rest
+		if (overdraw && clusterStarts.size() > 1) {
+			const SceneVertex* meshVertices = vertexPool.data() + mesh.vertexOffset;
+			float_3 meshCenter = float_3(0, 0, 0);
+			for (size_t vert = 0; vert < vertexCount; vert++) meshCenter = meshCenter + meshVertices[vert].pos;
+			meshCenter = meshCenter * (1.f / vertexCount);
+			std::vector<std::pair<float, size_t>> clusterKeys(clusterStarts.size());
+			for (size_t cluster = 0; cluster < clusterStarts.size(); cluster++) {
+				size_t first = clusterStarts[cluster];
+				size_t last = cluster + 1 < clusterStarts.size() ? clusterStarts[cluster + 1] : triangleOrder.size();
+				float_3 clusterCenter = float_3(0, 0, 0);
+				float_3 clusterNormal = float_3(0, 0, 0);
+				float clusterArea = 0;
+				for (size_t order = first; order < last; order++) {
+					uint32_t triangle = triangleOrder[order];
+					float_3 a = meshVertices[indices[triangle * 3]].pos;
+					float_3 b = meshVertices[indices[triangle * 3 + 1]].pos;
+					float_3 c = meshVertices[indices[triangle * 3 + 2]].pos;
+					float_3 edge0 = b - a;
+					float_3 areaNormal = edge0.cross(c - a);
+					float area = areaNormal.norm();
+					clusterNormal = clusterNormal + areaNormal;
+					clusterCenter = clusterCenter + (a + b + c) * (area / 3.f);
+					clusterArea += area;
+				}
+				if (clusterArea > 0) clusterCenter = clusterCenter * (1.f / clusterArea);
+				float_3 outward = clusterCenter - meshCenter;
+				clusterKeys[cluster] = std::make_pair(-outward.dot(clusterNormal), cluster);
+			}
+			std::stable_sort(clusterKeys.begin(), clusterKeys.end());
+			std::vector<uint32_t> sortedOrder;
+			sortedOrder.reserve(triangleOrder.size());
+			for (const std::pair<float, size_t>& key : clusterKeys) {
+				size_t first = clusterStarts[key.second];
+				size_t last = key.second + 1 < clusterStarts.size() ? clusterStarts[key.second + 1] : triangleOrder.size();
+				sortedOrder.insert(sortedOrder.end(), triangleOrder.begin() + first, triangleOrder.begin() + last);
+			}
+			triangleOrder = sortedOrder;
+		}
+
+		//Renumber vertices by first use, unreferenced ones go last
+		std::vector<uint32_t> reordered(indices.size());
+		std::vector<uint32_t> remap(vertexCount, UINT32_MAX);
+		uint32_t nextVertex = 0;
+		for (size_t order = 0; order < triangleOrder.size(); order++) {
+			for (size_t corner = 0; corner < 3; corner++) {
+				uint32_t vert = indices[triangleOrder[order] * 3 + corner];
+				if (remap[vert] == UINT32_MAX) remap[vert] = nextVertex++;
+				reordered[order * 3 + corner] = remap[vert];
+			}
+		}
+		for (size_t vert = 0; vert < vertexCount; vert++) {
+			if (remap[vert] == UINT32_MAX) remap[vert] = nextVertex++;
+		}
+		std::vector<SceneVertex> remappedVertices(vertexCount);
+		for (size_t vert = 0; vert < vertexCount; vert++) {
+			remappedVertices[remap[vert]] = vertexPool[mesh.vertexOffset + vert];
+		}
+		std::copy(remappedVertices.begin(), remappedVertices.end(), vertexPool.begin() + mesh.vertexOffset);
+		indices = reordered;
+
+		if (verbose) {
+			std::pair<float, float> after = vertexCacheStats(indices, vertexCount);
+			reports[meshIdx] = "MEASURE mesh " + mesh.name + " ACMR: " + std::to_string(before.first) + " to " +
+				std::to_string(after.first) + ", ATVR: " + std::to_string(before.second) + " to " + std::to_string(after.second);
+		}
+	};
+	forEachMeshParallel(meshes.size(), "optimize mesh batch", optimizeMesh);
+	for (const std::string& report : reports) {
+		if (!report.empty()) std::cout << report << std::endl;
+	}
+}
+
+//Symmetric 4x4 quadric summing squared distances to planes, stored as its upper triangle
+struct Quadric {
+	double q[10] = {};
+	void addPlane(double a, double b, double c, double d) {
+		q[0] += a * a; q[1] += a * b; q[2] += a * c; q[3] += a * d;
+		q[4] += b * b; q[5] += b * c; q[6] += b * d;
+		q[7] += c * c; q[8] += c * d;
+		q[9] += d * d;
+	}
+	void add(const Quadric& other) {
+		for (int entry = 0; entry < 10; entry++) q[entry] += other.q[entry];
+	}
+	double error(float_3 point) const {
+		double x = point.x, y = point.y, z = point.z;
+		return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x +
+			q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y +
+			q[7] * z * z + 2 * q[8] * z + q[9];
+	}
+};
+
+struct Collapse {
+	double cost;
+	uint32_t from;
+	uint32_t to;
+	bool operator>(const Collapse& other) const {
+		return cost > other.cost;
+	}
+};
+
+//Quadric error metric simplification (Garland and Heckbert 1997) by half edge collapses, so
+//every level reuses the mesh's own vertices. Boundary vertices, which include the attribute
+//seams welding leaves apart, never move. Produces an index list per target triangle count,
+//stopping early once the cheapest remaining collapse costs more than maxError.
+static std::vector<std::vector<uint32_t>> simplifyMesh(const SceneVertex* vertices, size_t vertexCount,
+	const std::vector<uint32_t>& indices, const std::vector<size_t>& targets, double maxError) {
+	std::vector<std::vector<uint32_t>> levels;
+	size_t triangleCount = indices.size() / 3;
+	std::vector<uint32_t> triangles = indices;
+	std::vector<bool> triangleAlive(triangleCount, true);
+	std::vector<std::vector<uint32_t>> vertexTriangles(vertexCount);
+	std::vector<Quadric> quadrics(vertexCount);
+	std::unordered_map<uint64_t, int> edgeUses;
+	for (size_t triangle = 0; triangle < triangleCount; triangle++) {
+		float_3 a = vertices[triangles[triangle * 3]].pos;
+		float_3 b = vertices[triangles[triangle * 3 + 1]].pos;
+		float_3 c = vertices[triangles[triangle * 3 + 2]].pos;
+		float_3 edge = b - a;
+		float_3 normal = edge.cross(c - a);
+		float length = normal.norm();
+		if (length > 0) normal = normal * (1.f / length);
+		double d = -(double)normal.dot(a);
+		for (size_t corner = 0; corner < 3; corner++) {
+			uint32_t vert = triangles[triangle * 3 + corner];
+			uint32_t next = triangles[triangle * 3 + (corner + 1) % 3];
+			vertexTriangles[vert].push_back(static_cast<uint32_t>(triangle));
+			if (length > 0) quadrics[vert].addPlane(normal.x, normal.y, normal.z, d);
+			uint64_t key = ((uint64_t)std::min(vert, next) << 32) | std::max(vert, next);
+			edgeUses[key]++;
+		}
+	}
+	//Edges used by a single triangle are on the boundary
+	std::vector<bool> locked(vertexCount, false);
+	for (const std::pair<const uint64_t, int>& edge : edgeUses) {
+		if (edge.second != 1) continue;
+		locked[edge.first >> 32] = true;
+		locked[edge.first & 0xffffffff] = true;
+	}
+
+	std::vector<bool> removed(vertexCount, false);
+	std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> collapses;
+	auto collapseCost = [&](uint32_t from, uint32_t to) {
+		Quadric merged = quadrics[from];
+		merged.add(quadrics[to]);
+		return merged.error(vertices[to].pos);
+	};
+	auto pushEdges = [&](uint32_t vert) {
+		for (uint32_t triangle : vertexTriangles[vert]) {
+			if (!triangleAlive[triangle]) continue;
+			for (size_t corner = 0; corner < 3; corner++) {
+				uint32_t other = triangles[triangle * 3 + corner];
+				if (other == vert) continue;
+				if (!locked[vert]) collapses.push({ collapseCost(vert, other), vert, other });
+				if (!locked[other]) collapses.push({ collapseCost(other, vert), other, vert });
+			}
+		}
+	};
+	for (size_t vert = 0; vert < vertexCount; vert++) {
+		if (!locked[vert]) pushEdges(static_cast<uint32_t>(vert));
+	}
+
+	size_t aliveCount = triangleCount;
+	bool exhausted = false;
+	for (size_t target : targets) {
+		while (aliveCount > target && !collapses.empty()) {
+			Collapse collapse = collapses.top();
+			collapses.pop();
+			if (removed[collapse.from] || removed[collapse.to]) continue;
+			//Quadrics only grow, so a stale entry can only be too cheap
+			double cost = collapseCost(collapse.from, collapse.to);
+			if (cost > collapse.cost * (1 + 1e-9) + 1e-12) {
+				collapses.push({ cost, collapse.from, collapse.to });
+				continue;
+			}
+			if (cost > maxError) {
+				exhausted = true;
+				break;
+			}
+			//The edge must still exist, and no remaining triangle may flip
+			bool shared = false;
+			bool flips = false;
+			for (uint32_t triangle : vertexTriangles[collapse.from]) {
+				if (!triangleAlive[triangle]) continue;
+				uint32_t* corners = triangles.data() + triangle * 3;
+				if (corners[0] == collapse.to || corners[1] == collapse.to || corners[2] == collapse.to) {
+					shared = true;
+					continue;
+				}
+				float_3 before[3];
+				float_3 after[3];
+				for (size_t corner = 0; corner < 3; corner++) {
+					before[corner] = vertices[corners[corner]].pos;
+					after[corner] = corners[corner] == collapse.from ? vertices[collapse.to].pos : before[corner];
+				}
+				float_3 beforeEdge = before[1] - before[0];
+				float_3 afterEdge = after[1] - after[0];
+				float_3 beforeNormal = beforeEdge.cross(before[2] - before[0]);
+				float_3 afterNormal = afterEdge.cross(after[2] - after[0]);
+				if (beforeNormal.dot(afterNormal) <= 0) flips = true;
+			}
+			if (!shared || flips) continue;
+
+			for (uint32_t triangle : vertexTriangles[collapse.from]) {
+				if (!triangleAlive[triangle]) continue;
+				uint32_t* corners = triangles.data() + triangle * 3;
+				if (corners[0] == collapse.to || corners[1] == collapse.to || corners[2] == collapse.to) {
+					triangleAlive[triangle] = false;
+					aliveCount--;
+					continue;
+				}
+				for (size_t corner = 0; corner < 3; corner++) {
+					if (corners[corner] == collapse.from) corners[corner] = collapse.to;
+				}
+				vertexTriangles[collapse.to].push_back(triangle);
+			}
+			quadrics[collapse.to].add(quadrics[collapse.from]);
+			removed[collapse.from] = true;
+			vertexTriangles[collapse.from].clear();
+			std::vector<uint32_t>& toTriangles = vertexTriangles[collapse.to];
+			toTriangles.erase(std::remove_if(toTriangles.begin(), toTriangles.end(),
+				[&](uint32_t triangle) { return !triangleAlive[triangle]; }), toTriangles.end());
+			pushEdges(collapse.to);
+		}
+		if (aliveCount == triangleCount) break;
+		std::vector<uint32_t> level;
+		level.reserve(aliveCount * 3);
+		for (size_t triangle = 0; triangle < triangleCount; triangle++) {
+			if (!triangleAlive[triangle]) continue;
+			level.insert(level.end(), triangles.begin() + triangle * 3, triangles.begin() + triangle * 3 + 3);
+		}
+		levels.push_back(level);
+		if (exhausted || collapses.empty()) break;
+	}
+	return levels;
+}
+
+//Simplify every indexed mesh into up to MAX_LODS - 1 coarser index lists over its own
+//vertices, each targeting half the triangles of the last. A level is only kept if it is
+//noticeably smaller, and each is cache optimized like the full mesh.
+void SceneGraph::buildMeshLods(bool verbose) {
+	TraceScope lodScope("build mesh lods", verbose);
+	std::vector<std::string> reports(meshes.size());
+	auto buildLods = [this, verbose, &reports](size_t meshIdx) {
+		Mesh& mesh = meshes[meshIdx];
+		mesh.lods.clear();
+		if (!mesh.indicies.has_value() || mesh.indicies->size() % 3 != 0 || mesh.count <= 0) return;
+		const std::vector<uint32_t>& indices = *mesh.indicies;
+		size_t triangleCount = indices.size() / 3;
+		if (triangleCount < LOD_MIN_TRIANGLES) return;
+		size_t vertexCount = mesh.count;
+		for (uint32_t index : indices) {
+			if (index >= vertexCount) return;
+		}
+		const SceneVertex* meshVertices = vertexPool.data() + mesh.vertexOffset;
+
+		//Errors are limited relative to the mesh's size
+		float_3 extent = mesh.boundingBox.second - mesh.boundingBox.first;
+		double maxError = LOD_MAX_ERROR * extent.norm();
+		maxError *= maxError;
+
+		std::vector<size_t> targets;
+		for (size_t level = 1; level < MAX_LODS; level++) {
+			targets.push_back(triangleCount >> level);
+		}
+		std::vector<std::vector<uint32_t>> levels = simplifyMesh(meshVertices, vertexCount, indices, targets, maxError);
+		size_t previous = triangleCount;
+		std::string report = "MEASURE mesh " + mesh.name + " LOD triangles: " + std::to_string(triangleCount);
+		for (std::vector<uint32_t>& level : levels) {
+			size_t levelTriangles = level.size() / 3;
+			if (levelTriangles == 0 || levelTriangles * 4 > previous * 3) continue;
+			std::vector<uint32_t> triangleOrder;
+			std::vector<uint32_t> clusterStarts;
+			tipsify(level, vertexCount, triangleOrder, clusterStarts);
+			std::vector<uint32_t> reordered;
+			reordered.reserve(level.size());
+			for (uint32_t triangle : triangleOrder) {
+				reordered.insert(reordered.end(), level.begin() + triangle * 3, level.begin() + triangle * 3 + 3);
+			}
+			mesh.lods.push_back(reordered);
+			previous = levelTriangles;
+			report += " " + std::to_string(levelTriangles);
+		}
+		if (verbose) reports[meshIdx] = report;
+	};
+	forEachMeshParallel(meshes.size(), "build lod batch", buildLods);
+	for (const std::string& report : reports) {
+		if (!report.empty()) std::cout << report << std::endl;
+	}
+}
+
 //Recurse scene graph from all root nodes and then return intermediate information
 DrawListIntermediate SceneGraph::navigateSceneGraphInt(int instanceSize) {
 	DrawListIntermediate drawList;
 	drawList.vertexPool = std::vector<Vertex>();
+	drawList.simpleVertexPool = std::vector<SimpleVertex>();
 	drawList.lights = std::vector<Light>();
 	drawList.indexPool = std::vector<uint32_t>();
+	drawList.shortIndexPool = std::vector<uint16_t>();
 	drawList.cameras = std::vector<DrawCamera>();
 	drawList.drawPool = std::vector<DrawNode>();
 	drawList.cameraDrivers = std::vector<Driver>();
 	drawList.nodeDrivers = std::vector<Driver>();
 	drawList.instancedTransforms = std::vector < std::vector<mat44<float>>>(instanceSize);
 	drawList.instancedNormalTransforms = std::vector < std::vector<mat44<float>>>(instanceSize);
+	drawList.groupPlacements = std::vector<std::vector<mat44<float>>>(instanceGroups.size());
 	drawList.textureMaps = textureMaps;
 	drawList.cubeMaps = cubeMaps;
 	drawList.environmentMap = environmentMap;
+	meshRanges.clear();
+	meshlets.clear();
 	int drawNode = 0;
 	for (int root : roots) {
 		std::vector<DrawNode> rootList;
@@ -306,7 +966,9 @@ DrawListIntermediate SceneGraph::navigateSceneGraphInt(int instanceSize) {
 			drawList.cameras,
 			drawList.lights,
 			drawList.vertexPool,
+			drawList.simpleVertexPool,
 			drawList.indexPool,
+			drawList.shortIndexPool,
 			root,
 			mat44<float>(1),
 			mat44<float>(1),
@@ -315,6 +977,7 @@ DrawListIntermediate SceneGraph::navigateSceneGraphInt(int instanceSize) {
 			drawList.cameraDrivers,
 			drawList.instancedTransforms,
 			drawList.instancedNormalTransforms,
+			drawList.groupPlacements,
 			rootList);
 		drawList.drawPool.reserve(drawList.drawPool.size() + rootList.size());
 		drawList.drawPool.insert(drawList.drawPool.end(), rootList.begin(), rootList.end());
@@ -326,14 +989,26 @@ DrawListIntermediate SceneGraph::navigateSceneGraphInt(int instanceSize) {
 		drawList.normalTransforms.push_back(node.normalTransform);
 	}
 	drawList.worldToEnvironment = worldToEnvironment;
+	drawList.meshlets = meshlets;
 	return drawList;
 }
 
-//Find which meshes should be instanced and which should use drawnodes
-void SceneGraph::navigateSceneGraphMeshes(std::vector<bool>& encountered, int node) {
+//Find which meshes should be instanced and which should use drawnodes. Each node is visited
+//once, a node referenced more than once repeats every mesh below it. Repeated subtrees that
+//can be grouped are recorded instead of descended into, their meshes are marked when flattened.
+void SceneGraph::navigateSceneGraphMeshes(std::vector<bool>& encountered, std::vector<bool>& visited,
+	const std::vector<int>& references, int node, bool repeated) {
+	if (visited[node]) return;
+	visited[node] = true;
+	repeated = repeated || references[node] > 1;
+	if (references[node] > 1 && !environmentMap.has_value() && staticSubtree(node)) {
+		nodeGroups[node] = static_cast<int>(instanceGroups.size());
+		instanceGroups.push_back({ node });
+		return;
+	}
 	if (graphNodes[node].mesh.has_value()) {
 		int meshId = *graphNodes[node].mesh;
-		if (encountered[meshId]) {
+		if (encountered[meshId] || repeated) {
 			meshes[meshId].instanceMesh = true;
 		}
 		else {
@@ -341,7 +1016,74 @@ void SceneGraph::navigateSceneGraphMeshes(std::vector<bool>& encountered, int no
 		}
 	}
 	for (int child : graphNodes[node].children) {
-		navigateSceneGraphMeshes(encountered, child);
+		navigateSceneGraphMeshes(encountered, visited, references, child, repeated);
+	}
+}
+
+//True if nothing below the node is animated, is a camera or light, or places the environment
+bool SceneGraph::staticSubtree(int node) {
+	if (staticNodes[node] >= 0) return staticNodes[node] == 1;
+	const GraphNode& graphNode = graphNodes[node];
+	bool isStatic = !graphNode.camera.has_value() && !graphNode.light.has_value() && !graphNode.hasEnvironment &&
+		!graphNode.translateDriver.has_value() && !graphNode.rotateDriver.has_value() && !graphNode.scaleDriver.has_value();
+	for (size_t child = 0; child < graphNode.children.size() && isStatic; child++) {
+		isStatic = staticSubtree(graphNode.children[child]);
+	}
+	staticNodes[node] = isStatic ? 1 : 0;
+	return isStatic;
+}
+
+//Every mesh below a node with its transforms into the node's parent space. Results are kept
+//per node, so a subtree repeated inside another is only flattened once.
+const std::map<int, std::vector<mat44<float>>>& SceneGraph::flattenSubtree(int node,
+	std::map<int, std::map<int, std::vector<mat44<float>>>>& flattened) {
+	auto found = flattened.find(node);
+	if (found != flattened.end()) return found->second;
+	const GraphNode& graphNode = graphNodes[node];
+	mat44<float> local = nodeLocalTransform(graphNode);
+	std::map<int, std::vector<mat44<float>>> members;
+	if (graphNode.mesh.has_value()) members[*graphNode.mesh].push_back(local);
+	for (int child : graphNode.children) {
+		for (const std::pair<const int, std::vector<mat44<float>>>& childMember : flattenSubtree(child, flattened)) {
+			std::vector<mat44<float>>& transforms = members[childMember.first];
+			transforms.reserve(transforms.size() + childMember.second.size());
+			for (mat44<float> transform : childMember.second) {
+				transforms.push_back(local * transform);
+			}
+		}
+	}
+	return flattened.emplace(node, std::move(members)).first->second;
+}
+
+//Groups only depend on the graph's structure and unanimated transforms, so they are built once
+void SceneGraph::buildInstanceGroups() {
+	if (instanceGroupsBuilt) return;
+	instanceGroupsBuilt = true;
+	std::vector<int> references(graphNodes.size(), 0);
+	for (int root : roots) references[root]++;
+	for (const GraphNode& graphNode : graphNodes) {
+		for (int child : graphNode.children) references[child]++;
+	}
+	staticNodes = std::vector<int8_t>(graphNodes.size(), -1);
+	nodeGroups = std::vector<int>(graphNodes.size(), -1);
+	instanceGroups.clear();
+	std::vector<bool> encounteredMesh = std::vector<bool>(meshes.size(), false);
+	std::vector<bool> visited = std::vector<bool>(graphNodes.size(), false);
+	for (int root : roots) {
+		navigateSceneGraphMeshes(encounteredMesh, visited, references, root, false);
+	}
+
+	std::map<int, std::map<int, std::vector<mat44<float>>>> flattened;
+	for (InstanceGroup& group : instanceGroups) {
+		group.members = flattenSubtree(group.node, flattened);
+		//The group's own local transform is applied as part of each member
+		for (const std::pair<const int, std::vector<mat44<float>>>& member : group.members) {
+			meshes[member.first].instanceMesh = true;
+		}
+	}
+	//Groups without any mesh have nothing to draw
+	for (size_t group = 0; group < instanceGroups.size(); group++) {
+		if (instanceGroups[group].members.empty()) nodeGroups[instanceGroups[group].node] = -1;
 	}
 }
 
@@ -435,28 +1177,47 @@ DrawMaterial processMaterial(std::optional<Material> matOpt) {
 	return drawMat;
 }
 
+//Grow a world space box to hold a bounding sphere placed by toWorld, scaling the
+//radius by the largest axis scale of the transform
+static void growSceneBounds(float_3& sceneMin, float_3& sceneMax, bool& sceneEmpty,
+	std::pair<float_3, float> sphere, mat44<float> toWorld) {
+	float_3 center = toWorld * sphere.first;
+	float scale = 0;
+	for (int axis = 0; axis < 3; axis++) {
+		float_3 column = float_3(toWorld.data[axis][0], toWorld.data[axis][1], toWorld.data[axis][2]);
+		scale = std::max(scale, column.norm());
+	}
+	float radius = sphere.second * scale;
+	float_3 nodeMin = center - float_3(radius, radius, radius);
+	float_3 nodeMax = center + float_3(radius, radius, radius);
+	if (sceneEmpty) {
+		sceneMin = nodeMin; sceneMax = nodeMax;
+		sceneEmpty = false;
+	}
+	else {
+		sceneMin = float_3(std::min(sceneMin.x, nodeMin.x), std::min(sceneMin.y, nodeMin.y), std::min(sceneMin.z, nodeMin.z));
+		sceneMax = float_3(std::max(sceneMax.x, nodeMax.x), std::max(sceneMax.y, nodeMax.y), std::max(sceneMax.z, nodeMax.z));
+	}
+}
+
 DrawList SceneGraph::navigateSceneGraph(bool verbose, int poolSize) {
 	if (poolSize > maxPool) {
 		throw std::runtime_error("ERROR: pool size requested by the user is larger than the maximum definable in a SceneGraph. " + maxPool);
 	}
-	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	TraceScope navigateScope("scene graph navigate", verbose);
 	DrawList list;
 	list.useInstancing = useInstancing;
 	std::vector<std::pair<std::string, int>> instancedMeshNamesAndIndex = std::vector<std::pair<std::string,int>>();
-	std::vector<std::pair<size_t, size_t>> meshStartsSizes = std::vector<std::pair<size_t, size_t>>();
 	//If instancing is requested, handle first and seperately
 	if (useInstancing) {
-		std::vector<bool> encounteredMesh = std::vector<bool>(meshes.size());
-		for (int i = 0; i < encounteredMesh.size(); i++) encounteredMesh[i] = false;
-		for (int root : roots) {
-			navigateSceneGraphMeshes(encounteredMesh,root);
-		}
+		buildInstanceGroups();
 		for (size_t i = 0; i < meshes.size(); i++) {
 			if (meshes[i].instanceMesh) {
 				instancedMeshNamesAndIndex.push_back(std::make_pair(meshes[i].name,i));
 			}
 		}
 		list.instancedIndexPools = std::vector<std::vector<uint32_t>>(instancedMeshNamesAndIndex.size());
+		list.instancedLodRanges = std::vector<std::vector<std::pair<uint32_t, uint32_t>>>(instancedMeshNamesAndIndex.size());
 		for (size_t ind = 0; ind < instancedMeshNamesAndIndex.size(); ind++) {
 			instancedToPool[instancedMeshNamesAndIndex[ind].first] = ind;
 
@@ -464,11 +1225,10 @@ DrawList SceneGraph::navigateSceneGraph(bool verbose, int poolSize) {
 			std::vector<SceneVertex> meshSceneVertices(vertexPool.begin() + mesh.vertexOffset, vertexPool.begin() + mesh.vertexOffset + mesh.count);
 			std::vector<Vertex> meshVertices(meshSceneVertices.size());
 			for (size_t vert = 0; vert < meshSceneVertices.size(); vert++) {
-				meshVertices[vert].color = meshSceneVertices[vert].color;
+				meshVertices[vert].color = packColor(meshSceneVertices[vert].color);
 				meshVertices[vert].pos = meshSceneVertices[vert].pos;
 				meshVertices[vert].normal = meshSceneVertices[vert].normal;
 			}
-			meshStartsSizes.push_back(std::make_pair(list.instancedVertexPool.size(), meshVertices.size()));
 			list.instancedVertexPool.reserve(list.instancedIndexPools.size() + meshVertices.size());
 			list.instancedVertexPool.insert(list.instancedVertexPool.end(), meshVertices.begin(), meshVertices.end());
 			if (mesh.indicies.has_value()){
@@ -479,6 +1239,11 @@ DrawList SceneGraph::navigateSceneGraph(bool verbose, int poolSize) {
 					list.instancedIndexPools[ind].push_back(index);
 				}
 			}
+			list.instancedLodRanges[ind].push_back(std::make_pair(0, list.instancedIndexPools[ind].size()));
+			for (const std::vector<uint32_t>& lod : mesh.lods) {
+				list.instancedLodRanges[ind].push_back(std::make_pair(list.instancedIndexPools[ind].size(), lod.size()));
+				list.instancedIndexPools[ind].insert(list.instancedIndexPools[ind].end(), lod.begin(), lod.end());
+			}
 			if (mesh.material.has_value()) {
 				list.instancedMaterials.push_back(processMaterial(materials[*mesh.material]));
 			}
@@ -502,13 +1267,9 @@ DrawList SceneGraph::navigateSceneGraph(bool verbose, int poolSize) {
 			previousLast = nextLast + 1;
 		}
 		
-		//Create bounding spheres
-		for (size_t pool = 0; pool < meshStartsSizes.size(); pool++) {
-			size_t start = meshStartsSizes[pool].first;
-			size_t end = meshStartsSizes[pool].first + meshStartsSizes[pool].second;
-			std::vector<Vertex> vertices = std::vector<Vertex>(list.instancedVertexPool.begin() + start
-				, list.instancedVertexPool.begin() + end);
-			list.instancedBoundingSpheres.push_back(DrawNode::produceBoundingSphere(vertices));
+		//Bounding spheres were computed with the meshes
+		for (size_t pool = 0; pool < instancedMeshNamesAndIndex.size(); pool++) {
+			list.instancedBoundingSpheres.push_back(meshes[instancedMeshNamesAndIndex[pool].second].boundingSphere);
 		}
 	}
 	//Get intermediate parsed data annd do final parsing
@@ -517,6 +1278,7 @@ DrawList SceneGraph::navigateSceneGraph(bool verbose, int poolSize) {
 	list.cameraDrivers = intermediate.cameraDrivers;
 	list.nodeDrivers = intermediate.nodeDrivers;
 	list.vertexPool = intermediate.vertexPool;
+	list.simpleVertexPool = intermediate.simpleVertexPool;
 	list.textureMaps = intermediate.textureMaps;
 	list.cubeMaps = intermediate.cubeMaps;
 	list.environmentMap = intermediate.environmentMap;
@@ -530,16 +1292,17 @@ DrawList SceneGraph::navigateSceneGraph(bool verbose, int poolSize) {
 	std::vector<mat44<float>> traNormInter = intermediate.normalTransforms;
 	std::vector<std::vector<mat44<float>>> instTraInter = intermediate.instancedTransforms;
 	std::vector<std::vector<mat44<float>>> instTraNormInter = intermediate.instancedNormalTransforms;
-	std::vector<uint32_t> indInter = intermediate.indexPool;
 	list.transformPools = std::vector<std::vector<mat44<float>>>();
 	list.instancedTransformPools = std::vector<std::vector<mat44<float>>>();
 	list.normalTransformPools = std::vector<std::vector<mat44<float>>>();
 	list.instancedNormalTransformPools = std::vector<std::vector<mat44<float>>>();
-	list.indexPools = std::vector<std::vector<uint32_t>>();
+	list.indexPool = intermediate.indexPool;
+	list.shortIndexPool = intermediate.shortIndexPool;
+	list.meshlets = intermediate.meshlets;
 	list.drawPools = std::vector<std::vector<DrawNode>>();
 	
 
-	//Produce pools and update indexes appropriately
+	//Produce pools, draw nodes keep their ranges into the shared index pool
 	int begin = 0; int end = 1;
 	for (; end <= intermediate.drawPool.size(); end++) {
 		if (end - begin == poolSize || (end == intermediate.drawPool.size())) {
@@ -555,14 +1318,6 @@ DrawList SceneGraph::navigateSceneGraph(bool verbose, int poolSize) {
 			normalTransforms.insert(normalTransforms.begin(), traNormInter.begin() + begin, traNormInter.begin() + end);
 			list.transformPools.push_back(transforms);
 			list.normalTransformPools.push_back(normalTransforms);
-			int indexStart = drawPool.begin()->indexStart;
-			int indexEnd = drawPool[poolSize - 1].indexStart + drawPool[poolSize - 1].indexCount;
-			std::vector<uint32_t> indexPool; indexPool.reserve(indexEnd - indexStart);
-			indexPool.insert(
-				indexPool.begin(), 
-				indInter.begin() + indexStart, 
-				indInter.begin() + indexEnd);
-			list.indexPools.push_back(indexPool);
 			begin = end;
 		}
 	}
@@ -575,49 +1330,72 @@ DrawList SceneGraph::navigateSceneGraph(bool verbose, int poolSize) {
 			list.instancedTransformPools.push_back(subPool);
 			list.instancedTransformIndexPools.push_back(pool);
 			list.instancedNormalTransformPools.push_back(subPoolNormal);
+			list.instancedPlacementPools.push_back(std::vector<mat44<float>>());
+			list.instancedGroupBounds.push_back(std::make_pair(float_3(0, 0, 0), 0.f));
+			list.instancedMemberRadii.push_back(0);
 		}
 	}
-
-	//Update index counts in each drawPool
-	for (int i = 0; i < list.drawPools.size(); i++) {
-		int indexStart = list.drawPools[i][0].indexStart;
-		for (size_t j = 0; j < list.drawPools[i].size(); j++) {
-			list.drawPools[i][j].indexStart -= indexStart;
-		}
-	}
-	int lastNode = -1;
-	for (size_t i = 0; i < list.indexPools.size(); i++) {
-		auto& pool = list.indexPools[i];
-		for (size_t j = 0; j < pool.size(); j++) {
-			auto index = pool[j];
-			Vertex vert = list.vertexPool[index];
-			if (vert.node != lastNode) {
-				assert(vert.node == lastNode + 1);
-				lastNode = vert.node;
+	//Each mesh of an instance group gets its own pools of transforms relative to the group,
+	//all drawn once per placement of the group
+	size_t groupPlacementCount = 0;
+	size_t groupMemberCount = 0;
+	size_t groupExpandedCount = 0;
+	for (size_t group = 0; group < intermediate.groupPlacements.size(); group++) {
+		const std::vector<mat44<float>>& placements = intermediate.groupPlacements[group];
+		if (placements.empty()) continue;
+		groupPlacementCount += placements.size();
+		for (const std::pair<const int, std::vector<mat44<float>>>& member : instanceGroups[group].members) {
+			const Mesh& mesh = meshes[member.first];
+			const std::vector<mat44<float>>& locals = member.second;
+			groupMemberCount += locals.size();
+			groupExpandedCount += locals.size() * placements.size();
+			for (size_t index = 0; index < locals.size(); index += poolSize) {
+				size_t size = index + poolSize > locals.size() ? locals.size() - index : poolSize;
+				std::vector<mat44<float>> subPool = std::vector<mat44<float>>(locals.begin() + index, locals.begin() + index + size);
+				std::vector<mat44<float>> subPoolNormal;
+				subPoolNormal.reserve(size);
+				//Bound every instance's sphere with one sphere around their box
+				float_3 boundsMin = float_3(INFINITY, INFINITY, INFINITY);
+				float_3 boundsMax = float_3(-INFINITY, -INFINITY, -INFINITY);
+				std::vector<std::pair<float_3, float>> spheres;
+				spheres.reserve(size);
+				float memberRadius = 0;
+				for (mat44<float> transform : subPool) {
+					subPoolNormal.push_back(mat44<float>::inverse(transform).transpose());
+					float scale = 0;
+					for (int axis = 0; axis < 3; axis++) {
+						float_3 column = float_3(transform.data[axis][0], transform.data[axis][1], transform.data[axis][2]);
+						scale = std::max(scale, column.norm());
+					}
+					float_3 center = transform * mesh.boundingSphere.first;
+					float radius = mesh.boundingSphere.second * scale;
+					spheres.push_back(std::make_pair(center, radius));
+					memberRadius = std::max(memberRadius, radius);
+					boundsMin = float_3(std::min(boundsMin.x, center.x - radius), std::min(boundsMin.y, center.y - radius),
+						std::min(boundsMin.z, center.z - radius));
+					boundsMax = float_3(std::max(boundsMax.x, center.x + radius), std::max(boundsMax.y, center.y + radius),
+						std::max(boundsMax.z, center.z + radius));
+				}
+				float_3 groupCenter = (boundsMin + boundsMax) * 0.5f;
+				float groupRadius = 0;
+				for (std::pair<float_3, float>& sphere : spheres) {
+					float_3 offset = sphere.first - groupCenter;
+					groupRadius = std::max(groupRadius, offset.norm() + sphere.second);
+				}
+				list.instancedTransformPools.push_back(subPool);
+				list.instancedTransformIndexPools.push_back(instancedToPool[mesh.name]);
+				list.instancedNormalTransformPools.push_back(subPoolNormal);
+				list.instancedPlacementPools.push_back(placements);
+				list.instancedGroupBounds.push_back(std::make_pair(groupCenter, groupRadius));
+				list.instancedMemberRadii.push_back(memberRadius);
 			}
 		}
 	}
-	//Update vertex node ids
-	for (int pool = 0; pool < list.indexPools.size(); pool++) {
-		//Since vertices and indices are stored in order traveresed,
-		//This can be safely assumed. IF this rule is broken, this could
-		//casue errors, but its easier to just sort the data when being
-		//proccessed then trying to do it here
-		int nodeStart = list.vertexPool[list.indexPools[pool][0]].node;
-		std::vector<uint32_t> indicesToOffset = std::vector<uint32_t>();
-		for (int j = 0; j < list.indexPools[pool].size(); j++) {
-			int curNode = list.indexPools[pool][j];
-			indicesToOffset.push_back(curNode);
-		}
-		std::sort(indicesToOffset.begin(), indicesToOffset.end());
-		uint32_t last = -1;
-		for (int k = 0; k < indicesToOffset.size(); k++) {
-			if (indicesToOffset[k] != last) {
-				last = indicesToOffset[k];
-				list.vertexPool[last].node -= nodeStart;
-			}
-		}
+	if (verbose && groupPlacementCount > 0) {
+		std::cout << "MEASURE instance groups: " << groupPlacementCount << " placements of " << groupMemberCount <<
+			" grouped mesh transforms, instead of " << groupExpandedCount << " expanded" << std::endl;
 	}
+
 	//Create material and material pools
 	list.materialPools = std::vector<std::vector<DrawMaterial>>(list.drawPools.size());
 	for (size_t pool = 0; pool < list.materialPools.size(); pool++) {
@@ -674,11 +1452,46 @@ DrawList SceneGraph::navigateSceneGraph(bool verbose, int poolSize) {
 		defaultCamera.forAnimate.translate = float_3(0,0,0);
 		list.cameras.push_back(defaultCamera);
 	}
+	//Find a world space sphere around all geometry, used to fit sun shadow volumes
+	float_3 sceneMin = float_3(0, 0, 0);
+	float_3 sceneMax = float_3(0, 0, 0);
+	bool sceneEmpty = true;
+	for (size_t node = 0; node < drawInter.size(); node++) {
+		growSceneBounds(sceneMin, sceneMax, sceneEmpty, drawInter[node].boundingSphere, traInter[node]);
+	}
+	for (size_t pool = 0; pool < list.instancedTransformPools.size(); pool++) {
+		//Grouped pools hold transforms relative to the group, their bounds already cover every instance
+		if (!list.instancedPlacementPools[pool].empty()) {
+			for (mat44<float> placement : list.instancedPlacementPools[pool]) {
+				growSceneBounds(sceneMin, sceneMax, sceneEmpty, list.instancedGroupBounds[pool], placement);
+			}
+			continue;
+		}
+		std::pair<float_3, float> sphere = list.instancedBoundingSpheres[list.instancedTransformIndexPools[pool]];
+		for (mat44<float> toWorld : list.instancedTransformPools[pool]) {
+			growSceneBounds(sceneMin, sceneMax, sceneEmpty, sphere, toWorld);
+		}
+	}
+	float_3 sceneCenter = (sceneMin + sceneMax) * 0.5f;
+	float sceneRadius = std::max((sceneMax - sceneMin).norm() * 0.5f, 0.01f);
+
 	//Make a perspective world to light vector for shadow mapping
 	list.worldToLightsPersp = std::vector<mat44<float>>();
 	for (int i = 0; i < list.worldToLights.size(); i++) {
 		mat44<float> transform = list.worldToLights[i];
 		DrawLight light = list.lights[i];
+		if (light.type == LIGHT_SUN) {
+			//Suns use an orthographic volume centered on the scene along the light direction
+			float_3 lightCenter = transform * sceneCenter;
+			mat44<float> recenter = mat44<float>(1);
+			recenter.data[3][0] = -lightCenter.x;
+			recenter.data[3][1] = -lightCenter.y;
+			float depth = -lightCenter.z;
+			mat44<float> ortho = mat44<float>::orthographic(sceneRadius, sceneRadius,
+				depth - sceneRadius, depth + sceneRadius);
+			list.worldToLightsPersp.push_back(ortho * recenter * transform);
+			continue;
+		}
 		mat44<float> persp = mat44<float>::perspective(light.fov, 1, 0.01, 1000);
 		list.worldToLightsPersp.push_back(persp*transform);
 	}
@@ -711,9 +1524,6 @@ DrawList SceneGraph::navigateSceneGraph(bool verbose, int poolSize) {
 		list.worldToLightsPersp.push_back(mat44<float>(1));
 	}
 
-	std::chrono::high_resolution_clock::time_point last = std::chrono::high_resolution_clock::now();
-	if(verbose) std::cout << "MEASURE scene graph navigate: " << (float)
-		std::chrono::duration_cast<std::chrono::milliseconds>(
-			last - start).count() << "ms" << std::endl;
+	navigateScope.stop();
 	return list;
 }
@@ -5,10 +5,17 @@
 #include <optional>
 #include "Vertex.h"
 #include <map>
+#include <cmath>
 #include <vulkan/vulkan_core.h>
 
 
 #define MAX_POOL 10000
+#define MESHLET_TRIANGLES 124
+#define MESHLET_VERTICES 64
+#define MAX_LODS 4 //Including the full mesh
+#define LOD_MIN_TRIANGLES 64
+#define LOD_MAX_ERROR 0.02 //Simplification error limit, relative to the mesh's bounding box diagonal
+#define LOD_COVERAGE 0.25f //Screen height fraction below which the first simplified level is used
 
 //Struct attached to node to handle animation
 enum Channel { CH_TRANSLATE, CH_ROTATE, CH_SCALE };
@@ -47,7 +54,7 @@ struct Driver {
 
 //Material structures
 struct Texture {
-	const unsigned char* data;
+	const unsigned char* data = nullptr;
 	enum {
 		TYPE_2D, TYPE_CUBE
 	} type;
@@ -78,9 +85,13 @@ struct Texture {
 	int realY;
 	int mipLevels;
 	bool doFree = true;
+	//Deferred textures only hold their size until the image is decoded from path
+	std::string path;
+	bool deferred() const { return data == nullptr && !path.empty(); }
 	Texture() {};
 	~Texture() {};
 	static Texture parseTexture(std::string path, bool cube);
+	static Texture deferTexture(std::string path);
 };
 
 
@@ -266,6 +277,16 @@ struct ForAnimate {
 	float_3 scale;
 };
 
+//A cluster of a mesh's triangles, culled on its own by its bounding sphere and
+//by its normal cone, which holds every triangle normal in the cluster
+struct Meshlet {
+	int indexStart; //In the same index pool as its mesh
+	int indexCount;
+	std::pair<float_3, float> boundingSphere;
+	float_3 coneAxis;
+	float coneCutoff; //Sine of the cone's half angle, 1 if the cluster can't be backface culled
+};
+
 //Finailized process nodes to be accessed if needed by Vulkan system directly
 //by index, vs. through graph navigation
 struct DrawNode {
@@ -274,14 +295,88 @@ struct DrawNode {
 	int start;
 	int indexCount;
 	int indexStart;
+	bool shortIndices; //indexStart refers to the 16 bit index pool
+	int meshletStart;
+	int meshletCount;
+	//Level 0 is indexStart and indexCount, coarser levels follow in the same index pool
+	int lodCount;
+	int lodIndexStart[MAX_LODS];
+	int lodIndexCount[MAX_LODS];
+	int lod = 0; //Level picked by culling for the current frame
 	mat44<float> transform;
 	mat44<float> normalTransform;
 	ForAnimate forAnimate;
 	std::pair<float_3, float> boundingSphere;
-	static std::pair<float_3, float> produceBoundingSphere(std::vector<Vertex>);
+	std::pair<float_3, float_3> boundingBox; //Minimum and maximum corners in mesh space
+	template <typename V>
+	static std::pair<float_3, float> produceBoundingSphere(const V* vertices, size_t count);
+	template <typename V>
+	static std::pair<float_3, float> produceBoundingSphere(const std::vector<V>& vertices);
+	VertexLayout layout; //Which vertex buffer start and the indices refer to
 	std::optional<Material> material;
 };
 
+//Given a pool of vertices produce a bounding sphere: center and radius. Ritter's sphere
+//grown from the most separated pair of axis extremes, or the box centered sphere if that is tighter.
+template <typename V>
+std::pair<float_3, float> DrawNode::produceBoundingSphere(const V* vertices, size_t count) {
+	if (count == 0) return std::make_pair(float_3(0, 0, 0), 0.f);
+	//Extreme points along each axis
+	float_3 minPoints[3] = { vertices[0].pos, vertices[0].pos, vertices[0].pos };
+	float_3 maxPoints[3] = { vertices[0].pos, vertices[0].pos, vertices[0].pos };
+	for (size_t vert = 1; vert < count; vert++) {
+		float_3 pos = vertices[vert].pos;
+		if (pos.x < minPoints[0].x) minPoints[0] = pos;
+		if (pos.y < minPoints[1].y) minPoints[1] = pos;
+		if (pos.z < minPoints[2].z) minPoints[2] = pos;
+		if (pos.x > maxPoints[0].x) maxPoints[0] = pos;
+		if (pos.y > maxPoints[1].y) maxPoints[1] = pos;
+		if (pos.z > maxPoints[2].z) maxPoints[2] = pos;
+	}
+	int widest = 0;
+	float widestDist = -1;
+	for (int axis = 0; axis < 3; axis++) {
+		float_3 span = maxPoints[axis] - minPoints[axis];
+		float dist = span.norm();
+		if (dist > widestDist) {
+			widest = axis;
+			widestDist = dist;
+		}
+	}
+	float_3 center = (minPoints[widest] + maxPoints[widest]) * 0.5f;
+	float radius = widestDist * 0.5f;
+	//Grow to reach any point still outside, moving the center towards it
+	for (size_t vert = 0; vert < count; vert++) {
+		float_3 pos = vertices[vert].pos;
+		float_3 distVec = pos - center;
+		float dist = distVec.norm();
+		if (dist <= radius) continue;
+		float newRadius = (radius + dist) * 0.5f;
+		center = center + distVec * ((newRadius - radius) / dist);
+		radius = newRadius;
+	}
+
+	float_3 boxCenter = float_3(
+		(minPoints[0].x + maxPoints[0].x) * 0.5f,
+		(minPoints[1].y + maxPoints[1].y) * 0.5f,
+		(minPoints[2].z + maxPoints[2].z) * 0.5f
+	);
+	float boxRadius = 0;
+	for (size_t vert = 0; vert < count; vert++) {
+		float_3 pos = vertices[vert].pos;
+		float_3 distVec = pos - boxCenter;
+		float dist = distVec.norm();
+		if (dist > boxRadius) boxRadius = dist;
+	}
+	if (boxRadius < radius) return std::make_pair(boxCenter, boxRadius);
+	return std::make_pair(center, radius);
+}
+
+template <typename V>
+std::pair<float_3, float> DrawNode::produceBoundingSphere(const std::vector<V>& vertices) {
+	return produceBoundingSphere(vertices.data(), vertices.size());
+}
+
 //Finallized processed camera structure to be passed to vulkan system
 struct DrawCamera {
 	std::string name;
@@ -298,13 +393,17 @@ class DrawListIntermediate
 {
 public:
 	std::vector<Vertex> vertexPool;
+	std::vector<SimpleVertex> simpleVertexPool;
 	std::vector<uint32_t> indexPool;
+	std::vector<uint16_t> shortIndexPool;
+	std::vector<Meshlet> meshlets;
 	std::vector<DrawNode> drawPool;
 	std::vector<DrawCamera> cameras;
 	std::vector<mat44<float>> transforms;
 	std::vector<mat44<float>> normalTransforms;
 	std::vector < std::vector<mat44<float>>> instancedTransforms;
 	std::vector < std::vector<mat44<float>>> instancedNormalTransforms;
+	std::vector<std::vector<mat44<float>>> groupPlacements; //World transforms each instance group is placed at
 	std::optional<mat44<float>> worldToEnvironment;
 	std::vector<Driver> nodeDrivers;
 	std::vector<Driver> cameraDrivers;
@@ -326,13 +425,28 @@ public:
 //split into "sub draw-pools" as large as or smaller than the maximum
 //number of transforms defined in the shader. This value can be set lower
 //to minimize memory transfers at a cost of more draw calls.
+//Vertices and indices are not pooled: each mesh is stored once in the
+//shared vertex and index pools, and every draw node references its mesh's
+//range, with its index in its draw pool supplied per draw. Meshes without
+//tangents or texcoords go in the smaller simple vertex pool. Indices are
+//relative to the mesh's first vertex, and kept in the 16 bit index pool
+//whenever the mesh is small enough.
 class DrawList
 {
 public:
 	std::vector<Vertex> vertexPool;
+	std::vector<SimpleVertex> simpleVertexPool;
 	std::vector<Vertex> instancedVertexPool;
-	std::vector<std::vector<uint32_t>> indexPools;
+	std::vector<uint32_t> indexPool;
+	std::vector<uint16_t> shortIndexPool;
+	std::vector<Meshlet> meshlets; //Every mesh's meshlets, draw nodes reference their range
 	std::vector<std::vector<uint32_t>> instancedIndexPools;
+	std::vector<std::vector<std::pair<uint32_t, uint32_t>>> instancedLodRanges; //Start and count of each level in its index pool
+	//Instanced pools of a repeated subtree hold transforms relative to the subtree, and are drawn once
+	//per placement of it. Placements are empty for pools of single meshes.
+	std::vector<std::vector<mat44<float>>> instancedPlacementPools;
+	std::vector<std::pair<float_3, float>> instancedGroupBounds; //Sphere around a grouped pool's instances, relative to the subtree
+	std::vector<float> instancedMemberRadii; //Largest instance radius in a grouped pool, for picking its LOD
 	std::vector<std::pair<float_3, float>> instancedBoundingSpheres;
 	std::vector<std::vector<DrawNode>> drawPools;
 	std::vector<DrawCamera> cameras;
@@ -385,6 +499,11 @@ struct Mesh {
 	int index;
 	bool instanceMesh; //This mesh will be references multiple times
 	std::optional<int> material;
+	uint32_t attributes = 0; //VertexAttribute bits present in the source data
+	std::vector<std::vector<uint32_t>> lods; //Simplified index lists over the same vertices, coarsest last
+	//Mesh space bounds, computed once after parsing and shared by every node placing the mesh
+	std::pair<float_3, float> boundingSphere;
+	std::pair<float_3, float_3> boundingBox;
 };
 
 //A camera data structured parsed from .s72 file
@@ -394,7 +513,7 @@ struct Camera {
 	int index;
 };
 
-//Vertex information sans the per-pool transform node
+//Vertex information as parsed from a .b72 file
 struct SceneVertex {
 	float_3 pos;
 	float_3 normal;
@@ -411,7 +530,8 @@ public:
 	bool useInstancing;
 	DrawListIntermediate navigateSceneGraphInt(int instanceSize = 0);
 	DrawList navigateSceneGraph(bool verbose = false, int poolSize = MAX_POOL);
-	void navigateSceneGraphMeshes(std::vector<bool>& encountered, int node);
+	void navigateSceneGraphMeshes(std::vector<bool>& encountered, std::vector<bool>& visited,
+		const std::vector<int>& references, int node, bool repeated);
 	std::string name;
 	std::vector<GraphNode> graphNodes;
 	std::vector<int> roots;
@@ -419,11 +539,17 @@ public:
 	std::vector<Camera> cameras;
 	std::vector<Material> materials;
 	std::vector<SceneVertex> vertexPool;
+	void weldMeshes(bool verbose = false);
+	void computeMeshBounds();
+	void optimizeMeshes(bool overdraw = false, bool verbose = false);
+	void buildMeshLods(bool verbose = false);
 	void recurseSceneGraph(
 		std::vector<DrawCamera>& drawCameras,
 		std::vector<Light>& drawLights,
 		std::vector<Vertex>& vertices, 
+		std::vector<SimpleVertex>& simpleVertices,
 		std::vector<uint32_t>& indices, 
+		std::vector<uint16_t>& shortIndices,
 		int node,
 		mat44<float> toWorld,
 		mat44<float> fromWorld,
@@ -432,6 +558,7 @@ public:
 		std::vector<Driver>& cameraDrivers,
 		std::vector < std::vector<mat44<float>>>& instancedTransforms,
 		std::vector<std::vector<mat44<float>>>& instancedNormalTransforms,
+		std::vector<std::vector<mat44<float>>>& groupPlacements,
 		std::vector<DrawNode>& drawNodes
 	);
 	std::vector<Texture> textureMaps;
@@ -442,6 +569,35 @@ public:
 	std::vector<Light> lights;
 	int maxPool = MAX_POOL;
 private:
+	//Where a mesh was placed in the shared vertex and index pools
+	struct MeshRange {
+		VertexLayout layout;
+		int start;
+		int indexStart;
+		int indexCount;
+		bool shortIndices;
+		int meshletStart;
+		int meshletCount;
+		int lodCount;
+		int lodIndexStart[MAX_LODS];
+		int lodIndexCount[MAX_LODS];
+	};
+	std::map<int, MeshRange> meshRanges;
+	std::vector<Meshlet> meshlets;
+	//A subtree referenced more than once with nothing animated, lit or viewed inside. Its meshes
+	//are flattened once relative to the subtree, so traversal stops at each placement of it.
+	struct InstanceGroup {
+		int node;
+		std::map<int, std::vector<mat44<float>>> members;
+	};
+	std::vector<InstanceGroup> instanceGroups;
+	std::vector<int> nodeGroups; //Group rooted at each node, or -1
+	bool instanceGroupsBuilt = false;
+	std::vector<int8_t> staticNodes; //Memo of staticSubtree, -1 while unknown
+	bool staticSubtree(int node);
+	const std::map<int, std::vector<mat44<float>>>& flattenSubtree(int node,
+		std::map<int, std::map<int, std::vector<mat44<float>>>>& flattened);
+	void buildInstanceGroups();
 	std::map<std::string, int> instancedToPool;
 	std::vector<DrawLight> toDrawLights(std::vector<Light> lights);
 	std::vector<DrawLight> toDrawLights(std::vector<Light> lights, std::vector<mat44<float>>& transforms);
@@ -1,8 +1,14 @@
 C:/VulkanSDK/1.3.268.0/Bin/glslc.exe shaderShadow.vert -o vertShadow.spv
 C:/VulkanSDK/1.3.268.0/Bin/glslc.exe shaderShadowInst.vert -o vertShadowInst.spv
 C:/VulkanSDK/1.3.268.0/Bin/glslc.exe shader.vert -o vert.spv
+C:/VulkanSDK/1.3.268.0/Bin/glslc.exe -DSIMPLE_VERTEX shader.vert -o vertSimple.spv
+C:/VulkanSDK/1.3.268.0/Bin/glslc.exe -DPACKED_VERTEX shader.vert -o vertPacked.spv
+C:/VulkanSDK/1.3.268.0/Bin/glslc.exe -DSIMPLE_VERTEX -DPACKED_VERTEX shader.vert -o vertSimplePacked.spv
 C:/VulkanSDK/1.3.268.0/Bin/glslc.exe shaderInst.vert -o vertInst.spv
 C:/VulkanSDK/1.3.268.0/Bin/glslc.exe shaderEnv.vert -o vertEnv.spv
+C:/VulkanSDK/1.3.268.0/Bin/glslc.exe -DSIMPLE_VERTEX shaderEnv.vert -o vertEnvSimple.spv
+C:/VulkanSDK/1.3.268.0/Bin/glslc.exe -DPACKED_VERTEX shaderEnv.vert -o vertEnvPacked.spv
+C:/VulkanSDK/1.3.268.0/Bin/glslc.exe -DSIMPLE_VERTEX -DPACKED_VERTEX shaderEnv.vert -o vertEnvSimplePacked.spv
 C:/VulkanSDK/1.3.268.0/Bin/glslc.exe shaderInstEnv.vert -o vertInstEnv.spv
 C:/VulkanSDK/1.3.268.0/Bin/glslc.exe vertQuad.vert -o vertQuad.spv
 C:/VulkanSDK/1.3.268.0/Bin/glslc.exe shaderShadow.frag -o fragShadow.spv
@@ -63,6 +63,14 @@ layout(binding = 7) uniform LightArray {
 layout(binding = 9) uniform LightPerspective {
     mat4 arr[1000];
 } lightPerspective;
+//Per cluster light lists, data holds an offset and count pair per cluster
+//followed by the light indices they point to
+layout(std430, binding = 13) readonly buffer Clusters {
+	mat4 worldToView;
+	uvec4 dims; //Tiles x, tiles y, depth slices, total lights
+	vec4 params; //Tile width, tile height, near, far
+	uint data[];
+} clusters;
 struct PushConstants
 {
     int lightNum;
@@ -91,13 +99,16 @@ float getShadowContribution(vec4 lightSpacePos){
 }
 
 void main() {
-	vec3 toLight[100];
-	vec4 lightSpace[100];
-	int numLights = inConsts.lightNum;
-	for(int lightInd = 0; lightInd < numLights; lightInd++){
-        lightSpace[lightInd] = lightPerspective.arr[lightInd]*position;
-        toLight[lightInd] = -(lightTransforms.arr[lightInd] * position).xyz;
-    }
+	//Find this fragment's cluster, slices are exponential in view depth
+	uvec4 dims = clusters.dims;
+	float viewDepth = -(clusters.worldToView * position).z;
+	uint tileX = min(uint(gl_FragCoord.x / clusters.params.x), dims.x - 1);
+	uint tileY = min(uint(gl_FragCoord.y / clusters.params.y), dims.y - 1);
+	float sliceF = log(max(viewDepth, clusters.params.z) / clusters.params.z) / log(clusters.params.w / clusters.params.z);
+	uint slice = min(uint(sliceF * dims.z), dims.z - 1);
+	uint cluster = (slice * dims.y + tileY) * dims.x + tileX;
+	uint clusterLightOffset = clusters.data[2 * cluster];
+	uint clusterLightCount = clusters.data[2 * cluster + 1];
 	Material material = materials.arr[nodeInd];
 	vec3 useNormal = normal;
 	//https://learnopengl.com/Advanced-Lighting/Normal-Mapping
@@ -110,18 +121,21 @@ void main() {
 	
 	if(material.type == 2){ //Diffuse
 		vec3 directLight = vec3(0,0,0);
-		for(int lightInd = 0; lightInd < numLights; lightInd++){
+		for(uint clusterLight = 0; clusterLight < clusterLightCount; clusterLight++){
+			int lightInd = int(clusters.data[clusterLightOffset + clusterLight]);
+			vec3 toLight = -(lightTransforms.arr[lightInd] * position).xyz;
+			vec4 lightSpace = lightPerspective.arr[lightInd] * position;
 			Light light = lights.arr[lightInd];
 			vec3 tint = vec3(light.tintR, light.tintG, light.tintB);
-			float dist = length(toLight[lightInd]);
+			float dist = length(toLight);
 			float fallOff;
 			if(light.limit > 0) fallOff = max(0,1 - pow(dist/light.limit,4))/4/3.14159/dist/dist;
 			else fallOff = 1/dist/dist/4/3.14159;
 			vec3 sphereContribution = vec3(light.power)*tint*fallOff;
-			float shadowContribution = getShadowContribution(lightSpace[lightInd]);
+			float shadowContribution = getShadowContribution(lightSpace);
 
 			if(light.type == 1){
-				float normDot = dot(useNormal,normalize(toLight[lightInd]));
+				float normDot = dot(useNormal,normalize(toLight));
 				if (normDot < 0) normDot = 0;
 				directLight += normDot * sphereContribution;
 			}
@@ -134,7 +148,7 @@ void main() {
 			else if(light.type == 3){
 				float normDot = dot(useNormal,vec3(0,0,-1));
 				if (normDot < 0) normDot = 0;
-				float angle = acos(dot(normalize(toLight[lightInd]),vec3(0,0,-1)));
+				float angle = acos(dot(normalize(toLight),vec3(0,0,-1)));
 				float blendLimit = light.fov*(1 - light.blend)/2;
 				float fovLimit = light.fov/2;
 				if(light.limit > dist){
@@ -174,20 +188,23 @@ void main() {
 		}
 		vec3 directLight = vec3(0,0,0);
 		vec3 cameraPos = vec3(inConsts.cameraPosX,inConsts.cameraPosY,inConsts.cameraPosZ);
-		for(int lightInd = 0; lightInd < numLights; lightInd++){
+		for(uint clusterLight = 0; clusterLight < clusterLightCount; clusterLight++){
+			int lightInd = int(clusters.data[clusterLightOffset + clusterLight]);
+			vec3 toLight = -(lightTransforms.arr[lightInd] * position).xyz;
+			vec4 lightSpace = lightPerspective.arr[lightInd] * position;
 			Light light = lights.arr[lightInd];
 			vec3 tint = vec3(light.tintR, light.tintG, light.tintB);
 			vec3 r = reflect(cameraPos - position.xyz, useNormal);
 			float p = inConsts.pbrP;
-			float shadowContribution = getShadowContribution(lightSpace[lightInd]);
+			float shadowContribution = getShadowContribution(lightSpace);
 			float fallOff;
 
 			if(light.type == 1){
-				vec3 centerToRay = dot(r,toLight[lightInd])*r - toLight[lightInd];
-				vec3 closestPoint = toLight[lightInd] + centerToRay*light.radius/length(centerToRay);
+				vec3 centerToRay = dot(r,toLight)*r - toLight;
+				vec3 closestPoint = toLight + centerToRay*light.radius/length(centerToRay);
 				float normDot = dot(useNormal,normalize(closestPoint));
 				if (normDot < 0) normDot = 0;
-				float phi = acos(dot(normalize(r),normalize(toLight[lightInd])));
+				float phi = acos(dot(normalize(r),normalize(toLight)));
 				float dist = length(closestPoint);
 				float alpha = roughness*roughness;
 				float alphaP = alpha + light.radius/2/dist;
@@ -214,9 +231,9 @@ void main() {
 			}
 			else if(light.type == 3){
 				
-				vec3 centerToRay = dot(r,toLight[lightInd])*r - toLight[lightInd];
-				vec3 closestPoint = toLight[lightInd] + centerToRay*light.radius/length(centerToRay);
-				float phi = acos(dot(normalize(r),normalize(toLight[lightInd])));
+				vec3 centerToRay = dot(r,toLight)*r - toLight;
+				vec3 closestPoint = toLight + centerToRay*light.radius/length(centerToRay);
+				float phi = acos(dot(normalize(r),normalize(toLight)));
 				float dist = length(closestPoint);
 				float alpha = roughness*roughness;
 				float alphaP = alpha + light.radius/2/dist;
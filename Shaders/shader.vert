@@ -9,11 +9,23 @@ layout(binding = 1) uniform Camera {
 } camera;
 
 layout(location = 0) in vec3 inPosition;
+//Packed vertices store normals and tangents octahedral encoded, and positions
+//within the mesh bounds, which the transform already maps back
+#ifdef PACKED_VERTEX
+layout(location = 1) in vec2 inNormalPacked;
+#else
 layout(location = 1) in vec3 inNormal;
+#endif
+//Simple vertices only carry position, normal and color
+#ifndef SIMPLE_VERTEX
+#ifdef PACKED_VERTEX
+layout(location = 2) in vec2 inTangentPacked;
+#else
 layout(location = 2) in vec3 inTangent;
+#endif
 layout(location = 3) in vec2 inTexcoord;
+#endif
 layout(location = 4) in vec3 inColor;
-layout(location = 5) in int inNode;
 
 
 layout(location = 0) out vec3 fragColor;
@@ -25,15 +37,40 @@ layout(location = 5) out vec3 bitangent;
 layout(location = 6) out vec3 toEnvLight;
 layout(location = 7) out vec4 position;
 
+#ifdef PACKED_VERTEX
+vec3 octDecode(vec2 e) {
+    vec3 v = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (v.z < 0.0) v.xy = (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+    return normalize(v);
+}
+#endif
+
 void main() {
-    vec4 worldPos = transforms.arr[inNode] * vec4(inPosition, 1.0);
+#ifdef PACKED_VERTEX
+    vec3 vertNormal = octDecode(inNormalPacked);
+#ifndef SIMPLE_VERTEX
+    vec3 vertTangent = octDecode(inTangentPacked);
+#endif
+#else
+    vec3 vertNormal = inNormal;
+#ifndef SIMPLE_VERTEX
+    vec3 vertTangent = inTangent;
+#endif
+#endif
+    vec4 worldPos = transforms.arr[gl_InstanceIndex] * vec4(inPosition, 1.0);
     gl_Position = camera.camera * worldPos;
     position = worldPos;
     fragColor = inColor;
-    normal = inNormal;
-    nodeInd = inNode;
+    normal = vertNormal;
+    nodeInd = gl_InstanceIndex;
+#ifdef SIMPLE_VERTEX
+    texcoord = vec2(0);
+    tangent = vec3(0);
+    bitangent = vec3(0);
+#else
     texcoord = inTexcoord;
-    tangent = inTangent;
-    bitangent = cross(inNormal,inTangent);
+    tangent = vertTangent;
+    bitangent = cross(vertNormal,vertTangent);
+#endif
     toEnvLight = vec3(0,0,0);
 }
\ No newline at end of file
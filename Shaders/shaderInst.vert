@@ -7,13 +7,16 @@ layout(binding = 0) uniform Transforms {
 layout(binding = 1) uniform Camera {
     mat4 camera;
 } camera;
+//Placement of the instance group being drawn, identity for single mesh instances
+layout(push_constant) uniform PushConsts {
+    layout(offset = 32) mat4 placement;
+} inConsts;
 
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inNormal;
 layout(location = 2) in vec3 inTangent;
 layout(location = 3) in vec2 inTexcoord;
 layout(location = 4) in vec3 inColor;
-layout(location = 5) in int inNode;
 
 
 layout(location = 0) out vec3 fragColor;
@@ -26,7 +29,7 @@ layout(location = 6) out vec3 toEnvLight;
 layout(location = 7) out vec4 position;
 
 void main() {
-    vec4 worldPos = transforms.arr[gl_InstanceIndex] * vec4(inPosition, 1.0);
+    vec4 worldPos = inConsts.placement * transforms.arr[gl_InstanceIndex] * vec4(inPosition, 1.0);
     gl_Position = camera.camera * worldPos;
     position = worldPos;
     fragColor = inColor;
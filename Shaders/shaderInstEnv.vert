@@ -19,7 +19,6 @@ layout(location = 1) in vec3 inNormal;
 layout(location = 2) in vec3 inTangent;
 layout(location = 3) in vec2 inTexcoord;
 layout(location = 4) in vec3 inColor;
-layout(location = 5) in int inNode;
 
 
 layout(location = 0) out vec3 fragColor;
@@ -7,6 +7,7 @@ layout(binding = 0) uniform Models {
 struct PushConstants
 {
     mat4 light;
+    mat4 placement; //Instance group placement, identity for single mesh instances
 };
 layout( push_constant ) uniform PushConsts
 {
@@ -15,15 +16,10 @@ layout( push_constant ) uniform PushConsts
 
 
 layout(location = 0) in vec3 inPosition;
-layout(location = 1) in vec3 inNormal;
-layout(location = 2) in vec3 inTangent;
-layout(location = 3) in vec2 inTexcoord;
-layout(location = 4) in vec3 inColor;
-layout(location = 5) in int inNode;
 
 
 
 void main() {
-    vec4 worldPos = models.arr[inNode] * vec4(inPosition, 1.0);
+    vec4 worldPos = inConsts.placement * models.arr[gl_InstanceIndex] * vec4(inPosition, 1.0);
     gl_Position = inConsts.light * worldPos;
 }
\ No newline at end of file
@@ -9,12 +9,6 @@ vec2 positions[6] = vec2[](
     vec2(1.0, -1.0)
 );
 
-layout(location = 0) in vec3 inPosition;
-layout(location = 1) in vec3 inNormal;
-layout(location = 2) in vec3 inTanget;
-layout(location = 3) in vec2 inTexcoord;
-layout(location = 4) in vec3 inColor;
-layout(location = 5) in int inNode;
 
 void main() {
     gl_Position = vec4(positions[gl_VertexIndex], 0.0, 1.0);
@@ -0,0 +1,41 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+//Lock free single producer, single consumer triple buffer.
+//The producer fills back() and publishes it, the consumer picks up the newest
+//published slot with update() and reads it through front(). Neither side ever
+//waits on the other, slots published in between are simply skipped.
+template <typename T>
+class TripleBuffer {
+public:
+	//Producer side
+	T& back() {
+		return slots[backIndex];
+	}
+	void publish() {
+		backIndex = middle.exchange(backIndex | FRESH_BIT, std::memory_order_acq_rel) & INDEX_MASK;
+	}
+	//True until the consumer picks up the last published slot
+	bool pending() const {
+		return (middle.load(std::memory_order_acquire) & FRESH_BIT) != 0;
+	}
+
+	//Consumer side, returns true if a newer slot was published since the last update
+	bool update() {
+		if ((middle.load(std::memory_order_relaxed) & FRESH_BIT) == 0) return false;
+		frontIndex = middle.exchange(frontIndex, std::memory_order_acq_rel) & INDEX_MASK;
+		return true;
+	}
+	const T& front() const {
+		return slots[frontIndex];
+	}
+
+private:
+	static const uint8_t INDEX_MASK = 3;
+	static const uint8_t FRESH_BIT = 4;
+	T slots[3];
+	uint8_t backIndex = 0;
+	std::atomic<uint8_t> middle{ 1 };
+	uint8_t frontIndex = 2;
+};
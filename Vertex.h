@@ -1,59 +1,214 @@
 #pragma once
 #include "MathHelpers.h"
 #include <array>
+#include <vector>
+#include <cstddef>
+#include <cstring>
+#include <cmath>
 #include<vulkan/vulkan.h>
 
 
 static VkFormat posFormat = VK_FORMAT_R32G32B32_SFLOAT;
 static VkFormat normalFormat = VK_FORMAT_R32G32B32_SFLOAT;
-static VkFormat tangentFormat = VK_FORMAT_R32G32B32_SFLOAT;
+static VkFormat tangentFormat = VK_FORMAT_R32G32B32A32_SFLOAT;
 static VkFormat texcoordFormat = VK_FORMAT_R32G32_SFLOAT;
-static VkFormat colFormat = VK_FORMAT_R32G32B32_SFLOAT;
+static VkFormat colFormat = VK_FORMAT_R8G8B8A8_UNORM;
+static VkFormat packedPosFormat = VK_FORMAT_R16G16B16A16_UNORM;
+static VkFormat packedNormalFormat = VK_FORMAT_R16G16_SNORM;
+static VkFormat packedTangentFormat = VK_FORMAT_R16G16_SNORM;
+static VkFormat packedTexcoordFormat = VK_FORMAT_R16G16_SFLOAT;
 
+//Attributes a mesh can carry. Each is always bound at the same shader location,
+//so a layout only decides which ones are present and where they sit in the vertex
+enum VertexAttribute : uint32_t {
+	ATTRIBUTE_POSITION = 1 << 0,
+	ATTRIBUTE_NORMAL = 1 << 1,
+	ATTRIBUTE_TANGENT = 1 << 2,
+	ATTRIBUTE_TEXCOORD = 1 << 3,
+	ATTRIBUTE_COLOR = 1 << 4,
+};
 
-//TODO: Split into simple (pos,normal,color,node) and standard (pos, normal,tangent,texcoord,color,node) in the future
+//Layouts vertices are stored in on the GPU, each with its own vertex buffer and pipelines
+enum VertexLayout {
+	LAYOUT_STANDARD = 0,
+	LAYOUT_SIMPLE = 1,
+	LAYOUT_COUNT = 2
+};
+
+//Colors are read as bytes from .b72 files, and are kept that way
+inline uint32_t packColor(float_3 color) {
+	uint32_t r = static_cast<uint32_t>(color.x * 255.f + 0.5f) & 0xff;
+	uint32_t g = static_cast<uint32_t>(color.y * 255.f + 0.5f) & 0xff;
+	uint32_t b = static_cast<uint32_t>(color.z * 255.f + 0.5f) & 0xff;
+	return r | (g << 8) | (b << 16) | (0xffu << 24);
+}
+
+inline uint16_t packUnorm16(float value) {
+	value = value < 0 ? 0 : (value > 1 ? 1 : value);
+	return static_cast<uint16_t>(value * 65535.f + 0.5f);
+}
+
+inline int16_t packSnorm16(float value) {
+	value = value < -1 ? -1 : (value > 1 ? 1 : value);
+	return static_cast<int16_t>(std::round(value * 32767.f));
+}
+
+//Round to nearest float to half conversion, values past the half range become infinity
+inline uint16_t packHalf(float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+	int32_t exponent = static_cast<int32_t>((bits >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = bits & 0x7fffff;
+	if (exponent >= 31) return sign | 0x7c00;
+	if (exponent <= 0) {
+		//Subnormal half, or zero if too small for even that
+		if (exponent < -10) return sign;
+		mantissa |= 0x800000;
+		uint32_t shift = static_cast<uint32_t>(14 - exponent);
+		uint32_t half = mantissa >> shift;
+		if ((mantissa >> (shift - 1)) & 1) half++;
+		return sign | static_cast<uint16_t>(half);
+	}
+	uint32_t half = (static_cast<uint32_t>(exponent) << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000) half++;
+	return sign | static_cast<uint16_t>(half);
+}
+
+//Octahedral encoding of a unit vector into two snorm components
+inline void packOctahedral(float_3 vector, int16_t out[2]) {
+	float length = std::fabs(vector.x) + std::fabs(vector.y) + std::fabs(vector.z);
+	if (length == 0) {
+		out[0] = 0; out[1] = 0;
+		return;
+	}
+	float x = vector.x / length;
+	float y = vector.y / length;
+	if (vector.z < 0) {
+		float foldX = (1 - std::fabs(y)) * (x >= 0 ? 1.f : -1.f);
+		float foldY = (1 - std::fabs(x)) * (y >= 0 ? 1.f : -1.f);
+		x = foldX; y = foldY;
+	}
+	out[0] = packSnorm16(x);
+	out[1] = packSnorm16(y);
+}
+
+//Position, normal, tangent, texcoord and color, for meshes with all attributes
 struct Vertex {
+	static const uint32_t attributes = ATTRIBUTE_POSITION | ATTRIBUTE_NORMAL |
+		ATTRIBUTE_TANGENT | ATTRIBUTE_TEXCOORD | ATTRIBUTE_COLOR;
+	static const VertexLayout layout = LAYOUT_STANDARD;
+	static const bool packed = false;
 	float_3 pos;
 	float_3 normal;
 	float_4 tangent;
 	float_2 texcoord;
-	float_3 color;
-	int node;
-
-	static VkVertexInputBindingDescription getBindingDescription() {
-		VkVertexInputBindingDescription bindingDescription{};
-		bindingDescription.binding = 0;
-		bindingDescription.stride = sizeof(Vertex);
-		bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
-		return bindingDescription;
-	}
-
-	static std::array<VkVertexInputAttributeDescription, 6> getAttributeDescriptions() {
-		std::array<VkVertexInputAttributeDescription, 6> attributeDescriptions{};
-		attributeDescriptions[0].binding = 0;
-		attributeDescriptions[0].location = 0;
-		attributeDescriptions[0].format = VK_FORMAT_R32G32B32_SFLOAT;
-		attributeDescriptions[0].offset = offsetof(Vertex, pos);
-		attributeDescriptions[1].binding = 0;
-		attributeDescriptions[1].location = 1;
-		attributeDescriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-		attributeDescriptions[1].offset = offsetof(Vertex, normal);
-		attributeDescriptions[2].binding = 0;
-		attributeDescriptions[2].location = 2;
-		attributeDescriptions[2].format = VK_FORMAT_R32G32B32A32_SFLOAT;
-		attributeDescriptions[2].offset = offsetof(Vertex, tangent);
-		attributeDescriptions[3].binding = 0;
-		attributeDescriptions[3].location = 3;
-		attributeDescriptions[3].format = VK_FORMAT_R32G32_SFLOAT;
-		attributeDescriptions[3].offset = offsetof(Vertex, texcoord);
-		attributeDescriptions[4].binding = 0;
-		attributeDescriptions[4].location = 4;
-		attributeDescriptions[4].format = VK_FORMAT_R32G32B32_SFLOAT;
-		attributeDescriptions[4].offset = offsetof(Vertex, color);
-		attributeDescriptions[5].binding = 0;
-		attributeDescriptions[5].location = 5;
-		attributeDescriptions[5].format = VK_FORMAT_R32_SINT;
-		attributeDescriptions[5].offset = offsetof(Vertex, node);
-		return attributeDescriptions;
-	};
-};
\ No newline at end of file
+	uint32_t color;
+};
+
+//Position, normal and color, for .pnc meshes used by simple and lambertian materials
+struct SimpleVertex {
+	static const uint32_t attributes = ATTRIBUTE_POSITION | ATTRIBUTE_NORMAL | ATTRIBUTE_COLOR;
+	static const VertexLayout layout = LAYOUT_SIMPLE;
+	static const bool packed = false;
+	float_3 pos;
+	float_3 normal;
+	uint32_t color;
+};
+
+//Opt-in packed versions of the layouts above. Positions are 16 bit unorm within the
+//mesh's bounds, which are folded into the node's transform, normals and tangents are
+//octahedral encoded and texcoords are half floats. The vertex shaders decode them.
+struct PackedVertex {
+	static const uint32_t attributes = Vertex::attributes;
+	static const VertexLayout layout = LAYOUT_STANDARD;
+	static const bool packed = true;
+	uint16_t pos[4];
+	int16_t normal[2];
+	int16_t tangent[2];
+	uint16_t texcoord[2];
+	uint32_t color;
+};
+
+struct PackedSimpleVertex {
+	static const uint32_t attributes = SimpleVertex::attributes;
+	static const VertexLayout layout = LAYOUT_SIMPLE;
+	static const bool packed = true;
+	uint16_t pos[4];
+	int16_t normal[2];
+	uint32_t color;
+};
+
+//Vertex input state for a pipeline drawing layout V. Attributes outside of used
+//are left out, so passes that only read positions can bind any layout.
+struct VertexInput {
+	VkVertexInputBindingDescription binding;
+	std::vector<VkVertexInputAttributeDescription> attributes;
+};
+
+template <typename V>
+VertexInput getVertexInput(uint32_t used = ~0u) {
+	VertexInput input{};
+	input.binding.binding = 0;
+	input.binding.stride = sizeof(V);
+	input.binding.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+	uint32_t present = V::attributes & used;
+	if constexpr ((V::attributes & ATTRIBUTE_POSITION) != 0) {
+		if (present & ATTRIBUTE_POSITION) input.attributes.push_back({ 0, 0, V::packed ? packedPosFormat : posFormat,
+			static_cast<uint32_t>(offsetof(V, pos)) });
+	}
+	if constexpr ((V::attributes & ATTRIBUTE_NORMAL) != 0) {
+		if (present & ATTRIBUTE_NORMAL) input.attributes.push_back({ 1, 0, V::packed ? packedNormalFormat : normalFormat,
+			static_cast<uint32_t>(offsetof(V, normal)) });
+	}
+	if constexpr ((V::attributes & ATTRIBUTE_TANGENT) != 0) {
+		if (present & ATTRIBUTE_TANGENT) input.attributes.push_back({ 2, 0, V::packed ? packedTangentFormat : tangentFormat,
+			static_cast<uint32_t>(offsetof(V, tangent)) });
+	}
+	if constexpr ((V::attributes & ATTRIBUTE_TEXCOORD) != 0) {
+		if (present & ATTRIBUTE_TEXCOORD) input.attributes.push_back({ 3, 0, V::packed ? packedTexcoordFormat : texcoordFormat,
+			static_cast<uint32_t>(offsetof(V, texcoord)) });
+	}
+	if constexpr ((V::attributes & ATTRIBUTE_COLOR) != 0) {
+		if (present & ATTRIBUTE_COLOR) input.attributes.push_back({ 4, 0, colFormat, static_cast<uint32_t>(offsetof(V, color)) });
+	}
+	return input;
+}
+
+//Fill whichever attributes layout V holds from a full set of parsed values
+template <typename V>
+V makeVertex(float_3 pos, float_3 normal, float_4 tangent, float_2 texcoord, float_3 color) {
+	V vertex{};
+	vertex.pos = pos;
+	vertex.normal = normal;
+	if constexpr ((V::attributes & ATTRIBUTE_TANGENT) != 0) vertex.tangent = tangent;
+	if constexpr ((V::attributes & ATTRIBUTE_TEXCOORD) != 0) vertex.texcoord = texcoord;
+	vertex.color = packColor(color);
+	return vertex;
+}
+
+//Pack a full precision vertex of the matching layout, positions are mapped from
+//[boundsMin, boundsMin + boundsExtent] to [0, 1]
+template <typename P, typename V>
+P packVertex(const V& vertex, float_3 boundsMin, float_3 boundsExtent) {
+	P packedVertex{};
+	packedVertex.pos[0] = packUnorm16(boundsExtent.x > 0 ? (vertex.pos.x - boundsMin.x) / boundsExtent.x : 0);
+	packedVertex.pos[1] = packUnorm16(boundsExtent.y > 0 ? (vertex.pos.y - boundsMin.y) / boundsExtent.y : 0);
+	packedVertex.pos[2] = packUnorm16(boundsExtent.z > 0 ? (vertex.pos.z - boundsMin.z) / boundsExtent.z : 0);
+	packOctahedral(vertex.normal, packedVertex.normal);
+	if constexpr ((P::attributes & ATTRIBUTE_TANGENT) != 0) {
+		packOctahedral(float_3(vertex.tangent.x, vertex.tangent.y, vertex.tangent.z), packedVertex.tangent);
+	}
+	if constexpr ((P::attributes & ATTRIBUTE_TEXCOORD) != 0) {
+		packedVertex.texcoord[0] = packHalf(vertex.texcoord.x);
+		packedVertex.texcoord[1] = packHalf(vertex.texcoord.y);
+	}
+	packedVertex.color = vertex.color;
+	return packedVertex;
+}
+
+//The layout a mesh is stored in, the smallest one holding every attribute it has
+inline VertexLayout layoutForAttributes(uint32_t attributes) {
+	if ((attributes & ~SimpleVertex::attributes) == 0) return LAYOUT_SIMPLE;
+	return LAYOUT_STANDARD;
+}
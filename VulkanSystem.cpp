@@ -21,6 +21,7 @@
 #include "shaderc/shaderc.hpp"
 #include <thread>
 #include "stb_image.h"
+#include "Profiler.h"
 //https://vulkan-tutorial.com
 
 
@@ -54,12 +55,36 @@ void DestroyDebugUtilsMessengerEXT(VkInstance instance, VkDebugUtilsMessengerEXT
 	}
 }
 
-void VulkanSystem::initVulkan(DrawList drawList, std::string cameraName) {
+//Everything that does not depend on the scene, so it can run while the scene is still parsing
+void VulkanSystem::initDevice() {
+	{
+		TraceScope scope("init device", verbose);
+		createInstance();
+		setupDebugMessenger();
+		createSurface();
+		pickPhysicalDevice();
+		createLogicalDevice();
+	}
+	{
+		TraceScope scope("init swapchain", verbose);
+		createSwapChain();
+		createPipelineCache();
+	}
+}
+
+void VulkanSystem::initScene(DrawList drawList, std::string cameraName) {
 	//Vertex shader
 	vertices = drawList.vertexPool;
+	verticesSimple = drawList.simpleVertexPool;
 	verticesInst = drawList.instancedVertexPool;
-	indexPoolsStore = drawList.indexPools;
+	indexPool = drawList.indexPool;
+	shortIndexPool = drawList.shortIndexPool;
+	meshlets = drawList.meshlets;
 	indexInstPools = drawList.instancedIndexPools;
+	lodRangesInst = drawList.instancedLodRanges;
+	placementInstPoolsStore = drawList.instancedPlacementPools;
+	groupBoundsInst = drawList.instancedGroupBounds;
+	memberRadiiInst = drawList.instancedMemberRadii;
 	transformPools = drawList.transformPools;
 	transformInstPoolsStore = drawList.instancedTransformPools;
 	transformInstIndexPools = drawList.instancedTransformIndexPools;
@@ -79,6 +104,15 @@ void VulkanSystem::initVulkan(DrawList drawList, std::string cameraName) {
 	lightPool = drawList.lights;
 	worldTolightPool = drawList.worldToLights;
 	worldTolightPerspPool = drawList.worldToLightsPersp;
+	shadowDirty = std::vector<bool>(lightPool.size());
+	shadowRenders = std::vector<int>(lightPool.size(), 0);
+	shadowCasters = std::vector<int>(lightPool.size(), 0);
+	shadowNodePools = std::vector<std::vector<std::vector<uint32_t>>>(lightPool.size());
+	shadowInstPools = std::vector<std::vector<std::vector<mat44<float>>>>(lightPool.size());
+	shadowPlacementPools = std::vector<std::vector<std::vector<mat44<float>>>>(lightPool.size());
+	for (size_t light = 0; light < lightPool.size(); light++) {
+		shadowDirty[light] = lightPool[light].shadowRes != 0;
+	}
 
 	//Animate and bounding box
 	drawPools = drawList.drawPools;
@@ -97,46 +131,70 @@ void VulkanSystem::initVulkan(DrawList drawList, std::string cameraName) {
 		currentCamera = findCamera;
 	}
 
-	createInstance();
-	setupDebugMessenger();
-	createSurface();
-	pickPhysicalDevice();
-	createLogicalDevice();
-	createSwapChain();
-	createAttachments();
-	createImageViews();
-	createRenderPasses();
-	createDescriptorSetLayout();
-	createGraphicsPipelines();
-	createDepthResources();
-	createFramebuffers();
-	createCommands();
-	createVertexBuffer();
-	createTextureImages();
-	createIndexBuffers();
-	createUniformBuffers();
-	createDescriptorPool();
-	createDescriptorSets();
-
+	//Startup time per stage
+	{
+		TraceScope scope("init passes", verbose);
+		createAttachments();
+		createImageViews();
+		createRenderPasses();
+		createDescriptorSetLayout();
+	}
+	{
+		TraceScope scope("init pipelines", verbose);
+		createGraphicsPipelines();
+		//Cold start, store the freshly built pipelines right away
+		if (!pipelineCacheLoaded) savePipelineCache();
+	}
+	{
+		TraceScope scope("init framebuffers and vertices", verbose);
+		createDepthResources();
+		createFramebuffers();
+		createCommands();
+		createTimestampQueries();
+		createVertexBuffer();
+	}
+	{
+		TraceScope scope("init textures", verbose);
+		createTextureImages();
+	}
+	{
+		TraceScope scope("init buffers and descriptors", verbose);
+		createIndexBuffers();
+		createUniformBuffers();
+		createClusterBuffers();
+		createMeshletBuffers();
+		createDescriptorPool();
+		createDescriptorSets();
+	}
+
+	inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+	VkFenceCreateInfo fenceInfo{};
+	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+	for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+		if (vkCreateFence(device, &fenceInfo, nullptr, inFlightFences.data() + i) != VK_SUCCESS) {
+			throw std::runtime_error("ERROR: Unable to create a semaphore or fence in VulkanSystem.");
+		}
+	}
 	if (renderToWindow) {
 		imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
 		renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-		inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
 
 		VkSemaphoreCreateInfo semaphoreInfo{};
 		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-		VkFenceCreateInfo fenceInfo{};
-		fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-		fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 		for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
 		{
 			if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, imageAvailableSemaphores.data() + i) != VK_SUCCESS ||
-				vkCreateSemaphore(device, &semaphoreInfo, nullptr, renderFinishedSemaphores.data() + i) != VK_SUCCESS ||
-				vkCreateFence(device, &fenceInfo, nullptr, inFlightFences.data() + i) != VK_SUCCESS) {
+				vkCreateSemaphore(device, &semaphoreInfo, nullptr, renderFinishedSemaphores.data() + i) != VK_SUCCESS) {
 				throw std::runtime_error("ERROR: Unable to create a semaphore or fence in VulkanSystem.");
 			}
 		}
 	}
+	else {
+		createReadbackBuffers();
+		saveThreadStop = false;
+		saveThread = std::thread(&VulkanSystem::saveThreadMain, this);
+	}
 
 }
 
@@ -343,6 +401,15 @@ bool updateTransform(Driver* driver, float frameTime, SceneGraph* sceneGraphP, b
 }
 
 void VulkanSystem::runDrivers(float frameTime, SceneGraph* sceneGraphP, bool loop) {
+	TRACE_SCOPE("runDrivers");
+	if (advanceDrivers(frameTime, sceneGraphP, loop)) {
+		DrawList drawList = sceneGraphP->navigateSceneGraph(false, poolSize);
+		applySceneTransforms(drawList);
+	}
+}
+
+//Only touches the drivers and the scene graph, so it can run ahead on the simulation thread
+bool VulkanSystem::advanceDrivers(float frameTime, SceneGraph* sceneGraphP, bool loop) {
 	frameTime *= playbackSpeed; //1 when not in headless mode
 	frameTime *= (playingAnimation ? (forwardAnimation ? 1 : -1) : 0);
 	bool renavigate = false;
@@ -354,15 +421,34 @@ void VulkanSystem::runDrivers(float frameTime, SceneGraph* sceneGraphP, bool loo
 		Driver* driver = cameraDrivers.data() + ind;
 		renavigate = renavigate || updateTransform(driver, frameTime, sceneGraphP, loop) || renavigate;
 	}
-	if (renavigate) {
-		DrawList drawList = sceneGraphP->navigateSceneGraph(false, poolSize);
-		transformPools = drawList.transformPools;
-		transformInstPoolsStore = drawList.instancedTransformPools;
-		transformNormalPools = drawList.normalTransformPools;
-		transformNormalInstPoolsStore = drawList.instancedNormalTransformPools;
-		transformEnvironmentPools = drawList.environmentTransformPools;
-		transformEnvironmentInstPoolsStore = drawList.instancedEnvironmentTransformPools;
-		cameras = drawList.cameras;
+	return renavigate;
+}
+
+void VulkanSystem::applySceneTransforms(const DrawList& drawList) {
+	markShadowsDirty(drawList);
+	transformPools = drawList.transformPools;
+	transformInstPoolsStore = drawList.instancedTransformPools;
+	placementInstPoolsStore = drawList.instancedPlacementPools;
+	transformNormalPools = drawList.normalTransformPools;
+	transformNormalInstPoolsStore = drawList.instancedNormalTransformPools;
+	transformEnvironmentPools = drawList.environmentTransformPools;
+	transformEnvironmentInstPoolsStore = drawList.instancedEnvironmentTransformPools;
+	cameras = drawList.cameras;
+	worldTolightPool = drawList.worldToLights;
+	worldTolightPerspPool = drawList.worldToLightsPersp;
+}
+
+//Take over the camera and, if the graph was navigated since, the transforms of a snapshot
+void VulkanSystem::applySnapshot(const FrameSnapshot& snapshot) {
+	moveVec = snapshot.moveVec;
+	dirVec = snapshot.dirVec;
+	debugMoveVec = snapshot.debugMoveVec;
+	debugDirVec = snapshot.debugDirVec;
+	movementMode = snapshot.movementMode;
+	if (snapshot.scene && snapshot.sceneVersion != appliedSceneVersion) {
+		TRACE_SCOPE("applySnapshot");
+		applySceneTransforms(*snapshot.scene);
+		appliedSceneVersion = snapshot.sceneVersion;
 	}
 }
 
@@ -381,7 +467,11 @@ void VulkanSystem::cleanup() {
 	std::cout << "Cleaning up Vulkan Mode." << std::endl;
 #endif // DEBUG
 
+	stopTextureStreaming();
 	cleanupSwapChain();
+	savePipelineCache();
+	vkDestroyPipelineCache(device, pipelineCache, nullptr);
+	if (timestampQueryPool != VK_NULL_HANDLE) vkDestroyQueryPool(device, timestampQueryPool, nullptr);
 	for (VkImageView texImageView : textureImageViews) {
 		vkDestroyImageView(device, texImageView, nullptr);
 	}
@@ -429,6 +519,11 @@ void VulkanSystem::cleanup() {
 			vkFreeMemory(device, uniformBuffersMemoryLightTransformsPools[pool][frame], nullptr);
 		}
 	}
+	for (size_t frame = 0; frame < clusterBuffers.size(); frame++) {
+		vkUnmapMemory(device, clusterBufferMemorys[frame]);
+		vkDestroyBuffer(device, clusterBuffers[frame], nullptr);
+		vkFreeMemory(device, clusterBufferMemorys[frame], nullptr);
+	}
 	vkDestroyDescriptorPool(device, descriptorPoolHDR, nullptr);
 	for (int i = 0; i < lightPool.size(); i++) {
 		vkDestroyDescriptorPool(device, descriptorPoolShadows[i], nullptr);
@@ -436,9 +531,15 @@ void VulkanSystem::cleanup() {
 	for (int i = 0; i < lightPool.size() + 2; i++) {
 		vkDestroyDescriptorSetLayout(device, descriptorSetLayouts[i], nullptr);
 	}
-	for (int pool = 0; pool < indexBufferMemorys.size(); pool++) {
-		vkDestroyBuffer(device, indexBuffers[pool], nullptr);
-		vkFreeMemory(device, indexBufferMemorys[pool], nullptr);
+	if (useVertexBuffer) {
+		vkDestroyBuffer(device, indexBuffer, nullptr);
+		vkFreeMemory(device, indexBufferMemory, nullptr);
+		vkDestroyBuffer(device, shortIndexBuffer, nullptr);
+		vkFreeMemory(device, shortIndexBufferMemory, nullptr);
+	}
+	for (size_t frame = 0; frame < meshletCommandBuffers.size(); frame++) {
+		vkDestroyBuffer(device, meshletCommandBuffers[frame], nullptr);
+		vkFreeMemory(device, meshletCommandBufferMemorys[frame], nullptr);
 	}
 	for (int pool = 0; pool < indexInstBufferMemorys.size(); pool++) {
 		vkDestroyBuffer(device, indexInstBuffers[pool], nullptr);
@@ -446,10 +547,16 @@ void VulkanSystem::cleanup() {
 	}
 	vkDestroyBuffer(device, vertexBuffer, nullptr);
 	vkFreeMemory(device, vertexBufferMemory, nullptr);
+	vkDestroyBuffer(device, vertexSimpleBuffer, nullptr);
+	vkFreeMemory(device, vertexSimpleBufferMemory, nullptr);
 	vkDestroyBuffer(device, vertexInstBuffer, nullptr);
 	vkFreeMemory(device, vertexInstBufferMemory, nullptr);
 	vkDestroyPipeline(device, graphicsPipeline, nullptr);
+	vkDestroyPipeline(device, graphicsSimplePipeline, nullptr);
 	vkDestroyPipeline(device, graphicsInstPipeline, nullptr);
+	for (VkPipeline pipeline : graphicsSimplePipelineShadows) {
+		vkDestroyPipeline(device, pipeline, nullptr);
+	}
 	for (int i = 0; i < lightPool.size(); i++) {
 		vkDestroyPipelineLayout(device, pipelineLayoutShadows[i], nullptr);
 	}
@@ -458,13 +565,19 @@ void VulkanSystem::cleanup() {
 	vkDestroyRenderPass(device, renderPass, nullptr);
 	for(int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
 	{
-		vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
-		vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
+		if (renderToWindow) {
+			vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
+			vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
+		}
+		else {
+			vkDestroyBuffer(device, readbackBuffers[i], nullptr);
+			vkFreeMemory(device, readbackBufferMemorys[i], nullptr);
+		}
 		vkDestroyFence(device, inFlightFences[i], nullptr);
 	}
 	vkDestroyCommandPool(device, commandPool, nullptr);
 	vkDestroyDevice(device, nullptr);
-	vkDestroySurfaceKHR(instance, surface, nullptr);
+	if (renderToWindow) vkDestroySurfaceKHR(instance, surface, nullptr);
 
 	if (enableValidationLayers) {
 		DestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
@@ -493,18 +606,21 @@ void VulkanSystem::createInstance(bool verbose) {
 	instanceCreateInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
 	instanceCreateInfo.pApplicationInfo = &appInfo;
 
-	//Extensions needed to support windows system
+	//Extensions needed to support windows system, headless rendering never presents
+	//so it does not need the surface extensions
 #ifdef PLATFORM_WIN
 
 
-	std::array<const char*, 5> requiredExtensionArray = std::array<const char*, 5>();
-	requiredExtensionArray[0] = VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME;
-	requiredExtensionArray[1] = VK_KHR_SURFACE_EXTENSION_NAME;
-	requiredExtensionArray[2] = VK_EXT_DEBUG_UTILS_EXTENSION_NAME;
-	requiredExtensionArray[3] = VK_KHR_WIN32_SURFACE_EXTENSION_NAME;
-	requiredExtensionArray[4] = VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME;
-	instanceCreateInfo.enabledExtensionCount = 5;
-	instanceCreateInfo.ppEnabledExtensionNames = requiredExtensionArray.data();
+	std::vector<const char*> requiredExtensions;
+	requiredExtensions.push_back(VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME);
+	requiredExtensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+	requiredExtensions.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+	if (renderToWindow) {
+		requiredExtensions.push_back(VK_KHR_SURFACE_EXTENSION_NAME);
+		requiredExtensions.push_back(VK_KHR_WIN32_SURFACE_EXTENSION_NAME);
+	}
+	instanceCreateInfo.enabledExtensionCount = static_cast<uint32_t>(requiredExtensions.size());
+	instanceCreateInfo.ppEnabledExtensionNames = requiredExtensions.data();
 #endif // PLATFORM_WIN
 
 #ifdef PLATFORM_LIN
@@ -551,6 +667,8 @@ void VulkanSystem::setupDebugMessenger() {
 }
 
 void VulkanSystem::createSurface() {
+	//Offscreen rendering needs no surface, so it also runs on software drivers
+	if (!renderToWindow) return;
 #ifdef PLATFORM_WIN
 
 
@@ -604,12 +722,14 @@ QueueFamilyIndices VulkanSystem::findQueueFamilies(VkPhysicalDevice device) {
 	int currentIndex = 0;
 	for (const VkQueueFamilyProperties& queueFamily : queueFamilies) {
 		VkBool32 presentSupport = false;
-		vkGetPhysicalDeviceSurfaceSupportKHR(device, currentIndex, surface, &presentSupport);
-		if (presentSupport) {
-			indices.presentFamily = currentIndex;
-		}
+		if (renderToWindow) vkGetPhysicalDeviceSurfaceSupportKHR(device, currentIndex, surface, &presentSupport);
 		if (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
 			indices.graphicsFamily = currentIndex;
+			//Nothing is presented offscreen, the graphics queue stands in
+			if (!renderToWindow) presentSupport = true;
+		}
+		if (presentSupport) {
+			indices.presentFamily = currentIndex;
 		}
 		if (indices.isComplete()) break;
 		currentIndex++;
@@ -617,6 +737,12 @@ QueueFamilyIndices VulkanSystem::findQueueFamilies(VkPhysicalDevice device) {
 	return indices;
 }
 
+//The swapchain extension is only needed when presenting to a window
+std::vector<const char*> VulkanSystem::requiredDeviceExtensions() {
+	if (renderToWindow) return deviceExtensions;
+	return std::vector<const char*>();
+}
+
 bool VulkanSystem::CheckDeviceExtensionSupport(VkPhysicalDevice device) {
 	uint32_t extensionCount;
 	vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount,
@@ -625,7 +751,8 @@ bool VulkanSystem::CheckDeviceExtensionSupport(VkPhysicalDevice device) {
 	vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount,
 		availableExtensions.data());
 
-	std::set<std::string> requiredExtensions(deviceExtensions.begin(), deviceExtensions.end());
+	std::vector<const char*> extensions = requiredDeviceExtensions();
+	std::set<std::string> requiredExtensions(extensions.begin(), extensions.end());
 	for (const VkExtensionProperties& extension : availableExtensions) {
 		requiredExtensions.erase(extension.extensionName);
 	}
@@ -663,9 +790,10 @@ VkSurfaceFormatKHR chooseSwapSurfaceFormat(const std::vector<VkSurfaceFormatKHR>
 	return availableFormats[0];
 }
 
-VkPresentModeKHR chooseSwapPresentMode(const std::vector<VkPresentModeKHR>& availablePresentmodes) {
+//FIFO is the only mode every driver has to support
+VkPresentModeKHR chooseSwapPresentMode(const std::vector<VkPresentModeKHR>& availablePresentmodes, VkPresentModeKHR preferred) {
 	for (const VkPresentModeKHR presentMode : availablePresentmodes) {
-		if (presentMode == VK_PRESENT_MODE_MAILBOX_KHR) {
+		if (presentMode == preferred) {
 			return presentMode;
 		}
 	}
@@ -703,10 +831,12 @@ int VulkanSystem::isDeviceSuitable(VkPhysicalDevice device) {
 		return -1;
 	}
 	bool swapChainSupported = false;
-	SwapChainSupportDetails swapChainSupport = querySwapChainSupport(device);
-	if (swapChainSupport.formats.empty() || swapChainSupport.presentModes.empty()) {
-		std::cout << "ERROR: Failure in finding supported swapChain attributes in VulkanSystem." << std::endl;
-		return -1;
+	if (renderToWindow) {
+		SwapChainSupportDetails swapChainSupport = querySwapChainSupport(device);
+		if (swapChainSupport.formats.empty() || swapChainSupport.presentModes.empty()) {
+			std::cout << "ERROR: Failure in finding supported swapChain attributes in VulkanSystem." << std::endl;
+			return -1;
+		}
 	}
 	int score = 0;
 	//Maximally prefer a discrete GPU
@@ -769,10 +899,16 @@ void VulkanSystem::createLogicalDevice() {
 		static_cast<uint32_t>(deviceQueueCreateInfos.size());
 	createInfo.pQueueCreateInfos = deviceQueueCreateInfos.data();
 	physicalDeviceFeatures.samplerAnisotropy = VK_TRUE;
+	//Meshlet draws are issued indirectly, with the node index as the first instance
+	VkPhysicalDeviceFeatures supportedFeatures;
+	vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+	physicalDeviceFeatures.multiDrawIndirect = supportedFeatures.multiDrawIndirect;
+	physicalDeviceFeatures.drawIndirectFirstInstance = supportedFeatures.drawIndirectFirstInstance;
 	createInfo.pEnabledFeatures = &physicalDeviceFeatures;
+	std::vector<const char*> extensions = requiredDeviceExtensions();
 	createInfo.enabledExtensionCount =
-		static_cast<uint32_t>(deviceExtensions.size());
-	createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+		static_cast<uint32_t>(extensions.size());
+	createInfo.ppEnabledExtensionNames = extensions.data();
 	createInfo.enabledLayerCount = 0;
 	if (enableValidationLayers) {
 		createInfo.enabledLayerCount =
@@ -789,13 +925,18 @@ void VulkanSystem::createLogicalDevice() {
 }
 
 void VulkanSystem::createSwapChain() {
-	SwapChainSupportDetails swapChainSupport = querySwapChainSupport(physicalDevice);
-	VkSurfaceFormatKHR surfaceFormat = chooseSwapSurfaceFormat(swapChainSupport.formats);
+	VkSurfaceFormatKHR surfaceFormat{};
+	surfaceFormat.format = VK_FORMAT_B8G8R8A8_SRGB;
 	VkExtent2D extent;
 	extent.width = mainWindow->resolution.first;
 	extent.height = mainWindow->resolution.second;
 	if (renderToWindow){
-		VkPresentModeKHR presentMode = chooseSwapPresentMode(swapChainSupport.presentModes);
+		SwapChainSupportDetails swapChainSupport = querySwapChainSupport(physicalDevice);
+		surfaceFormat = chooseSwapSurfaceFormat(swapChainSupport.formats);
+		VkPresentModeKHR presentMode = chooseSwapPresentMode(swapChainSupport.presentModes, preferredPresentMode);
+		if (verbose && presentMode != preferredPresentMode) {
+			std::cout << "WARNING: Requested present mode is unsupported, falling back to FIFO." << std::endl;
+		}
 		extent = chooseSwapExtent(swapChainSupport.capabilities, mainWindow->resolution);
 		uint32_t imageCount = swapChainSupport.capabilities.minImageCount + 1;
 		if (swapChainSupport.capabilities.maxImageCount > 0 && imageCount > swapChainSupport.capabilities.maxImageCount) {
@@ -838,6 +979,16 @@ void VulkanSystem::createSwapChain() {
 		swapChainImages.resize(imageCount);
 		vkGetSwapchainImagesKHR(device, swapChain, &imageCount, swapChainImages.data());
 	}
+	else {
+		//One offscreen image per frame in flight, copied out after rendering
+		swapChainImages.resize(MAX_FRAMES_IN_FLIGHT);
+		offscreenImageMemorys.resize(MAX_FRAMES_IN_FLIGHT);
+		for (uint32_t image = 0; image < MAX_FRAMES_IN_FLIGHT; image++) {
+			createImage(extent.width, extent.height, surfaceFormat.format,
+				VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, 0,
+				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, swapChainImages[image], offscreenImageMemorys[image]);
+		}
+	}
 	swapChainImageFormat = surfaceFormat.format;
 	swapChainExtent = extent;
 }
@@ -981,7 +1132,7 @@ void VulkanSystem::createRenderPasses() {
 		depthAttachment.format = VK_FORMAT_D16_UNORM;
 		depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
 		depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-		depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE; //Kept between frames while cached
 		depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 		depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
 		depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
@@ -1062,7 +1213,7 @@ void VulkanSystem::createRenderPasses() {
 	colorAttachmentFinal.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 	colorAttachmentFinal.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
 	colorAttachmentFinal.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-	colorAttachmentFinal.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	colorAttachmentFinal.finalLayout = renderToWindow ? VK_IMAGE_LAYOUT_PRESENT_SRC_KHR : VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
 
 	VkAttachmentReference colorAttachmentRefFinal{};
 	colorAttachmentRefFinal.attachment = 0;
@@ -1256,15 +1407,27 @@ void VulkanSystem::createDescriptorSetLayout() {
 	envTransformBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 
 
-	VkDescriptorSetLayoutBinding bindings[] = { 
+	VkDescriptorSetLayoutBinding clusterBinding{};
+	clusterBinding.binding = 13;
+	clusterBinding.descriptorCount = 1;
+	clusterBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	clusterBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+
+	std::vector<VkDescriptorSetLayoutBinding> bindings = { 
 		transformBinding, cameraBinding, materialBinding,textureBinding, 
-		cubeBinding, LUTBinding, lightTransformBinding, lightBinding, shadowMapBinding, lightPerspectiveBinding,
-		environmentBinding, normTransformBinding, envTransformBinding};
+		cubeBinding, LUTBinding, lightTransformBinding, lightBinding, shadowMapBinding, lightPerspectiveBinding};
+	if (rawEnvironment.has_value()) {
+		bindings.push_back(environmentBinding);
+		bindings.push_back(normTransformBinding);
+		bindings.push_back(envTransformBinding);
+	}
+	bindings.push_back(clusterBinding);
 
 	VkDescriptorSetLayoutCreateInfo layoutInfo{};
 	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-	layoutInfo.bindingCount = rawEnvironment.has_value() ? 13 : 10;
-	layoutInfo.pBindings = bindings;
+	layoutInfo.bindingCount = bindings.size();
+	layoutInfo.pBindings = bindings.data();
 	if (vkCreateDescriptorSetLayout(
 		device, &layoutInfo, nullptr, &descriptorSetLayouts[lightPool.size()]) != VK_SUCCESS) {
 		throw std::runtime_error("ERROR: Failed to create a descriptor set layout in Vulkan System.");
@@ -1291,25 +1454,36 @@ void VulkanSystem::createDescriptorSetLayout() {
 
 void VulkanSystem::createGraphicsPipeline(std::string vertShader, 
 	std::string fragShader, VkPipeline& pipeline, VkPipelineLayout& layout, 
-	int subpass, VkRenderPass inRenderPass) {
-	std::vector<char> vertexShaderRawData = readFile((shaderDir + vertShader).c_str());
-	std::vector<char> fragmentShaderRawData = readFile((shaderDir + fragShader).c_str());
-
-	VkShaderModule vertexShaderModule = createShaderModule(vertexShaderRawData);
-	VkShaderModule fragmentShaderModule = createShaderModule(fragmentShaderRawData);
-
-	VkPipelineShaderStageCreateInfo vertexShaderStageInfo{};
-	vertexShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-	vertexShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-	vertexShaderStageInfo.module = vertexShaderModule;
-	vertexShaderStageInfo.pName = "main";
-	VkPipelineShaderStageCreateInfo fragmentShaderStageInfo{};
-	fragmentShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-	fragmentShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-	fragmentShaderStageInfo.module = fragmentShaderModule;
-	fragmentShaderStageInfo.pName = "main";
-	VkPipelineShaderStageCreateInfo shaderStages[] = { vertexShaderStageInfo, fragmentShaderStageInfo };
+	int subpass, VkRenderPass inRenderPass, VertexInput vertexInput) {
+	PipelineRequest request;
+	request.vertShader = vertShader;
+	request.fragShader = fragShader;
+	request.pipeline = &pipeline;
+	request.layout = layout;
+	request.subpass = subpass;
+	request.renderPass = inRenderPass;
+	request.vertexInput = vertexInput;
+	pipelineRequests.push_back(request);
+}
+
+//Build every queued pipeline at once, shader modules are shared between
+//pipelines using the same file and the driver compiles on several threads
+void VulkanSystem::buildGraphicsPipelines() {
+	//Load each shader file once
+	std::map<std::string, VkShaderModule> shaderModules;
+	{
+		TraceScope scope("shader modules", verbose);
+		for (size_t request = 0; request < pipelineRequests.size(); request++) {
+			std::string shaders[] = { pipelineRequests[request].vertShader, pipelineRequests[request].fragShader };
+			for (std::string shader : shaders) {
+				if (shaderModules.find(shader) != shaderModules.end()) continue;
+				std::vector<char> shaderRawData = readFile((shaderDir + shader).c_str());
+				shaderModules[shader] = createShaderModule(shaderRawData);
+			}
+		}
+	}
 
+	//Fixed function state shared by all pipelines
 	std::vector<VkDynamicState> dynamicStates = {
 		VK_DYNAMIC_STATE_VIEWPORT,
 		VK_DYNAMIC_STATE_SCISSOR
@@ -1320,16 +1494,6 @@ void VulkanSystem::createGraphicsPipeline(std::string vertShader,
 	dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
 	dynamicState.pDynamicStates = dynamicStates.data();
 
-	VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
-	vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-	VkVertexInputBindingDescription bindingDescription = Vertex::getBindingDescription();
-	std::array<VkVertexInputAttributeDescription, 6>
-		attributeDescriptions = Vertex::getAttributeDescriptions();
-	vertexInputInfo.vertexBindingDescriptionCount = 1;
-	vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size());
-	vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
-	vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data();
-
 
 	VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
 	inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
@@ -1378,42 +1542,184 @@ void VulkanSystem::createGraphicsPipeline(std::string vertShader,
 	depthStencil.depthBoundsTestEnable = VK_FALSE;
 	depthStencil.stencilTestEnable = VK_FALSE;
 
+	//Create infos for every request, stages need stable storage
+	std::vector<std::array<VkPipelineShaderStageCreateInfo, 2>> shaderStages(pipelineRequests.size());
+	std::vector<VkPipelineVertexInputStateCreateInfo> vertexInputInfos(pipelineRequests.size());
+	std::vector<VkGraphicsPipelineCreateInfo> pipelineInfos(pipelineRequests.size());
+	for (size_t request = 0; request < pipelineRequests.size(); request++) {
+		//Vertex input comes from the layout the pipeline draws
+		VertexInput& vertexInput = pipelineRequests[request].vertexInput;
+		VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
+		vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+		vertexInputInfo.vertexBindingDescriptionCount = vertexInput.attributes.size() > 0 ? 1 : 0;
+		vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(vertexInput.attributes.size());
+		vertexInputInfo.pVertexBindingDescriptions = &vertexInput.binding;
+		vertexInputInfo.pVertexAttributeDescriptions = vertexInput.attributes.data();
+		vertexInputInfos[request] = vertexInputInfo;
+
+		VkPipelineShaderStageCreateInfo vertexShaderStageInfo{};
+		vertexShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+		vertexShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
+		vertexShaderStageInfo.module = shaderModules[pipelineRequests[request].vertShader];
+		vertexShaderStageInfo.pName = "main";
+		VkPipelineShaderStageCreateInfo fragmentShaderStageInfo{};
+		fragmentShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+		fragmentShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+		fragmentShaderStageInfo.module = shaderModules[pipelineRequests[request].fragShader];
+		fragmentShaderStageInfo.pName = "main";
+		shaderStages[request] = { vertexShaderStageInfo, fragmentShaderStageInfo };
+
+		VkGraphicsPipelineCreateInfo pipelineInfo{};
+		pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+		pipelineInfo.stageCount = 2;
+		pipelineInfo.pStages = shaderStages[request].data();
+		pipelineInfo.pVertexInputState = &vertexInputInfos[request];
+		pipelineInfo.pInputAssemblyState = &inputAssembly;
+		pipelineInfo.pViewportState = &viewportState;
+		pipelineInfo.pRasterizationState = &rasterizer;
+		pipelineInfo.pMultisampleState = &multisampling;
+		pipelineInfo.pColorBlendState = &colorBlending;
+		pipelineInfo.pDynamicState = &dynamicState;
+		pipelineInfo.pDepthStencilState = &depthStencil;
+		pipelineInfo.layout = pipelineRequests[request].layout;
+		pipelineInfo.renderPass = pipelineRequests[request].renderPass;
+		pipelineInfo.subpass = pipelineRequests[request].subpass;
+		pipelineInfos[request] = pipelineInfo;
+	}
+
+	//Split the pipelines across threads, the pipeline cache is internally synchronized
+	std::vector<VkPipeline> pipelines(pipelineRequests.size(), VK_NULL_HANDLE);
+	size_t threadCount = std::thread::hardware_concurrency();
+	if (threadCount == 0) threadCount = 1;
+	if (threadCount > pipelineRequests.size()) threadCount = pipelineRequests.size();
+	std::vector<VkResult> results(threadCount, VK_SUCCESS);
+	{
+		TraceScope scope("pipeline creation", verbose);
+		std::vector<std::thread> threads;
+		for (size_t thread = 0; thread < threadCount; thread++) {
+			size_t first = pipelineRequests.size() * thread / threadCount;
+			size_t last = pipelineRequests.size() * (thread + 1) / threadCount;
+			threads.push_back(std::thread([this, first, last, thread, &pipelineInfos, &pipelines, &results]() {
+				TRACE_SCOPE("vkCreateGraphicsPipelines");
+				results[thread] = vkCreateGraphicsPipelines(device, pipelineCache, static_cast<uint32_t>(last - first),
+					pipelineInfos.data() + first, nullptr, pipelines.data() + first);
+			}));
+		}
+		for (size_t thread = 0; thread < threads.size(); thread++) {
+			threads[thread].join();
+		}
+	}
+
+	for (auto shaderModule : shaderModules) {
+		vkDestroyShaderModule(device, shaderModule.second, nullptr);
+	}
+	for (size_t thread = 0; thread < results.size(); thread++) {
+		if (results[thread] != VK_SUCCESS) {
+			throw std::runtime_error("ERROR: Unable to create graphics pipeline in VulkanSystem.");
+		}
+	}
+	for (size_t request = 0; request < pipelineRequests.size(); request++) {
+		*pipelineRequests[request].pipeline = pipelines[request];
+	}
+
+	if (verbose) {
+		std::cout << "Built " << pipelineRequests.size() << " pipelines from " << shaderModules.size()
+			<< " shader files on " << threadCount << " threads" << std::endl;
+	}
+	pipelineRequests.clear();
+}
+
+//Seed the pipeline cache from disk, the file is only trusted when it was
+//written by the same device and driver
+void VulkanSystem::createPipelineCache() {
+	pipelineCacheFile = shaderDir + "/pipelineCache.bin";
+	pipelineCacheLoaded = false;
+
+	VkPhysicalDeviceProperties properties{};
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
 
-	VkGraphicsPipelineCreateInfo pipelineInfo{};
-	pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-	pipelineInfo.stageCount = 2;
-	pipelineInfo.pStages = shaderStages;
-	pipelineInfo.pVertexInputState = &vertexInputInfo;
-	pipelineInfo.pInputAssemblyState = &inputAssembly;
-	pipelineInfo.pViewportState = &viewportState;
-	pipelineInfo.pRasterizationState = &rasterizer;
-	pipelineInfo.pMultisampleState = &multisampling;
-	pipelineInfo.pColorBlendState = &colorBlending;
-	pipelineInfo.pDynamicState = &dynamicState;
-	pipelineInfo.pDepthStencilState = &depthStencil;
-	pipelineInfo.layout = layout;
-	pipelineInfo.renderPass = inRenderPass;
-	pipelineInfo.subpass = subpass;
-	if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS) {
-		throw std::runtime_error("ERROR: Unable to create graphics pipeline in VulkanSystem.");
+	std::vector<char> cacheData;
+	std::ifstream file(pipelineCacheFile, std::ios::binary | std::ios::ate);
+	if (file.is_open()) {
+		size_t fileSize = (size_t)file.tellg();
+		PipelineCachePrefix prefix{};
+		if (fileSize >= sizeof(PipelineCachePrefix)) {
+			file.seekg(0);
+			file.read((char*)&prefix, sizeof(PipelineCachePrefix));
+		}
+		bool valid = fileSize >= sizeof(PipelineCachePrefix) &&
+			prefix.magic == 0x4C505643 &&
+			prefix.driverVersion == properties.driverVersion &&
+			prefix.vendorID == properties.vendorID &&
+			prefix.deviceID == properties.deviceID &&
+			memcmp(prefix.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0 &&
+			prefix.dataSize == fileSize - sizeof(PipelineCachePrefix);
+		if (valid) {
+			cacheData.resize(prefix.dataSize);
+			file.read(cacheData.data(), prefix.dataSize);
+			pipelineCacheLoaded = true;
+		}
+		else {
+			std::cout << "Pipeline cache " << pipelineCacheFile << " is stale, rebuilding." << std::endl;
+		}
+		file.close();
+	}
+
+	VkPipelineCacheCreateInfo cacheInfo{};
+	cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	cacheInfo.initialDataSize = cacheData.size();
+	cacheInfo.pInitialData = cacheData.empty() ? nullptr : cacheData.data();
+	if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache) != VK_SUCCESS) {
+		//Driver rejected the data, fall back to an empty cache
+		cacheInfo.initialDataSize = 0;
+		cacheInfo.pInitialData = nullptr;
+		pipelineCacheLoaded = false;
+		if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache) != VK_SUCCESS) {
+			throw std::runtime_error("ERROR: Unable to create pipeline cache in VulkanSystem.");
+		}
 	}
+}
 
-	vkDestroyShaderModule(device, vertexShaderModule, nullptr);
-	vkDestroyShaderModule(device, fragmentShaderModule, nullptr);
+void VulkanSystem::savePipelineCache() {
+	if (pipelineCache == VK_NULL_HANDLE) return;
+	size_t dataSize = 0;
+	if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, nullptr) != VK_SUCCESS) return;
+	std::vector<char> cacheData(dataSize);
+	if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, cacheData.data()) != VK_SUCCESS) return;
 
+	VkPhysicalDeviceProperties properties{};
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+	PipelineCachePrefix prefix{};
+	prefix.magic = 0x4C505643;
+	prefix.driverVersion = properties.driverVersion;
+	prefix.vendorID = properties.vendorID;
+	prefix.deviceID = properties.deviceID;
+	memcpy(prefix.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+	prefix.dataSize = dataSize;
+
+	std::ofstream file(pipelineCacheFile, std::ios::binary | std::ios::trunc);
+	if (!file.is_open()) {
+		std::cout << "Unable to write pipeline cache " << pipelineCacheFile << std::endl;
+		return;
+	}
+	file.write((char*)&prefix, sizeof(PipelineCachePrefix));
+	file.write(cacheData.data(), dataSize);
+	file.close();
 }
 
 void VulkanSystem::createGraphicsPipelines() {
 	size_t subpassCount = 2 + lightPool.size();
 	pipelineLayoutShadows.resize(lightPool.size());
 	graphicsPipelineShadows.resize(lightPool.size());
+	graphicsSimplePipelineShadows.resize(lightPool.size());
 	graphicsInstPipelineShadows.resize(lightPool.size());
 
 	for (int i = 0; i < lightPool.size(); i++) {
 
+		//The light transform, then the placement of instance groups
 		VkPushConstantRange lightTransformConstant;
 		lightTransformConstant.offset = 0;
-		lightTransformConstant.size = sizeof(mat44<float>);
+		lightTransformConstant.size = sizeof(mat44<float>) * 2;
 		lightTransformConstant.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 		VkPipelineLayoutCreateInfo pipelineLayoutInfoShadow{};
 		pipelineLayoutInfoShadow.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
@@ -1424,9 +1730,14 @@ void VulkanSystem::createGraphicsPipelines() {
 		if (vkCreatePipelineLayout(device, &pipelineLayoutInfoShadow, nullptr, &pipelineLayoutShadows[i]) != VK_SUCCESS) {
 			throw std::runtime_error("ERROR: Unable to create pipeline layout in VulkanSystems.");
 		}
-		createGraphicsPipeline("/vertShadow.spv", "/fragShadow.spv", graphicsPipelineShadows[i], pipelineLayoutShadows[i], 0, shadowPasses[i]);
+		//Shadows only read positions, so layouts differ only in their stride and position format
+		createGraphicsPipeline("/vertShadow.spv", "/fragShadow.spv", graphicsPipelineShadows[i], pipelineLayoutShadows[i], 0, shadowPasses[i],
+			packVertices ? getVertexInput<PackedVertex>(ATTRIBUTE_POSITION) : getVertexInput<Vertex>(ATTRIBUTE_POSITION));
+		createGraphicsPipeline("/vertShadow.spv", "/fragShadow.spv", graphicsSimplePipelineShadows[i], pipelineLayoutShadows[i], 0, shadowPasses[i],
+			packVertices ? getVertexInput<PackedSimpleVertex>(ATTRIBUTE_POSITION) : getVertexInput<SimpleVertex>(ATTRIBUTE_POSITION));
 
-		createGraphicsPipeline("/vertShadowInst.spv", "/fragShadow.spv", graphicsInstPipelineShadows[i], pipelineLayoutShadows[i],0, shadowPasses[i]);
+		createGraphicsPipeline("/vertShadowInst.spv", "/fragShadow.spv", graphicsInstPipelineShadows[i], pipelineLayoutShadows[i],0, shadowPasses[i],
+			getVertexInput<Vertex>(ATTRIBUTE_POSITION));
 
 	}
 
@@ -1434,14 +1745,20 @@ void VulkanSystem::createGraphicsPipelines() {
 	numLightsConstant.offset = 0;
 	numLightsConstant.size = sizeof(int) + sizeof(float)*3 + sizeof(float);
 	numLightsConstant.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+	//Instanced draws compose their transforms with the placement of their group
+	VkPushConstantRange placementConstant;
+	placementConstant.offset = PLACEMENT_PUSH_OFFSET;
+	placementConstant.size = sizeof(mat44<float>);
+	placementConstant.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+	VkPushConstantRange hdrConstants[] = { numLightsConstant, placementConstant };
 
 
 	VkPipelineLayoutCreateInfo pipelineLayoutInfoHDR{};
 	pipelineLayoutInfoHDR.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
 	pipelineLayoutInfoHDR.setLayoutCount = 1;
 	pipelineLayoutInfoHDR.pSetLayouts = &descriptorSetLayouts[lightPool.size()];
-	pipelineLayoutInfoHDR.pushConstantRangeCount = 1;
-	pipelineLayoutInfoHDR.pPushConstantRanges = &numLightsConstant;
+	pipelineLayoutInfoHDR.pushConstantRangeCount = 2;
+	pipelineLayoutInfoHDR.pPushConstantRanges = hdrConstants;
 
 	VkPipelineLayoutCreateInfo pipelineLayoutInfoFinal{};
 	pipelineLayoutInfoFinal.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
@@ -1459,16 +1776,24 @@ void VulkanSystem::createGraphicsPipelines() {
 		throw std::runtime_error("ERROR: Unable to create pipeline layout in VulkanSystems.");
 	}
 
+	//Packed vertices use shader variants that decode them
+	std::string packedVariant = packVertices ? "Packed" : "";
+	VertexInput standardInput = packVertices ? getVertexInput<PackedVertex>() : getVertexInput<Vertex>();
+	VertexInput simpleInput = packVertices ? getVertexInput<PackedSimpleVertex>() : getVertexInput<SimpleVertex>();
 	if (rawEnvironment.has_value()) {
-		createGraphicsPipeline("/vertEnv.spv", "/fragEnv.spv", graphicsPipeline, pipelineLayoutHDR, subpassCount-2,renderPass);
+		createGraphicsPipeline("/vertEnv" + packedVariant + ".spv", "/fragEnv.spv", graphicsPipeline, pipelineLayoutHDR, subpassCount-2,renderPass, standardInput);
+		createGraphicsPipeline("/vertEnvSimple" + packedVariant + ".spv", "/fragEnv.spv", graphicsSimplePipeline, pipelineLayoutHDR, subpassCount - 2, renderPass, simpleInput);
 
-		createGraphicsPipeline("/vertInstEnv.spv", "/fragEnv.spv", graphicsInstPipeline, pipelineLayoutHDR, 0, renderPass);
+		createGraphicsPipeline("/vertInstEnv.spv", "/fragEnv.spv", graphicsInstPipeline, pipelineLayoutHDR, 0, renderPass, getVertexInput<Vertex>());
 	}
 	else {
-		createGraphicsPipeline("/vert.spv", "/frag.spv", graphicsPipeline, pipelineLayoutHDR, 0, renderPass);
-		createGraphicsPipeline("/vertInst.spv", "/frag.spv", graphicsInstPipeline, pipelineLayoutHDR, 0, renderPass);
+		createGraphicsPipeline("/vert" + packedVariant + ".spv", "/frag.spv", graphicsPipeline, pipelineLayoutHDR, 0, renderPass, standardInput);
+		createGraphicsPipeline("/vertSimple" + packedVariant + ".spv", "/frag.spv", graphicsSimplePipeline, pipelineLayoutHDR, 0, renderPass, simpleInput);
+		createGraphicsPipeline("/vertInst.spv", "/frag.spv", graphicsInstPipeline, pipelineLayoutHDR, 0, renderPass, getVertexInput<Vertex>());
 	}
-	createGraphicsPipeline("/vertQuad.spv", "/fragFinal.spv", graphicsPipelineFinal, pipelineLayoutFinal, 1, renderPass);
+	//The full screen quad is generated from the vertex index
+	createGraphicsPipeline("/vertQuad.spv", "/fragFinal.spv", graphicsPipelineFinal, pipelineLayoutFinal, 1, renderPass, VertexInput{});
+	buildGraphicsPipelines();
 }
 
 VkShaderModule VulkanSystem::createShaderModule(const std::vector<char>& code) {
@@ -1620,33 +1945,105 @@ void VulkanSystem::copyBuffer(VkBuffer source, VkBuffer dest,
 	endSingleTimeCommands(commandBuffer);
 }
 
-void VulkanSystem::createVertexBuffer(bool realloc) {
-	useVertexBuffer = false;
+//Stage data and copy it into a device vertex buffer
+void VulkanSystem::uploadVertices(const void* source, VkDeviceSize bufferSize, VkBuffer& buffer, VkDeviceMemory& bufferMemory, bool realloc) {
 	int stagingBits = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
 	int vertexUsageBits = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
 	int vertexPropertyBits = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-	if (vertices.size() != 0) {
-		useVertexBuffer = true;
 
-		//Create temp staging buffer
-		VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
-		VkBuffer stagingBuffer{};
-		VkDeviceMemory stagingBufferMemory{};
-		createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, stagingBits,
-			stagingBuffer, stagingBufferMemory, true);
+	//Create temp staging buffer
+	VkBuffer stagingBuffer{};
+	VkDeviceMemory stagingBufferMemory{};
+	createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, stagingBits,
+		stagingBuffer, stagingBufferMemory, true);
 
-		//Move vertex data to GPU
-		void* data;
-		vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-		memcpy(data, vertices.data(), (size_t)bufferSize);
-		vkUnmapMemory(device, stagingBufferMemory);
+	//Move vertex data to GPU
+	void* data;
+	vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
+	memcpy(data, source, (size_t)bufferSize);
+	frameStats.stagedBytes += bufferSize;
+	vkUnmapMemory(device, stagingBufferMemory);
+
+	//Create proper vertex buffer
+	createBuffer(bufferSize, vertexUsageBits, vertexPropertyBits,
+		buffer, bufferMemory, realloc);
+	copyBuffer(stagingBuffer, buffer, bufferSize);
+	vkDestroyBuffer(device, stagingBuffer, nullptr);
+	vkFreeMemory(device, stagingBufferMemory, nullptr);
+}
 
-		//Create proper vertex buffer
-		createBuffer(bufferSize, vertexUsageBits, vertexPropertyBits,
-			vertexBuffer, vertexBufferMemory, realloc);
-		copyBuffer(stagingBuffer, vertexBuffer, bufferSize);
-		vkDestroyBuffer(device, stagingBuffer, nullptr);
-		vkFreeMemory(device, stagingBufferMemory, nullptr);
+//Quantize one layout against the bounds of each mesh range, and record the mapping
+//from those bounds back to mesh space for every node drawing that range
+template <typename P, typename V>
+std::vector<P> VulkanSystem::packVertexLayout(const std::vector<V>& source) {
+	std::vector<P> packed(source.size());
+	std::map<int, mat44<float>> dequantizeRanges;
+	for (size_t pool = 0; pool < drawPools.size(); pool++) {
+		for (size_t node = 0; node < drawPools[pool].size(); node++) {
+			const DrawNode& drawNode = drawPools[pool][node];
+			if (drawNode.layout != P::layout) continue;
+			auto range = dequantizeRanges.find(drawNode.start);
+			if (range == dequantizeRanges.end()) {
+				float_3 boundsMin = drawNode.boundingBox.first;
+				float_3 boundsMax = drawNode.boundingBox.second;
+				float_3 boundsExtent = boundsMax - boundsMin;
+				for (int vert = drawNode.start; vert < drawNode.start + drawNode.count; vert++) {
+					packed[vert] = packVertex<P>(source[vert], boundsMin, boundsExtent);
+				}
+				mat44<float> dequantize = mat44<float>(1);
+				dequantize.data[0][0] = boundsExtent.x;
+				dequantize.data[1][1] = boundsExtent.y;
+				dequantize.data[2][2] = boundsExtent.z;
+				dequantize.data[3][0] = boundsMin.x;
+				dequantize.data[3][1] = boundsMin.y;
+				dequantize.data[3][2] = boundsMin.z;
+				range = dequantizeRanges.insert(std::make_pair(drawNode.start, dequantize)).first;
+			}
+			dequantizePools[pool][node] = range->second;
+		}
+	}
+	return packed;
+}
+
+void VulkanSystem::createVertexBuffer(bool realloc) {
+	TRACE_SCOPE("createVertexBuffer");
+	useVertexBuffer = false;
+	int stagingBits = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	int vertexUsageBits = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+	int vertexPropertyBits = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	useVertexBuffer = vertices.size() != 0 || verticesSimple.size() != 0;
+	size_t vertexBytes = 0;
+	if (packVertices) {
+		dequantizePools.resize(drawPools.size());
+		for (size_t pool = 0; pool < drawPools.size(); pool++) {
+			dequantizePools[pool].assign(drawPools[pool].size(), mat44<float>(1));
+		}
+		std::vector<PackedVertex> packedStandard = packVertexLayout<PackedVertex>(vertices);
+		std::vector<PackedSimpleVertex> packedSimple = packVertexLayout<PackedSimpleVertex>(verticesSimple);
+		if (packedStandard.size() != 0) {
+			uploadVertices(packedStandard.data(), sizeof(PackedVertex) * packedStandard.size(),
+				vertexBuffer, vertexBufferMemory, realloc);
+		}
+		if (packedSimple.size() != 0) {
+			uploadVertices(packedSimple.data(), sizeof(PackedSimpleVertex) * packedSimple.size(),
+				vertexSimpleBuffer, vertexSimpleBufferMemory, realloc);
+		}
+		vertexBytes = sizeof(PackedVertex) * packedStandard.size() + sizeof(PackedSimpleVertex) * packedSimple.size();
+	}
+	else {
+		if (vertices.size() != 0) {
+			uploadVertices(vertices.data(), sizeof(Vertex) * vertices.size(),
+				vertexBuffer, vertexBufferMemory, realloc);
+		}
+		if (verticesSimple.size() != 0) {
+			uploadVertices(verticesSimple.data(), sizeof(SimpleVertex) * verticesSimple.size(),
+				vertexSimpleBuffer, vertexSimpleBufferMemory, realloc);
+		}
+		vertexBytes = sizeof(Vertex) * vertices.size() + sizeof(SimpleVertex) * verticesSimple.size();
+	}
+	if (verbose) {
+		std::cout << "MEASURE vertex memory: " << vertexBytes << " bytes, " << vertices.size() << " standard and " <<
+			verticesSimple.size() << " simple vertices" << (packVertices ? ", packed" : "") << std::endl;
 	}
 
 	if (useInstancing) {
@@ -1662,6 +2059,7 @@ void VulkanSystem::createVertexBuffer(bool realloc) {
 		void* data;
 		vkMapMemory(device, stagingInstBufferMemory, 0, bufferInstSize, 0, &data);
 		memcpy(data, verticesInst.data(), (size_t)bufferInstSize);
+		frameStats.stagedBytes += bufferInstSize;
 		vkUnmapMemory(device, stagingInstBufferMemory);
 
 		//Create proper vertex buffer
@@ -1933,7 +2331,34 @@ mat44<float> VulkanSystem::getCameraSpace(DrawCamera camera, float_3 useMoveVec,
 	return local;
 }
 
+//Pick a level by the fraction of the screen height the bounding sphere covers,
+//each level down is used once coverage halves again
+int selectLod(std::pair<float_3, float> boundingSphere, mat44<float> transform, float_3 cameraPos,
+	float tanHalfFov, int lodCount) {
+	if (lodCount <= 1) return 0;
+	float scale = 0;
+	for (int axis = 0; axis < 3; axis++) {
+		float_3 column = float_3(transform.data[axis][0], transform.data[axis][1], transform.data[axis][2]);
+		scale = fmaxf(scale, column.norm());
+	}
+	float_3 center = boundingSphere.first;
+	float_4 worldCenter = transform * float_4(center.x, center.y, center.z, 1);
+	float_3 toCenter = float_3(worldCenter.x, worldCenter.y, worldCenter.z) - cameraPos;
+	float radius = boundingSphere.second * scale;
+	float distance = toCenter.norm();
+	if (distance <= radius) return 0;
+	float coverage = radius / (distance * tanHalfFov);
+	int lod = 0;
+	float limit = LOD_COVERAGE;
+	while (lod + 1 < lodCount && coverage < limit) {
+		lod++;
+		limit *= 0.5f;
+	}
+	return lod;
+}
+
 void VulkanSystem::cullInstances() {
+	TRACE_SCOPE("cullInstances");
 
 	if (transformInstPools.size() < transformInstPoolsStore.size()) {
 		transformInstPools = std::vector<std::vector<mat44<float>>>(transformInstPoolsStore.size());
@@ -1943,7 +2368,17 @@ void VulkanSystem::cullInstances() {
 	DrawCamera camera = cameras[currentCamera];
 	frustumInfo info = findFrustumInfo(camera);
 	mat44<float> cameraSpace = getCameraSpace(camera, moveVec, dirVec);
+	float_3 cameraPos = moveVec + camera.forAnimate.translate;
+	float tanHalfFov = tan(camera.perspectiveInfo.vfov / 2.0);
+	instanceLodCounts.resize(transformInstPools.size());
+	visiblePlacementPools.resize(transformInstPools.size());
+	std::vector<std::vector<size_t>> levelInstances(MAX_LODS);
 	for (size_t pool = 0; pool < transformInstPools.size(); pool++) {
+		visiblePlacementPools[pool].clear();
+		if (pool < placementInstPoolsStore.size() && !placementInstPoolsStore[pool].empty()) {
+			cullPlacements(pool, info, cameraSpace, cameraPos, tanHalfFov);
+			continue;
+		}
 		transformInstPools[pool].clear();
 		transformInstPools[pool].reserve(transformInstPoolsStore[pool].size());
 		if (rawEnvironment.has_value()) {
@@ -1952,8 +2387,22 @@ void VulkanSystem::cullInstances() {
 		}
 		transformNormalInstPools[pool].clear();
 		transformNormalInstPools[pool].reserve(transformInstPoolsStore[pool].size());
+		//Visible instances are grouped by level so each level is one instanced draw
+		int meshPool = transformInstIndexPools[pool];
+		int lodCount = useLods ? static_cast<int>(lodRangesInst[meshPool].size()) : 1;
+		for (std::vector<size_t>& level : levelInstances) level.clear();
 		for (size_t transform = 0; transform < transformInstPoolsStore[pool].size(); transform++) {
-			if (!useCulling || sphereInFrustum(boundingSpheresInst[transformInstIndexPools[pool]], info, cameraSpace, transformInstPoolsStore[pool][transform])) {
+			if (!useCulling || sphereInFrustum(boundingSpheresInst[meshPool], info, cameraSpace, transformInstPoolsStore[pool][transform])) {
+				frameStats.instancesVisible++;
+				levelInstances[selectLod(boundingSpheresInst[meshPool], transformInstPoolsStore[pool][transform],
+					cameraPos, tanHalfFov, lodCount)].push_back(transform);
+			}
+			else frameStats.instancesCulled++;
+		}
+		instanceLodCounts[pool].assign(lodCount, 0);
+		for (int level = 0; level < lodCount; level++) {
+			instanceLodCounts[pool][level] = static_cast<uint32_t>(levelInstances[level].size());
+			for (size_t transform : levelInstances[level]) {
 				transformInstPools[pool].push_back(transformInstPoolsStore[pool][transform]);
 				if (rawEnvironment.has_value()) {
 					transformEnvironmentInstPools[pool].push_back(transformEnvironmentInstPoolsStore[pool][transform]);
@@ -1964,26 +2413,281 @@ void VulkanSystem::cullInstances() {
 	}
 }
 
-void VulkanSystem::cullIndexPools() {
-	if (indexPools.size() < indexPoolsStore.size()) {
-		indexPools = std::vector<std::vector<uint32_t>>(indexPoolsStore.size());
-		indexBuffersValid = std::vector<bool>(indexPoolsStore.size());
+//Grouped pools are culled per placement against a sphere around all their instances, and each
+//visible placement draws every instance at one LOD. Their transforms never change.
+void VulkanSystem::cullPlacements(size_t pool, const frustumInfo& info, mat44<float> cameraSpace,
+	float_3 cameraPos, float tanHalfFov) {
+	int meshPool = transformInstIndexPools[pool];
+	int lodCount = useLods ? static_cast<int>(lodRangesInst[meshPool].size()) : 1;
+	uint32_t instanceCount = static_cast<uint32_t>(transformInstPoolsStore[pool].size());
+	std::pair<float_3, float> memberSphere = std::make_pair(groupBoundsInst[pool].first, memberRadiiInst[pool]);
+	for (mat44<float> placement : placementInstPoolsStore[pool]) {
+		if (!useCulling || sphereInFrustum(groupBoundsInst[pool], info, cameraSpace, placement)) {
+			frameStats.instancesVisible += instanceCount;
+			visiblePlacementPools[pool].push_back(std::make_pair(placement,
+				selectLod(memberSphere, placement, cameraPos, tanHalfFov, lodCount)));
+		}
+		else frameStats.instancesCulled += instanceCount;
+	}
+	instanceLodCounts[pool].clear();
+	if (visiblePlacementPools[pool].empty()) {
+		transformInstPools[pool].clear();
+		transformNormalInstPools[pool].clear();
+		if (rawEnvironment.has_value()) transformEnvironmentInstPools[pool].clear();
+		return;
+	}
+	if (transformInstPools[pool].size() == instanceCount) return;
+	transformInstPools[pool] = transformInstPoolsStore[pool];
+	transformNormalInstPools[pool] = transformNormalInstPoolsStore[pool];
+	if (rawEnvironment.has_value()) transformEnvironmentInstPools[pool] = transformEnvironmentInstPoolsStore[pool];
+}
+
+//Only selects which nodes are drawn, the shared index buffer itself never changes
+void VulkanSystem::cullDrawPools() {
+	TRACE_SCOPE("cullDrawPools");
+	DrawCamera camera = cameras[currentCamera];
+	frustumInfo info = findFrustumInfo(camera);
+	mat44<float> cameraSpace = getCameraSpace(camera, moveVec, dirVec);
+	float_3 cameraPos = moveVec + camera.forAnimate.translate;
+	float tanHalfFov = tan(camera.perspectiveInfo.vfov / 2.0);
+	visibleNodePools.resize(drawPools.size());
+	for (size_t pool = 0; pool < drawPools.size(); pool++) {
+		visibleNodePools[pool].clear();
+		for (size_t node = 0; node < drawPools[pool].size(); node++) {
+			DrawNode& drawNode = drawPools[pool][node];
+			if (!useCulling || sphereInFrustum(drawNode.boundingSphere, info, cameraSpace, transformPools[pool][node])) {
+				drawNode.lod = useLods ? selectLod(drawNode.boundingSphere, transformPools[pool][node],
+					cameraPos, tanHalfFov, drawNode.lodCount) : 0;
+				visibleNodePools[pool].push_back(static_cast<uint32_t>(node));
+				frameStats.nodesVisible++;
+			}
+			else frameStats.nodesCulled++;
+		}
 	}
+}
+
+//Test the meshlets of every visible node against the frustum and their normal cones, then
+//write the survivors as indirect draws grouped by the state they are drawn with
+void VulkanSystem::cullMeshlets(uint32_t frame) {
+	TRACE_SCOPE("cullMeshlets");
+	meshletDrawGroups.clear();
+	if (meshletCommandsMapped.empty()) return;
 	DrawCamera camera = cameras[currentCamera];
 	frustumInfo info = findFrustumInfo(camera);
 	mat44<float> cameraSpace = getCameraSpace(camera, moveVec, dirVec);
+	float_3 cameraPos = moveVec + camera.forAnimate.translate;
+	VkDrawIndexedIndirectCommand* commands = (VkDrawIndexedIndirectCommand*)meshletCommandsMapped[frame];
+	uint32_t commandCount = 0;
+	for (int layout = 0; layout < LAYOUT_COUNT; layout++) {
+		for (size_t pool = 0; pool < transformPools.size() && pool < visibleNodePools.size(); pool++) {
+			for (int width = 0; width < 2; width++) {
+				MeshletDrawGroup group;
+				group.layout = layout;
+				group.pool = pool;
+				group.shortIndices = width == 1;
+				group.first = commandCount;
+				for (uint32_t node : visibleNodePools[pool]) {
+					const DrawNode& drawNode = drawPools[pool][node];
+					if (drawNode.layout != layout || drawNode.shortIndices != group.shortIndices) continue;
+					//Meshlets only cover the full mesh, simplified levels are drawn whole
+					if (drawNode.meshletCount == 0 || drawNode.lod > 0) {
+						commands[commandCount++] = { static_cast<uint32_t>(drawNode.lodIndexCount[drawNode.lod]), 1,
+							static_cast<uint32_t>(drawNode.lodIndexStart[drawNode.lod]), drawNode.start, node };
+						frameStats.indicesDrawn += drawNode.lodIndexCount[drawNode.lod];
+						continue;
+					}
+					mat44<float> transform = transformPools[pool][node];
+					//Radii grow with the largest axis scale. The normal cone only keeps its shape under
+					//rotation and uniform scale, any other transform skips the cone test.
+					float_3 columns[3];
+					float scale = 0;
+					float minScale = INFINITY;
+					for (int axis = 0; axis < 3; axis++) {
+						columns[axis] = float_3(transform.data[axis][0], transform.data[axis][1], transform.data[axis][2]);
+						scale = fmaxf(scale, columns[axis].norm());
+						minScale = fminf(minScale, columns[axis].norm());
+					}
+					float tolerance = 1e-4f * scale * scale;
+					bool coneTest = minScale > 0 && scale - minScale <= 1e-4f * scale &&
+						fabsf(columns[0].dot(columns[1])) <= tolerance && fabsf(columns[0].dot(columns[2])) <= tolerance &&
+						fabsf(columns[1].dot(columns[2])) <= tolerance && columns[0].cross(columns[1]).dot(columns[2]) > 0;
+					for (int index = drawNode.meshletStart; index < drawNode.meshletStart + drawNode.meshletCount; index++) {
+						const Meshlet& meshlet = meshlets[index];
+						bool visible = sphereInFrustum(meshlet.boundingSphere, info, cameraSpace, transform);
+						if (visible && coneTest && meshlet.coneCutoff < 1) {
+							//Culled when the camera sees only the back of every triangle in the cluster
+							float_3 center = meshlet.boundingSphere.first;
+							float_4 worldCenter = transform * float_4(center.x, center.y, center.z, 1);
+							float_4 worldAxis = transform * float_4(meshlet.coneAxis.x, meshlet.coneAxis.y, meshlet.coneAxis.z, 0);
+							float_3 axis = float_3(worldAxis.x, worldAxis.y, worldAxis.z);
+							float axisLength = axis.norm();
+							float_3 toCenter = float_3(worldCenter.x, worldCenter.y, worldCenter.z) - cameraPos;
+							if (axisLength > 0 && toCenter.dot(axis) / axisLength >=
+								meshlet.coneCutoff * toCenter.norm() + meshlet.boundingSphere.second * scale) {
+								visible = false;
+							}
+						}
+						if (visible) {
+							commands[commandCount++] = { static_cast<uint32_t>(meshlet.indexCount), 1,
+								static_cast<uint32_t>(meshlet.indexStart), drawNode.start, node };
+							frameStats.indicesDrawn += meshlet.indexCount;
+							frameStats.meshletsVisible++;
+						}
+						else frameStats.meshletsCulled++;
+					}
+				}
+				group.count = commandCount - group.first;
+				if (group.count > 0) meshletDrawGroups.push_back(group);
+			}
+		}
+	}
+}
+
+frustumInfo findLightFrustumInfo(DrawLight light) {
+	//Matches the perspective used to build worldTolightPerspPool
+	DrawCamera lightCamera;
+	lightCamera.perspectiveInfo.aspect = 1;
+	lightCamera.perspectiveInfo.vfov = light.fov;
+	lightCamera.perspectiveInfo.nearP = 0.01f;
+	lightCamera.perspectiveInfo.farP = 1000.f;
+	return findFrustumInfo(lightCamera);
+}
+
+bool transformChanged(const mat44<float>& a, const mat44<float>& b) {
+	return memcmp(a.data, b.data, sizeof(a.data)) != 0;
+}
+
+//Compare the newly navigated scene against the current one, and mark any
+//light whose transform changed or whose frustum saw a caster move as dirty
+void VulkanSystem::markShadowsDirty(const DrawList& drawList) {
+	//Collect moved casters once, as a bounding sphere with its old and new transforms
+	struct MovedCaster {
+		std::pair<float_3, float> boundingSphere;
+		mat44<float> oldTransform;
+		mat44<float> newTransform;
+	};
+	std::vector<MovedCaster> movedCasters;
+	for (size_t pool = 0; pool < drawPools.size() && pool < drawList.transformPools.size(); pool++) {
+		for (size_t node = 0; node < drawPools[pool].size() && node < drawList.transformPools[pool].size(); node++) {
+			if (transformChanged(transformPools[pool][node], drawList.transformPools[pool][node])) {
+				movedCasters.push_back({ drawPools[pool][node].boundingSphere,
+					transformPools[pool][node], drawList.transformPools[pool][node] });
+			}
+		}
+	}
+	for (size_t pool = 0; pool < transformInstPoolsStore.size() && pool < drawList.instancedTransformPools.size(); pool++) {
+		std::pair<float_3, float> boundingSphere = boundingSpheresInst[transformInstIndexPools[pool]];
+		for (size_t transform = 0; transform < transformInstPoolsStore[pool].size() && 
+			transform < drawList.instancedTransformPools[pool].size(); transform++) {
+			if (transformChanged(transformInstPoolsStore[pool][transform], drawList.instancedTransformPools[pool][transform])) {
+				movedCasters.push_back({ boundingSphere,
+					transformInstPoolsStore[pool][transform], drawList.instancedTransformPools[pool][transform] });
+			}
+		}
+	}
+	//Grouped pools only move with their placements
+	for (size_t pool = 0; pool < placementInstPoolsStore.size() && pool < drawList.instancedPlacementPools.size(); pool++) {
+		for (size_t placement = 0; placement < placementInstPoolsStore[pool].size() &&
+			placement < drawList.instancedPlacementPools[pool].size(); placement++) {
+			if (transformChanged(placementInstPoolsStore[pool][placement], drawList.instancedPlacementPools[pool][placement])) {
+				movedCasters.push_back({ groupBoundsInst[pool],
+					placementInstPoolsStore[pool][placement], drawList.instancedPlacementPools[pool][placement] });
+			}
+		}
+	}
+
+	for (size_t light = 0; light < lightPool.size(); light++) {
+		if (lightPool[light].shadowRes == 0 || shadowDirty[light]) continue;
+		if (light >= drawList.worldToLightsPersp.size() ||
+			transformChanged(worldTolightPerspPool[light], drawList.worldToLightsPersp[light])) {
+			shadowDirty[light] = true;
+			continue;
+		}
+		//Only spot lights have a usable frustum, any other light is dirtied by any moving caster
+		bool testFrustum = lightPool[light].type == LIGHT_SPOT;
+		frustumInfo info = findLightFrustumInfo(lightPool[light]);
+		for (MovedCaster& caster : movedCasters) {
+			//Test both positions, as the caster may have moved out of the frustum
+			if (!testFrustum ||
+				sphereInFrustum(caster.boundingSphere, info, worldTolightPool[light], caster.oldTransform) ||
+				sphereInFrustum(caster.boundingSphere, info, worldTolightPool[light], caster.newTransform)) {
+				shadowDirty[light] = true;
+				break;
+			}
+		}
+	}
+}
+
+//Orthographic light volumes are affine, so a sphere maps to an ellipsoid
+//whose extent along each clip axis is the radius times that row's length
+bool sphereInOrthoVolume(std::pair<float_3, float> boundingSphere, mat44<float> toClipSpace) {
+	float_3 center = toClipSpace * boundingSphere.first;
+	if (center.x != center.x || center.y != center.y || center.z != center.z) return false;
+	float extents[3];
+	for (int axis = 0; axis < 3; axis++) {
+		float_3 row = float_3(toClipSpace.data[0][axis], toClipSpace.data[1][axis], toClipSpace.data[2][axis]);
+		extents[axis] = boundingSphere.second * row.norm();
+	}
+	if (center.x + extents[0] < -1 || center.x - extents[0] > 1) return false;
+	if (center.y + extents[1] < -1 || center.y - extents[1] > 1) return false;
+	if (center.z + extents[2] < 0 || center.z - extents[2] > 1) return false;
+	return true;
+}
+
+//Build the list of casters visible to a light, as visible nodes for
+//standard pools and culled transforms for instanced pools
+void VulkanSystem::cullShadowCasters(int light) {
+	TRACE_SCOPE("cullShadowCasters");
+	DrawLight drawLight = lightPool[light];
+	//Sphere lights have no single volume to cull against
+	bool testSpot = useCulling && drawLight.type == LIGHT_SPOT;
+	bool testSun = useCulling && drawLight.type == LIGHT_SUN;
+	frustumInfo info = findLightFrustumInfo(drawLight);
+	mat44<float> toLightClip = worldTolightPerspPool[light];
+	shadowCasters[light] = 0;
+
+	shadowNodePools[light].resize(drawPools.size());
 	for (size_t pool = 0; pool < drawPools.size(); pool++) {
-		indexPools[pool].clear();
-		indexPools[pool].reserve(indexPoolsStore[pool].size());
+		std::vector<uint32_t>& casters = shadowNodePools[light][pool];
+		casters.clear();
 		for (size_t node = 0; node < drawPools[pool].size(); node++) {
-			if (!useCulling || sphereInFrustum(drawPools[pool][node].boundingSphere, info, cameraSpace, transformPools[pool][node])) {
-				int indexBegin = drawPools[pool][node].indexStart;
-				int indexEnd = drawPools[pool][node].indexCount + indexBegin;
-				indexPools[pool].insert(
-					indexPools[pool].end(),
-					indexPoolsStore[pool].begin() + indexBegin,
-					indexPoolsStore[pool].begin() + indexEnd);
+			DrawNode& drawNode = drawPools[pool][node];
+			if ((testSpot && !sphereInFrustum(drawNode.boundingSphere, info, worldTolightPool[light], transformPools[pool][node])) ||
+				(testSun && !sphereInOrthoVolume(drawNode.boundingSphere, toLightClip * transformPools[pool][node]))) {
+				continue;
+			}
+			shadowCasters[light]++;
+			casters.push_back(static_cast<uint32_t>(node));
+		}
+	}
+
+	shadowInstPools[light].resize(transformInstPoolsStore.size());
+	shadowPlacementPools[light].resize(transformInstPoolsStore.size());
+	for (size_t pool = 0; pool < transformInstPoolsStore.size(); pool++) {
+		std::pair<float_3, float> boundingSphere = boundingSpheresInst[transformInstIndexPools[pool]];
+		shadowInstPools[light][pool].clear();
+		shadowPlacementPools[light][pool].clear();
+		//Grouped pools cast all their instances from every placement the light sees
+		if (pool < placementInstPoolsStore.size() && !placementInstPoolsStore[pool].empty()) {
+			for (mat44<float> placement : placementInstPoolsStore[pool]) {
+				if ((testSpot && !sphereInFrustum(groupBoundsInst[pool], info, worldTolightPool[light], placement)) ||
+					(testSun && !sphereInOrthoVolume(groupBoundsInst[pool], toLightClip * placement))) {
+					continue;
+				}
+				shadowCasters[light] += transformInstPoolsStore[pool].size();
+				shadowPlacementPools[light][pool].push_back(placement);
+			}
+			if (!shadowPlacementPools[light][pool].empty()) shadowInstPools[light][pool] = transformInstPoolsStore[pool];
+			continue;
+		}
+		for (size_t transform = 0; transform < transformInstPoolsStore[pool].size(); transform++) {
+			mat44<float> toWorld = transformInstPoolsStore[pool][transform];
+			if ((testSpot && !sphereInFrustum(boundingSphere, info, worldTolightPool[light], toWorld)) ||
+				(testSun && !sphereInOrthoVolume(boundingSphere, toLightClip * toWorld))) {
+				continue;
 			}
+			shadowCasters[light]++;
+			shadowInstPools[light][pool].push_back(toWorld);
 		}
 	}
 }
@@ -2274,12 +2978,23 @@ void VulkanSystem::createTextureImage(Texture tex, VkImage& image,
 }
 
 void VulkanSystem::createTextureImages() {
-	textureImages.resize(rawTextures.size());
-	textureImageMemorys.resize(rawTextures.size());
-	textureImageViews.resize(rawTextures.size());
-	textureSamplers.resize(rawTextures.size());
+	textureImages = std::vector<VkImage>(rawTextures.size(), VK_NULL_HANDLE);
+	textureImageMemorys = std::vector<VkDeviceMemory>(rawTextures.size(), VK_NULL_HANDLE);
+	textureImageViews = std::vector<VkImageView>(rawTextures.size(), VK_NULL_HANDLE);
+	textureSamplers = std::vector<VkSampler>(rawTextures.size(), VK_NULL_HANDLE);
+	createTextureImage(LUT, LUTImage, LUTImageMemory, LUTImageView, LUTSampler);
+	createTextureImage(defaultShadowTex, defaultShadowImage, defaultShadowImageMemory, defaultShadowImageView, defaultShadowSampler);
+	std::vector<size_t> deferredTextures;
 	for (size_t texInd = 0; texInd < rawTextures.size(); texInd++) {
 		Texture tex = rawTextures[texInd];
+		if (tex.deferred()) {
+			//Headless output has to match from the first frame, so nothing streams in there
+			if (renderToWindow) {
+				deferredTextures.push_back(texInd);
+				continue;
+			}
+			tex = Texture::parseTexture(tex.path, false);
+		}
 		createTextureImage(
 			tex,
 			textureImages[texInd],
@@ -2288,8 +3003,6 @@ void VulkanSystem::createTextureImages() {
 			textureSamplers[texInd]
 		);
 	}
-	createTextureImage(LUT, LUTImage, LUTImageMemory, LUTImageView, LUTSampler);
-	createTextureImage(defaultShadowTex, defaultShadowImage, defaultShadowImageMemory, defaultShadowImageView, defaultShadowSampler);
 	cubeImages.resize(rawCubes.size());
 	cubeImageMemorys.resize(rawCubes.size());
 	cubeImageViews.resize(rawCubes.size());
@@ -2313,65 +3026,146 @@ void VulkanSystem::createTextureImages() {
 			environmentSampler
 		);
 	}
-	int a = 0;
 
+	//Deferred textures draw with the default texture until decoded on the stream thread
+	textureGeneration = 0;
+	textureDescriptorGenerations = std::vector<uint64_t>(MAX_FRAMES_IN_FLIGHT, 0);
+	if (deferredTextures.size() > 0) {
+		textureStreamStop = false;
+		textureStreamRemaining = deferredTextures.size();
+		textureStreamThread = std::thread(&VulkanSystem::textureStreamMain, this, deferredTextures);
+	}
 }
 
+//Descriptor for a texture slot, the default texture stands in until the slot is uploaded
+VkDescriptorImageInfo VulkanSystem::textureDescriptor(size_t tex) {
+	VkDescriptorImageInfo imageInfo{};
+	imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	bool loaded = textureImageViews[tex] != VK_NULL_HANDLE;
+	imageInfo.imageView = loaded ? textureImageViews[tex] : defaultShadowImageView;
+	imageInfo.sampler = loaded ? textureSamplers[tex] : defaultShadowSampler;
+	return imageInfo;
+}
 
-void VulkanSystem::createIndexBuffers(bool realloc, bool andFree) {
-	if (andFree) {
-		for (int pool = 0; pool < indexBufferMemorys.size(); pool++) {
-			if (!indexBuffersValid[pool]) continue;
-			vkDestroyBuffer(device, indexBuffers[pool], nullptr);
-			vkFreeMemory(device, indexBufferMemorys[pool], nullptr);
-		}
-		for (int pool = 0; pool < indexInstBufferMemorys.size(); pool++) {
-			vkDestroyBuffer(device, indexInstBuffers[pool], nullptr);
-			vkFreeMemory(device, indexInstBufferMemorys[pool], nullptr);
-		}
-	}
-	if (useVertexBuffer) {
-		cullIndexPools();
-		for (int pool = 0; pool < indexPools.size(); pool++) {
-			if (indexPools[pool].size() == 0) {
-				indexBuffersValid[pool] = false;
+void VulkanSystem::textureStreamMain(std::vector<size_t> deferredTextures) {
+	Profiler::nameThread("texture streaming");
+	for (size_t texInd : deferredTextures) {
+		if (textureStreamStop) return;
+		StreamedTexture streamed;
+		streamed.index = texInd;
+		{
+			TRACE_SCOPE("decode texture");
+			try {
+				streamed.texture = Texture::parseTexture(rawTextures[texInd].path, false);
 			}
-			else {
-				indexBuffersValid[pool] = true;
+			catch (std::runtime_error& error) {
+				//Keeps the default texture
+				std::cout << error.what() << std::endl;
+				textureStreamRemaining--;
+				continue;
 			}
 		}
+		std::lock_guard<std::mutex> lock(textureStreamMutex);
+		streamedTextures.push_back(streamed);
+	}
+}
 
-		indexBufferMemorys.resize(indexPools.size());
-		indexBuffers.resize(indexPools.size());
-		for (size_t pool = 0; pool < indexPools.size(); pool++) {
-			if (!indexBuffersValid[pool]) continue;
-			VkDeviceSize bufferSize = sizeof(indexPools[pool][0]) * indexPools[pool].size();
-			if (bufferSize > 0) {
+//Upload textures decoded since the last frame, then point this frame's descriptor sets
+//at them. Only this frame's sets are written, as the other frame may still be in flight.
+void VulkanSystem::uploadStreamedTextures(uint32_t frame) {
+	if (textureStreamRemaining > 0) {
+		std::vector<StreamedTexture> ready;
+		{
+			std::lock_guard<std::mutex> lock(textureStreamMutex);
+			ready.swap(streamedTextures);
+		}
+		for (StreamedTexture& streamed : ready) {
+			TRACE_SCOPE("upload texture");
+			size_t texInd = streamed.index;
+			createTextureImage(streamed.texture, textureImages[texInd], textureImageMemorys[texInd],
+				textureImageViews[texInd], textureSamplers[texInd]);
+			textureStreamRemaining--;
+		}
+		if (ready.size() > 0) textureGeneration++;
+		if (textureStreamRemaining == 0 && textureStreamThread.joinable()) textureStreamThread.join();
+	}
+	if (textureDescriptorGenerations[frame] == textureGeneration) return;
+	textureDescriptorGenerations[frame] = textureGeneration;
 
-				//Create temp staging buffer
-				VkBuffer stagingBuffer{};
-				VkDeviceMemory stagingBufferMemory{};
-				int stagingBits = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-				createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, stagingBits,
-					stagingBuffer, stagingBufferMemory, true);
+	std::vector<VkDescriptorImageInfo> imageInfosTex(rawTextures.size());
+	for (size_t tex = 0; tex < rawTextures.size(); tex++) {
+		imageInfosTex[tex] = textureDescriptor(tex);
+	}
+	for (size_t pool = 0; pool < transformPools.size() + transformInstPoolsStore.size(); pool++) {
+		size_t poolInd = pool * MAX_FRAMES_IN_FLIGHT + frame;
+		if (poolInd >= descriptorSetsHDR.size()) break;
+		VkWriteDescriptorSet writeDescriptorSet{};
+		writeDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writeDescriptorSet.dstSet = descriptorSetsHDR[poolInd];
+		writeDescriptorSet.dstBinding = 3;
+		writeDescriptorSet.dstArrayElement = 0;
+		writeDescriptorSet.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		writeDescriptorSet.descriptorCount = static_cast<uint32_t>(imageInfosTex.size());
+		writeDescriptorSet.pImageInfo = imageInfosTex.data();
+		vkUpdateDescriptorSets(device, 1, &writeDescriptorSet, 0, nullptr);
+	}
+}
 
-				//Move index data to GPU
-				void* data;
-				vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-				memcpy(data, indexPools[pool].data(), (size_t)bufferSize);
-				vkUnmapMemory(device, stagingBufferMemory);
+void VulkanSystem::stopTextureStreaming() {
+	textureStreamStop = true;
+	if (textureStreamThread.joinable()) textureStreamThread.join();
+}
 
-				//Create proper index buffer
-				int indexUsageBits = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
-				int indexPropertyBits = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-				createBuffer(bufferSize, indexUsageBits, indexPropertyBits,
-					indexBuffers[pool], indexBufferMemorys[pool], realloc);
-				copyBuffer(stagingBuffer, indexBuffers[pool], bufferSize);
 
-				vkDestroyBuffer(device, stagingBuffer, nullptr);
-				vkFreeMemory(device, stagingBufferMemory, nullptr);
-			}
-		}
+//Bind the index buffer a node's indices are in, unless it already is
+void VulkanSystem::bindNodeIndices(VkCommandBuffer commandBuffer, const DrawNode& drawNode, int& boundIndices) {
+	int nodeIndices = drawNode.shortIndices ? 1 : 0;
+	if (boundIndices == nodeIndices) return;
+	if (drawNode.shortIndices) vkCmdBindIndexBuffer(commandBuffer, shortIndexBuffer, 0, VK_INDEX_TYPE_UINT16);
+	else vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+	boundIndices = nodeIndices;
+}
+
+//Stage indices and copy them into a device local index buffer
+void VulkanSystem::uploadIndices(const void* source, VkDeviceSize bufferSize, VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
+	//Create temp staging buffer
+	VkBuffer stagingBuffer{};
+	VkDeviceMemory stagingBufferMemory{};
+	int stagingBits = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, stagingBits,
+		stagingBuffer, stagingBufferMemory, true);
+
+	//Move index data to GPU
+	void* data;
+	vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
+	memcpy(data, source, (size_t)bufferSize);
+	frameStats.stagedBytes += bufferSize;
+	vkUnmapMemory(device, stagingBufferMemory);
+
+	//Create proper index buffer
+	int indexUsageBits = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
+	createBuffer(bufferSize, indexUsageBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		buffer, bufferMemory, true);
+	copyBuffer(stagingBuffer, buffer, bufferSize);
+
+	vkDestroyBuffer(device, stagingBuffer, nullptr);
+	vkFreeMemory(device, stagingBufferMemory, nullptr);
+}
+
+//Every mesh's indices are stored once and never rewritten, culling only picks
+//which ranges are drawn, so the buffers are device local. Meshes small enough
+//for 16 bit indices are kept in their own buffer.
+void VulkanSystem::createIndexBuffers() {
+	TRACE_SCOPE("createIndexBuffers");
+	if (useVertexBuffer && indexPool.size() > 0) {
+		uploadIndices(indexPool.data(), sizeof(uint32_t) * indexPool.size(), indexBuffer, indexBufferMemory);
+	}
+	if (useVertexBuffer && shortIndexPool.size() > 0) {
+		uploadIndices(shortIndexPool.data(), sizeof(uint16_t) * shortIndexPool.size(), shortIndexBuffer, shortIndexBufferMemory);
+	}
+	if (verbose && useVertexBuffer) {
+		std::cout << "MEASURE index memory: " << sizeof(uint16_t) * shortIndexPool.size() + sizeof(uint32_t) * indexPool.size() <<
+			" bytes, " << shortIndexPool.size() << " 16 bit and " << indexPool.size() << " 32 bit indices" << std::endl;
 	}
 	if (useInstancing) {
 		indexInstBufferMemorys.resize(indexInstPools.size());
@@ -2391,13 +3185,14 @@ void VulkanSystem::createIndexBuffers(bool realloc, bool andFree) {
 				void* data;
 				vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
 				memcpy(data, indexInstPools[pool].data(), (size_t)bufferSize);
+				frameStats.stagedBytes += bufferSize;
 				vkUnmapMemory(device, stagingBufferMemory);
 
 				//Create proper index buffer
 				int indexUsageBits = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
 				int indexPropertyBits = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
 				createBuffer(bufferSize, indexUsageBits, indexPropertyBits,
-					indexInstBuffers[pool], indexInstBufferMemorys[pool], realloc);
+					indexInstBuffers[pool], indexInstBufferMemorys[pool], true);
 				copyBuffer(stagingBuffer, indexInstBuffers[pool], bufferSize);
 
 				vkDestroyBuffer(device, stagingBuffer, nullptr);
@@ -2604,6 +3399,57 @@ void VulkanSystem::createUniformBuffers(bool realloc) {
 }
 
 
+void VulkanSystem::createClusterBuffers() {
+	//Sized for the worst case of every light reaching every cluster
+	size_t clusterCount = CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES;
+	VkDeviceSize bufferSize = sizeof(ClusterHeader) +
+		sizeof(uint32_t) * (2 * clusterCount + clusterCount * lightPool.size());
+	int props = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	clusterBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+	clusterBufferMemorys.resize(MAX_FRAMES_IN_FLIGHT);
+	clusterBuffersMapped.resize(MAX_FRAMES_IN_FLIGHT);
+	for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
+		createBuffer(bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, props,
+			clusterBuffers[frame], clusterBufferMemorys[frame], true);
+		vkMapMemory(device, clusterBufferMemorys[frame], 0, bufferSize, 0,
+			clusterBuffersMapped.data() + frame);
+	}
+	clusterLightLists = std::vector<std::vector<uint32_t>>(clusterCount);
+}
+
+//Sized for every meshlet of every node surviving, nodes without meshlets take one draw
+void VulkanSystem::createMeshletBuffers() {
+	if (useMeshlets && !physicalDeviceFeatures.drawIndirectFirstInstance) {
+		std::cout << "Indirect draws with a first instance are unsupported on this device, meshlet culling disabled." << std::endl;
+		useMeshlets = false;
+	}
+	if (!useMeshlets || !useVertexBuffer) return;
+	size_t commandCount = 0;
+	for (size_t pool = 0; pool < drawPools.size(); pool++) {
+		for (size_t node = 0; node < drawPools[pool].size(); node++) {
+			commandCount += drawPools[pool][node].meshletCount > 0 ? drawPools[pool][node].meshletCount : 1;
+		}
+	}
+	if (commandCount == 0) return;
+	VkDeviceSize bufferSize = sizeof(VkDrawIndexedIndirectCommand) * commandCount;
+	int props = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	meshletCommandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+	meshletCommandBufferMemorys.resize(MAX_FRAMES_IN_FLIGHT);
+	meshletCommandsMapped.resize(MAX_FRAMES_IN_FLIGHT);
+	for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
+		createBuffer(bufferSize, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, props,
+			meshletCommandBuffers[frame], meshletCommandBufferMemorys[frame], true);
+		vkMapMemory(device, meshletCommandBufferMemorys[frame], 0, bufferSize, 0,
+			meshletCommandsMapped.data() + frame);
+	}
+	if (verbose) {
+		std::cout << "MEASURE meshlets: " << meshlets.size() << " across all meshes, up to " << commandCount <<
+			" indirect draws per frame" << std::endl;
+	}
+}
+
 void VulkanSystem::createDescriptorPool() {
 	size_t transformsSize = useVertexBuffer ?
 		transformPools.size() : 0;
@@ -2627,7 +3473,7 @@ void VulkanSystem::createDescriptorPool() {
 		}
 	}
 
-	std::array<VkDescriptorPoolSize,2> poolSizesHDR{};
+	std::array<VkDescriptorPoolSize,3> poolSizesHDR{};
 	poolSizesHDR[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
 	poolSizesHDR[0].descriptorCount = rawEnvironment.has_value() ? 
 		8 * (transformsSize)*MAX_FRAMES_IN_FLIGHT :
@@ -2636,6 +3482,8 @@ void VulkanSystem::createDescriptorPool() {
 	poolSizesHDR[1].descriptorCount = rawEnvironment.has_value() ? 
 		(rawTextures.size() + rawCubes.size() + 1 + lightPool.size()) * transformsSize*MAX_FRAMES_IN_FLIGHT : 
 		(rawTextures.size() + rawCubes.size() + lightPool.size()) * transformsSize * MAX_FRAMES_IN_FLIGHT;
+	poolSizesHDR[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	poolSizesHDR[2].descriptorCount = transformsSize * MAX_FRAMES_IN_FLIGHT;
 	VkDescriptorPoolCreateInfo poolInfoHDR{};
 	poolInfoHDR.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
 	poolInfoHDR.poolSizeCount = poolSizesHDR.size();
@@ -2851,9 +3699,7 @@ void VulkanSystem::createDescriptorSets() {
 			std::vector<VkDescriptorImageInfo> imageInfosTex = std::vector<VkDescriptorImageInfo>(rawTextures.size());
 			for (size_t tex = 0; tex < rawTextures.size(); tex++) {
 				size_t descSet = rawEnvironment.has_value() ? tex + 9 : tex + 7;
-				imageInfosTex[tex].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-				imageInfosTex[tex].imageView = textureImageViews[tex];
-				imageInfosTex[tex].sampler = textureSamplers[tex];
+				imageInfosTex[tex] = textureDescriptor(tex);
 				writeDescriptorSets[descSet].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 				writeDescriptorSets[descSet].dstSet = descriptorSetsHDR[poolInd];
 				writeDescriptorSets[descSet].dstBinding = 3;
@@ -2894,6 +3740,21 @@ void VulkanSystem::createDescriptorSets() {
 			}
 
 			vkUpdateDescriptorSets(device, writeDescriptorSets.size(), writeDescriptorSets.data(), 0, nullptr);
+
+			//Cluster light lists
+			VkDescriptorBufferInfo bufferInfoClusters{};
+			bufferInfoClusters.buffer = clusterBuffers[frame];
+			bufferInfoClusters.offset = 0;
+			bufferInfoClusters.range = VK_WHOLE_SIZE;
+			VkWriteDescriptorSet clusterWriteDescriptorSet{};
+			clusterWriteDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			clusterWriteDescriptorSet.dstSet = descriptorSetsHDR[poolInd];
+			clusterWriteDescriptorSet.dstBinding = 13;
+			clusterWriteDescriptorSet.dstArrayElement = 0;
+			clusterWriteDescriptorSet.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+			clusterWriteDescriptorSet.descriptorCount = 1;
+			clusterWriteDescriptorSet.pBufferInfo = &bufferInfoClusters;
+			vkUpdateDescriptorSets(device, 1, &clusterWriteDescriptorSet, 0, nullptr);
 		}
 	}
 	for (; useInstancing && pool < transformPools.size() + transformInstPoolsStore.size(); pool++) {
@@ -3036,9 +3897,7 @@ void VulkanSystem::createDescriptorSets() {
 			std::vector<VkDescriptorImageInfo> imageInfosTex = std::vector<VkDescriptorImageInfo>(rawTextures.size());
 			for (size_t tex = 0; tex < rawTextures.size(); tex++) {
 				size_t descSet = rawEnvironment.has_value() ? tex + 9 : tex + 7;
-				imageInfosTex[tex].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-				imageInfosTex[tex].imageView = textureImageViews[tex];
-				imageInfosTex[tex].sampler = textureSamplers[tex];
+				imageInfosTex[tex] = textureDescriptor(tex);
 				writeDescriptorSets[descSet].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 				writeDescriptorSets[descSet].dstSet = descriptorSetsHDR[poolInd];
 				writeDescriptorSets[descSet].dstBinding = 3;
@@ -3081,6 +3940,21 @@ void VulkanSystem::createDescriptorSets() {
 				writeDescriptorSets[descSet].pImageInfo = &imageInfoEnv;
 			}
 			vkUpdateDescriptorSets(device, writeDescriptorSets.size(), writeDescriptorSets.data(), 0, nullptr);
+
+			//Cluster light lists
+			VkDescriptorBufferInfo bufferInfoClusters{};
+			bufferInfoClusters.buffer = clusterBuffers[frame];
+			bufferInfoClusters.offset = 0;
+			bufferInfoClusters.range = VK_WHOLE_SIZE;
+			VkWriteDescriptorSet clusterWriteDescriptorSet{};
+			clusterWriteDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			clusterWriteDescriptorSet.dstSet = descriptorSetsHDR[poolInd];
+			clusterWriteDescriptorSet.dstBinding = 13;
+			clusterWriteDescriptorSet.dstArrayElement = 0;
+			clusterWriteDescriptorSet.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+			clusterWriteDescriptorSet.descriptorCount = 1;
+			clusterWriteDescriptorSet.pBufferInfo = &bufferInfoClusters;
+			vkUpdateDescriptorSets(device, 1, &clusterWriteDescriptorSet, 0, nullptr);
 		}
 	}
 
@@ -3180,13 +4054,213 @@ void VulkanSystem::createDepthResources() {
 	}
 }
 
+void VulkanSystem::createReadbackBuffers() {
+	VkDeviceSize bufferSize = (VkDeviceSize)swapChainExtent.width * swapChainExtent.height * 4;
+	int props = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	readbackBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+	readbackBufferMemorys.resize(MAX_FRAMES_IN_FLIGHT);
+	readbackBuffersMapped.resize(MAX_FRAMES_IN_FLIGHT);
+	pendingSaves = std::vector<std::vector<std::string>>(MAX_FRAMES_IN_FLIGHT);
+	for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
+		createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT, props,
+			readbackBuffers[frame], readbackBufferMemorys[frame], true);
+		vkMapMemory(device, readbackBufferMemorys[frame], 0, bufferSize, 0,
+			readbackBuffersMapped.data() + frame);
+	}
+}
+
+//Saves refer to the most recently drawn frame, its pixels are picked up
+//once that frame's fence has signaled
+void VulkanSystem::requestSave(std::string fileName) {
+	if (renderToWindow) return;
+	//A frame made available by an event handled in the same batch has not been drawn yet
+	if (!headlessGuard) {
+		nextFrameSaves.push_back(fileName);
+		return;
+	}
+	if (lastRenderedFrame < 0) {
+		std::cout << "WARNING: No frame has been rendered yet, unable to save " << fileName << std::endl;
+		return;
+	}
+	pendingSaves[lastRenderedFrame].push_back(fileName);
+}
+
+//Hand this frame's readback to the writer thread, the frame's fence must have signaled
+void VulkanSystem::collectReadbacks(uint32_t frame) {
+	if (pendingSaves[frame].size() == 0) return;
+	size_t byteCount = (size_t)swapChainExtent.width * swapChainExtent.height * 4;
+	std::lock_guard<std::mutex> lock(saveMutex);
+	for (std::string fileName : pendingSaves[frame]) {
+		SaveJob job;
+		job.fileName = fileName;
+		job.width = swapChainExtent.width;
+		job.height = swapChainExtent.height;
+		job.bgra = swapChainImageFormat == VK_FORMAT_B8G8R8A8_SRGB || swapChainImageFormat == VK_FORMAT_B8G8R8A8_UNORM;
+		job.pixels.resize(byteCount);
+		memcpy(job.pixels.data(), readbackBuffersMapped[frame], byteCount);
+		saveJobs.push_back(std::move(job));
+	}
+	pendingSaves[frame].clear();
+	saveCondition.notify_one();
+}
+
+void VulkanSystem::saveThreadMain() {
+	while (true) {
+		SaveJob job;
+		{
+			std::unique_lock<std::mutex> lock(saveMutex);
+			saveCondition.wait(lock, [this]() { return saveThreadStop || saveJobs.size() > 0; });
+			if (saveJobs.size() == 0) return;
+			job = std::move(saveJobs.front());
+			saveJobs.pop_front();
+		}
+		TRACE_SCOPE("write ppm");
+		std::ofstream file(job.fileName, std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) {
+			std::cout << "WARNING: Unable to write saved frame " << job.fileName << std::endl;
+			continue;
+		}
+		file << "P6\n" << job.width << " " << job.height << "\n255\n";
+		std::vector<uint8_t> rgb((size_t)job.width * job.height * 3);
+		for (size_t pixel = 0; pixel < (size_t)job.width * job.height; pixel++) {
+			rgb[pixel * 3 + 0] = job.pixels[pixel * 4 + (job.bgra ? 2 : 0)];
+			rgb[pixel * 3 + 1] = job.pixels[pixel * 4 + 1];
+			rgb[pixel * 3 + 2] = job.pixels[pixel * 4 + (job.bgra ? 0 : 2)];
+		}
+		file.write((char*)rgb.data(), rgb.size());
+		file.close();
+	}
+}
+
+//Wait for the last frames, write any outstanding saves and stop the writer
+void VulkanSystem::finishHeadless() {
+	if (renderToWindow) return;
+	vkDeviceWaitIdle(device);
+	//Sustained throughput from the first submit until the last frame finished on the GPU
+	if (headlessFrames > 1) {
+		float seconds = std::chrono::duration<float>(
+			std::chrono::high_resolution_clock::now() - headlessStart).count();
+		std::cout << "MEASURE headless: " << headlessFrames << " frames in " << seconds * 1000.f <<
+			"ms (" << headlessFrames / seconds << " fps)" << std::endl;
+	}
+	for (uint32_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
+		collectReadbacks(frame);
+	}
+	{
+		std::lock_guard<std::mutex> lock(saveMutex);
+		saveThreadStop = true;
+	}
+	saveCondition.notify_one();
+	if (saveThread.joinable()) saveThread.join();
+}
+
+void VulkanSystem::createTimestampQueries() {
+	VkPhysicalDeviceProperties properties{};
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+	uint32_t queueFamilyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+	std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+	uint32_t validBits = queueFamilies[familyIndices.graphicsFamily.value()].timestampValidBits;
+	timestampPeriod = properties.limits.timestampPeriod;
+	if (validBits == 0) {
+		std::cout << "Graphics queue does not support timestamps, GPU timings disabled." << std::endl;
+		useTimestamps = false;
+		return;
+	}
+	timestampMask = validBits >= 64 ? ~0ull : ((1ull << validBits) - 1);
+
+	timestampsPerFrame = 2 * static_cast<uint32_t>(lightPool.size()) + 4;
+	VkQueryPoolCreateInfo queryPoolInfo{};
+	queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	queryPoolInfo.queryCount = timestampsPerFrame * MAX_FRAMES_IN_FLIGHT;
+	if (vkCreateQueryPool(device, &queryPoolInfo, nullptr, &timestampQueryPool) != VK_SUCCESS) {
+		throw std::runtime_error("ERROR: Unable to create timestamp query pool in VulkanSystem.");
+	}
+	useTimestamps = true;
+
+	//Written flags per frame, one per shadow pass and one for the main pass
+	timestampsWritten = std::vector<std::vector<bool>>(MAX_FRAMES_IN_FLIGHT, std::vector<bool>(lightPool.size() + 1, false));
+	gpuPassNames.clear();
+	for (size_t light = 0; light < lightPool.size(); light++) {
+		gpuPassNames.push_back("shadow " + std::to_string(light));
+	}
+	gpuPassNames.push_back("main");
+	gpuPassNames.push_back("instanced");
+	gpuPassNames.push_back("final");
+	gpuPassTimes = std::vector<std::vector<float>>(gpuPassNames.size());
+}
+
+//Collect finished timestamps without waiting, results that are not ready are dropped
+//as the queries are about to be reset for this frame
+void VulkanSystem::readTimestampQueries(uint32_t frame) {
+	if (!useTimestamps) return;
+	uint32_t base = frame * timestampsPerFrame;
+	VkQueryResultFlags flags = VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT;
+	float toMs = timestampPeriod / 1000000.f;
+	for (size_t light = 0; light < lightPool.size(); light++) {
+		if (!timestampsWritten[frame][light]) continue;
+		timestampsWritten[frame][light] = false;
+		uint64_t results[4]; //Value and availability per query
+		if (vkGetQueryPoolResults(device, timestampQueryPool, base + 2 * static_cast<uint32_t>(light), 2,
+			sizeof(results), results, 2 * sizeof(uint64_t), flags) != VK_SUCCESS) continue;
+		if (results[1] == 0 || results[3] == 0) continue;
+		gpuPassTimes[light].push_back(((results[2] - results[0]) & timestampMask) * toMs);
+	}
+	if (timestampsWritten[frame][lightPool.size()]) {
+		timestampsWritten[frame][lightPool.size()] = false;
+		uint64_t results[8];
+		if (vkGetQueryPoolResults(device, timestampQueryPool, base + 2 * static_cast<uint32_t>(lightPool.size()), 4,
+			sizeof(results), results, 2 * sizeof(uint64_t), flags) == VK_SUCCESS &&
+			results[1] != 0 && results[3] != 0 && results[5] != 0 && results[7] != 0) {
+			for (size_t pass = 0; pass < 3; pass++) {
+				gpuPassTimes[lightPool.size() + pass].push_back(
+					((results[2 * pass + 2] - results[2 * pass]) & timestampMask) * toMs);
+			}
+		}
+	}
+}
+
+//Print min, mean and p99 per pass and append the same to a csv, then start over
+void VulkanSystem::reportGpuTimings(std::string dumpFile) {
+	if (!useTimestamps) return;
+	std::ofstream dump(dumpFile, gpuTimingReports == 0 ? std::ios::trunc : std::ios::app);
+	if (dump.is_open() && gpuTimingReports == 0) {
+		dump << "report,pass,samples,min_ms,mean_ms,p99_ms" << std::endl;
+	}
+	for (size_t pass = 0; pass < gpuPassTimes.size(); pass++) {
+		std::vector<float> samples = gpuPassTimes[pass];
+		if (samples.size() == 0) continue;
+		std::sort(samples.begin(), samples.end());
+		float mean = 0;
+		for (float sample : samples) mean += sample;
+		mean /= samples.size();
+		size_t p99Index = (samples.size() * 99 + 99) / 100 - 1;
+		float p99 = samples[p99Index];
+		std::cout << "MEASURE gpu " << gpuPassNames[pass] << " (" << samples.size() << " samples): min "
+			<< samples[0] << "ms, mean " << mean << "ms, p99 " << p99 << "ms" << std::endl;
+		if (dump.is_open()) {
+			dump << gpuTimingReports << "," << gpuPassNames[pass] << "," << samples.size() << ","
+				<< samples[0] << "," << mean << "," << p99 << std::endl;
+		}
+		gpuPassTimes[pass].clear();
+	}
+	gpuTimingReports++;
+}
+
 void VulkanSystem::recordCommandBufferShadow(VkCommandBuffer commandBuffer, uint32_t imageIndex, int lightIndex) {
+	TRACE_SCOPE("record shadow pass");
 	VkCommandBufferBeginInfo beginInfo{};
 	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
 	if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
 		throw std::runtime_error("ERROR: Unable to begin recording a command buffer in VulkanSystem.");
 	}
-
+	uint32_t shadowQuery = currentFrame * timestampsPerFrame + 2 * lightIndex;
+	if (useTimestamps) {
+		vkCmdResetQueryPool(commandBuffer, timestampQueryPool, shadowQuery, 2);
+		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampQueryPool, shadowQuery);
+	}
 
 
 	VkExtent2D shadowExtent;
@@ -3228,15 +4302,31 @@ void VulkanSystem::recordCommandBufferShadow(VkCommandBuffer commandBuffer, uint
 	//Shadow subpass;
 	{
 		vkCmdPushConstants(commandBuffer, pipelineLayoutShadows[lightIndex], VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(mat44<float>), &worldTolightPerspPool[lightIndex]);
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipelineShadows[lightIndex]);
 		const VkDeviceSize offsets[] = { 0 };
-		if (useVertexBuffer) vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vertexBuffer, offsets);
-		for (size_t pool = 0; pool < transformPools.size() && pool < indexBuffersValid.size() && useVertexBuffer; pool++) {
-			if (indexBuffersValid[pool]) {
-				vkCmdBindIndexBuffer(commandBuffer, indexBuffers[pool], 0, VK_INDEX_TYPE_UINT32);
-				vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-					pipelineLayoutShadows[lightIndex], 0, 1, &descriptorSetsShadows[lightIndex][pool * MAX_FRAMES_IN_FLIGHT + currentFrame], 0, nullptr);
-				vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(indexPools[pool].size()), 1, 0, 0, 0);
+		int boundIndices = -1; //Index buffers are bound as nodes need them
+		//Each vertex layout has its own buffer and pipeline
+		VkPipeline layoutPipelines[LAYOUT_COUNT] = { graphicsPipelineShadows[lightIndex], graphicsSimplePipelineShadows[lightIndex] };
+		VkBuffer layoutBuffers[LAYOUT_COUNT] = { vertexBuffer, vertexSimpleBuffer };
+		for (int layout = 0; layout < LAYOUT_COUNT && useVertexBuffer; layout++) {
+			if (layoutBuffers[layout] == VK_NULL_HANDLE) continue;
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layoutPipelines[layout]);
+			vkCmdBindVertexBuffers(commandBuffer, 0, 1, &layoutBuffers[layout], offsets);
+			for (size_t pool = 0; pool < shadowNodePools[lightIndex].size(); pool++) {
+				bool poolBound = false;
+				//The node's index in its pool is passed as the first instance, its mesh's start as the base vertex
+				for (uint32_t node : shadowNodePools[lightIndex][pool]) {
+					DrawNode& drawNode = drawPools[pool][node];
+					if (drawNode.layout != layout) continue;
+					if (!poolBound) {
+						vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+							pipelineLayoutShadows[lightIndex], 0, 1, &descriptorSetsShadows[lightIndex][pool * MAX_FRAMES_IN_FLIGHT + currentFrame], 0, nullptr);
+						poolBound = true;
+					}
+					bindNodeIndices(commandBuffer, drawNode, boundIndices);
+					vkCmdDrawIndexed(commandBuffer, drawNode.indexCount, 1, drawNode.indexStart, drawNode.start, node);
+					frameStats.drawCalls++;
+					frameStats.indicesDrawn += drawNode.indexCount;
+				}
 			}
 		}
 
@@ -3247,20 +4337,40 @@ void VulkanSystem::recordCommandBufferShadow(VkCommandBuffer commandBuffer, uint
 		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsInstPipelineShadows[lightIndex]);
 		const VkDeviceSize offsets[] = { 0 };
 		vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vertexInstBuffer, offsets);
-		for (size_t pool = 0; pool < transformInstPools.size(); pool++) {
-			if (transformInstPools[pool].size() == 0) continue;
+		mat44<float> identity = mat44<float>(1);
+		for (size_t pool = 0; pool < shadowInstPools[lightIndex].size(); pool++) {
+			if (shadowInstPools[lightIndex][pool].size() == 0) continue;
 			vkCmdBindIndexBuffer(commandBuffer, indexInstBuffers[transformInstIndexPools[pool]], 0, VK_INDEX_TYPE_UINT32);
 			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
 				pipelineLayoutShadows[lightIndex], 0, 1, &descriptorSetsShadows[lightIndex][(pool + transformPools.size()) *
 				MAX_FRAMES_IN_FLIGHT + currentFrame], 0, nullptr);
-			vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(
-				indexInstPools[transformInstIndexPools[pool]].size()),
-				transformInstPools[pool].size(), 0, 0, 0);
+			//Shadows always use the full mesh
+			uint32_t indexCount = lodRangesInst[transformInstIndexPools[pool]][0].second;
+			uint32_t instanceCount = static_cast<uint32_t>(shadowInstPools[lightIndex][pool].size());
+			if (shadowPlacementPools[lightIndex][pool].empty()) {
+				vkCmdPushConstants(commandBuffer, pipelineLayoutShadows[lightIndex], VK_SHADER_STAGE_VERTEX_BIT,
+					sizeof(mat44<float>), sizeof(mat44<float>), &identity);
+				vkCmdDrawIndexed(commandBuffer, indexCount, instanceCount, 0, 0, 0);
+				frameStats.drawCalls++;
+				frameStats.indicesDrawn += indexCount * instanceCount;
+				continue;
+			}
+			for (mat44<float>& placement : shadowPlacementPools[lightIndex][pool]) {
+				vkCmdPushConstants(commandBuffer, pipelineLayoutShadows[lightIndex], VK_SHADER_STAGE_VERTEX_BIT,
+					sizeof(mat44<float>), sizeof(mat44<float>), &placement);
+				vkCmdDrawIndexed(commandBuffer, indexCount, instanceCount, 0, 0, 0);
+				frameStats.drawCalls++;
+				frameStats.indicesDrawn += indexCount * instanceCount;
+			}
 		}
 
 	}
 	//END render pass
 	vkCmdEndRenderPass(commandBuffer);
+	if (useTimestamps) {
+		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampQueryPool, shadowQuery + 1);
+		timestampsWritten[currentFrame][lightIndex] = true;
+	}
 
 	VkImageMemoryBarrier barrier{};
 	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
@@ -3290,6 +4400,7 @@ void VulkanSystem::recordCommandBufferShadow(VkCommandBuffer commandBuffer, uint
 }
 
 void VulkanSystem::recordCommandBufferMain(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
+	TRACE_SCOPE("record main pass");
 	VkCommandBufferBeginInfo beginInfo{};
 	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
 	if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
@@ -3312,6 +4423,13 @@ void VulkanSystem::recordCommandBufferMain(VkCommandBuffer commandBuffer, uint32
 	renderPassInfo.pClearValues = clearColors.data();
 
 
+	//Timestamps before the main draws, after them, after the instanced draws and after the final subpass
+	uint32_t mainQuery = currentFrame * timestampsPerFrame + 2 * static_cast<uint32_t>(lightPool.size());
+	if (useTimestamps) {
+		vkCmdResetQueryPool(commandBuffer, timestampQueryPool, mainQuery, 4);
+		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampQueryPool, mainQuery);
+	}
+
 	VkViewport viewport{};
 	VkRect2D scissor{};
 	vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
@@ -3331,20 +4449,64 @@ void VulkanSystem::recordCommandBufferMain(VkCommandBuffer commandBuffer, uint32
 
 	//Main subpass
 	{
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
 		//Begin recording commands
 		vkCmdPushConstants(commandBuffer, pipelineLayoutHDR, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(PushConst), &pushConstHDR);
 		const VkDeviceSize offsets[] = { 0 };
-		if (useVertexBuffer) vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vertexBuffer, offsets);
-		for (size_t pool = 0; pool < transformPools.size() && pool < indexBuffersValid.size() && useVertexBuffer; pool++) {
-			if (indexBuffersValid[pool]) {
-				vkCmdBindIndexBuffer(commandBuffer, indexBuffers[pool], 0, VK_INDEX_TYPE_UINT32);
-				vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-					pipelineLayoutHDR, 0, 1, &descriptorSetsHDR[pool * MAX_FRAMES_IN_FLIGHT + currentFrame], 0, nullptr);
-				vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(indexPools[pool].size()), 1, 0, 0, 0);
+		int boundIndices = -1; //Index buffers are bound as nodes need them
+		//Each vertex layout has its own buffer and pipeline
+		VkPipeline layoutPipelines[LAYOUT_COUNT] = { graphicsPipeline, graphicsSimplePipeline };
+		VkBuffer layoutBuffers[LAYOUT_COUNT] = { vertexBuffer, vertexSimpleBuffer };
+		for (int layout = 0; layout < LAYOUT_COUNT && useVertexBuffer; layout++) {
+			if (layoutBuffers[layout] == VK_NULL_HANDLE) continue;
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layoutPipelines[layout]);
+			vkCmdBindVertexBuffers(commandBuffer, 0, 1, &layoutBuffers[layout], offsets);
+			if (useMeshlets) {
+				//cullMeshlets already wrote the surviving meshlets as indirect draws
+				VkDeviceSize stride = sizeof(VkDrawIndexedIndirectCommand);
+				for (const MeshletDrawGroup& group : meshletDrawGroups) {
+					if (group.layout != layout) continue;
+					vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+						pipelineLayoutHDR, 0, 1, &descriptorSetsHDR[group.pool * MAX_FRAMES_IN_FLIGHT + currentFrame], 0, nullptr);
+					if (group.shortIndices) vkCmdBindIndexBuffer(commandBuffer, shortIndexBuffer, 0, VK_INDEX_TYPE_UINT16);
+					else vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+					if (physicalDeviceFeatures.multiDrawIndirect) {
+						vkCmdDrawIndexedIndirect(commandBuffer, meshletCommandBuffers[currentFrame], stride * group.first,
+							group.count, static_cast<uint32_t>(stride));
+						frameStats.drawCalls++;
+					}
+					else {
+						for (uint32_t draw = 0; draw < group.count; draw++) {
+							vkCmdDrawIndexedIndirect(commandBuffer, meshletCommandBuffers[currentFrame], stride * (group.first + draw),
+								1, static_cast<uint32_t>(stride));
+							frameStats.drawCalls++;
+						}
+					}
+				}
+				boundIndices = -1;
+				continue;
+			}
+			for (size_t pool = 0; pool < transformPools.size() && pool < visibleNodePools.size(); pool++) {
+				bool poolBound = false;
+				//Nodes share their mesh's indices, the node's index in its pool is passed as the first instance
+				//and its mesh's start as the base vertex
+				for (uint32_t node : visibleNodePools[pool]) {
+					DrawNode& drawNode = drawPools[pool][node];
+					if (drawNode.layout != layout) continue;
+					if (!poolBound) {
+						vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+							pipelineLayoutHDR, 0, 1, &descriptorSetsHDR[pool * MAX_FRAMES_IN_FLIGHT + currentFrame], 0, nullptr);
+						poolBound = true;
+					}
+					bindNodeIndices(commandBuffer, drawNode, boundIndices);
+					vkCmdDrawIndexed(commandBuffer, drawNode.lodIndexCount[drawNode.lod], 1,
+						drawNode.lodIndexStart[drawNode.lod], drawNode.start, node);
+					frameStats.drawCalls++;
+					frameStats.indicesDrawn += drawNode.lodIndexCount[drawNode.lod];
+				}
 			}
 		}
 	}
+	if (useTimestamps) vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampQueryPool, mainQuery + 1);
 
 	//Instanced version
 	if (useInstancing) {
@@ -3352,6 +4514,7 @@ void VulkanSystem::recordCommandBufferMain(VkCommandBuffer commandBuffer, uint32
 
 
 		vkCmdPushConstants(commandBuffer, pipelineLayoutHDR, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(PushConst), &pushConstHDR);
+		mat44<float> identity = mat44<float>(1);
 
 		const VkDeviceSize offsets[] = { 0 };
 		vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vertexInstBuffer, offsets);
@@ -3361,12 +4524,36 @@ void VulkanSystem::recordCommandBufferMain(VkCommandBuffer commandBuffer, uint32
 			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
 				pipelineLayoutHDR, 0, 1, &descriptorSetsHDR[(pool + transformPools.size()) *
 				MAX_FRAMES_IN_FLIGHT + currentFrame], 0, nullptr);
-			vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(
-				indexInstPools[transformInstIndexPools[pool]].size()),
-				transformInstPools[pool].size(), 0, 0, 0);
+			const std::vector<std::pair<uint32_t, uint32_t>>& lodRanges = lodRangesInst[transformInstIndexPools[pool]];
+			//Grouped pools draw all their instances once per visible placement
+			if (!visiblePlacementPools[pool].empty()) {
+				uint32_t instanceCount = static_cast<uint32_t>(transformInstPools[pool].size());
+				for (std::pair<mat44<float>, int>& placement : visiblePlacementPools[pool]) {
+					vkCmdPushConstants(commandBuffer, pipelineLayoutHDR, VK_SHADER_STAGE_VERTEX_BIT,
+						PLACEMENT_PUSH_OFFSET, sizeof(mat44<float>), &placement.first);
+					const std::pair<uint32_t, uint32_t>& range = lodRanges[placement.second];
+					vkCmdDrawIndexed(commandBuffer, range.second, instanceCount, range.first, 0, 0);
+					frameStats.drawCalls++;
+					frameStats.indicesDrawn += range.second * instanceCount;
+				}
+				continue;
+			}
+			vkCmdPushConstants(commandBuffer, pipelineLayoutHDR, VK_SHADER_STAGE_VERTEX_BIT,
+				PLACEMENT_PUSH_OFFSET, sizeof(mat44<float>), &identity);
+			//cullInstances stored the visible instances in level order
+			uint32_t firstInstance = 0;
+			for (size_t level = 0; level < instanceLodCounts[pool].size(); level++) {
+				uint32_t instanceCount = instanceLodCounts[pool][level];
+				if (instanceCount == 0) continue;
+				vkCmdDrawIndexed(commandBuffer, lodRanges[level].second, instanceCount, lodRanges[level].first, 0, firstInstance);
+				frameStats.drawCalls++;
+				frameStats.indicesDrawn += lodRanges[level].second * instanceCount;
+				firstInstance += instanceCount;
+			}
 		}
 
 	}
+	if (useTimestamps) vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampQueryPool, mainQuery + 2);
 
 	//Present subpass
 	vkCmdNextSubpass(commandBuffer, VK_SUBPASS_CONTENTS_INLINE);
@@ -3375,9 +4562,59 @@ void VulkanSystem::recordCommandBufferMain(VkCommandBuffer commandBuffer, uint32
 	vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
 	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayoutFinal, 0, 1, &descriptorSetsFinal[currentFrame], 0, NULL);
 	vkCmdDraw(commandBuffer, 6, 1, 0, 0); //Draw a quad in shader
+	frameStats.drawCalls++;
 
 	//END render pass
 	vkCmdEndRenderPass(commandBuffer);
+	if (useTimestamps) {
+		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampQueryPool, mainQuery + 3);
+		timestampsWritten[currentFrame][lightPool.size()] = true;
+	}
+
+	//Headless frames are copied to this frame's readback buffer, read once its fence signals
+	if (!renderToWindow) {
+		VkImageMemoryBarrier imageBarrier{};
+		imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		imageBarrier.image = swapChainImages[imageIndex];
+		imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		imageBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		imageBarrier.subresourceRange.baseArrayLayer = 0;
+		imageBarrier.subresourceRange.layerCount = 1;
+		imageBarrier.subresourceRange.levelCount = 1;
+		imageBarrier.subresourceRange.baseMipLevel = 0;
+		imageBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		imageBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		imageBarrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		imageBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+			VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageBarrier);
+
+		VkBufferImageCopy region{};
+		region.bufferOffset = 0;
+		region.bufferRowLength = 0;
+		region.bufferImageHeight = 0;
+		region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		region.imageSubresource.mipLevel = 0;
+		region.imageSubresource.baseArrayLayer = 0;
+		region.imageSubresource.layerCount = 1;
+		region.imageOffset = { 0, 0, 0 };
+		region.imageExtent = { swapChainExtent.width, swapChainExtent.height, 1 };
+		vkCmdCopyImageToBuffer(commandBuffer, swapChainImages[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+			readbackBuffers[currentFrame], 1, &region);
+
+		VkBufferMemoryBarrier bufferBarrier{};
+		bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+		bufferBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		bufferBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+		bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		bufferBarrier.buffer = readbackBuffers[currentFrame];
+		bufferBarrier.offset = 0;
+		bufferBarrier.size = VK_WHOLE_SIZE;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &bufferBarrier, 0, nullptr);
+	}
 
 	if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
 		throw std::runtime_error("ERROR: Unable to record command buffer in VulkanSystem.");
@@ -3388,7 +4625,175 @@ void VulkanSystem::recordCommandBufferMain(VkCommandBuffer commandBuffer, uint32
 
 
 
+void VulkanSystem::uploadUniform(void* mapped, const void* data, size_t size) {
+	memcpy(mapped, data, size);
+	frameStats.uniformBytes += size;
+}
+
+//Add the frame to the rolling window, and to the csv when running headless
+void VulkanSystem::finishFrameStats() {
+	statsWindow.drawCalls += frameStats.drawCalls;
+	statsWindow.indicesDrawn += frameStats.indicesDrawn;
+	statsWindow.nodesVisible += frameStats.nodesVisible;
+	statsWindow.nodesCulled += frameStats.nodesCulled;
+	statsWindow.instancesVisible += frameStats.instancesVisible;
+	statsWindow.instancesCulled += frameStats.instancesCulled;
+	statsWindow.meshletsVisible += frameStats.meshletsVisible;
+	statsWindow.meshletsCulled += frameStats.meshletsCulled;
+	statsWindow.uniformBytes += frameStats.uniformBytes;
+	statsWindow.stagedBytes += frameStats.stagedBytes;
+	statsWindowFrames++;
+
+	if (renderToWindow) return;
+	if (!statsCsv.is_open()) {
+		statsCsv.open(statsFile, std::ios::trunc);
+		statsCsv << "frame,draw_calls,indices_drawn,nodes_visible,nodes_culled,"
+			"instances_visible,instances_culled,meshlets_visible,meshlets_culled,uniform_bytes,staged_bytes" << std::endl;
+	}
+	statsCsv << frameStats.frame << "," << frameStats.drawCalls << "," << frameStats.indicesDrawn << "," <<
+		frameStats.nodesVisible << "," << frameStats.nodesCulled << "," <<
+		frameStats.instancesVisible << "," << frameStats.instancesCulled << "," <<
+		frameStats.meshletsVisible << "," << frameStats.meshletsCulled << "," <<
+		frameStats.uniformBytes << "," << frameStats.stagedBytes << std::endl;
+}
+
+//Print the averages over the frames since the last report
+void VulkanSystem::reportFrameStats() {
+	if (statsWindowFrames == 0) return;
+	float frames = (float)statsWindowFrames;
+	std::cout << "MEASURE frame stats (avg of " << statsWindowFrames << " frames): " <<
+		statsWindow.drawCalls / frames << " draws, " <<
+		statsWindow.indicesDrawn / frames / 3 << " triangles, " <<
+		statsWindow.nodesVisible / frames << " nodes visible / " << statsWindow.nodesCulled / frames << " culled, " <<
+		statsWindow.instancesVisible / frames << " instances visible / " << statsWindow.instancesCulled / frames << " culled, " <<
+		statsWindow.meshletsVisible / frames << " meshlets visible / " << statsWindow.meshletsCulled / frames << " culled, " <<
+		statsWindow.uniformBytes / frames / 1024 << "KB uniforms, " <<
+		statsWindow.stagedBytes / frames / 1024 << "KB staged" << std::endl;
+	statsWindow = FrameStats();
+	statsWindowFrames = 0;
+}
+
+//Assign each light to the view space clusters its range can reach, so the
+//fragment shaders only iterate the lights of their own cluster
+void VulkanSystem::buildLightClusters(uint32_t frame, mat44<float> worldToView) {
+	TRACE_SCOPE("buildLightClusters");
+	const uint32_t clusterCount = CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES;
+	for (size_t cluster = 0; cluster < clusterLightLists.size(); cluster++) {
+		clusterLightLists[cluster].clear();
+	}
+
+	DrawCamera camera = cameras[currentCamera];
+	float nearP = camera.perspectiveInfo.nearP;
+	float farP = camera.perspectiveInfo.farP;
+	float depthRatio = log(farP / nearP);
+	//NDC to view space at unit depth
+	float scaleX = 1 / camera.perspective.data[0][0];
+	float scaleY = 1 / camera.perspective.data[1][1];
+
+	//View space bounds of each cluster, tiles follow framebuffer coordinates
+	std::vector<std::pair<float_3, float_3>> clusterBounds(clusterCount);
+	for (uint32_t slice = 0; slice < CLUSTER_SLICES; slice++) {
+		float depthNear = nearP * pow(farP / nearP, (float)slice / CLUSTER_SLICES);
+		float depthFar = nearP * pow(farP / nearP, (float)(slice + 1) / CLUSTER_SLICES);
+		for (uint32_t tileY = 0; tileY < CLUSTER_TILES_Y; tileY++) {
+			float ndcY0 = -1 + 2 * (float)tileY / CLUSTER_TILES_Y;
+			float ndcY1 = -1 + 2 * (float)(tileY + 1) / CLUSTER_TILES_Y;
+			for (uint32_t tileX = 0; tileX < CLUSTER_TILES_X; tileX++) {
+				float ndcX0 = -1 + 2 * (float)tileX / CLUSTER_TILES_X;
+				float ndcX1 = -1 + 2 * (float)(tileX + 1) / CLUSTER_TILES_X;
+				float_3 minBound;
+				float_3 maxBound;
+				minBound.x = fminf(fminf(ndcX0 * depthNear, ndcX0 * depthFar), fminf(ndcX1 * depthNear, ndcX1 * depthFar)) * scaleX;
+				maxBound.x = fmaxf(fmaxf(ndcX0 * depthNear, ndcX0 * depthFar), fmaxf(ndcX1 * depthNear, ndcX1 * depthFar)) * scaleX;
+				minBound.y = fminf(fminf(ndcY0 * depthNear, ndcY0 * depthFar), fminf(ndcY1 * depthNear, ndcY1 * depthFar)) * scaleY;
+				maxBound.y = fmaxf(fmaxf(ndcY0 * depthNear, ndcY0 * depthFar), fmaxf(ndcY1 * depthNear, ndcY1 * depthFar)) * scaleY;
+				minBound.z = -depthFar;
+				maxBound.z = -depthNear;
+				clusterBounds[(slice * CLUSTER_TILES_Y + tileY) * CLUSTER_TILES_X + tileX] = std::make_pair(minBound, maxBound);
+			}
+		}
+	}
+
+	for (uint32_t light = 0; light < lightPool.size(); light++) {
+		DrawLight drawLight = lightPool[light];
+		//Spot lights only shade within their limit, unlimited sphere lights and suns reach everything
+		if (drawLight.type == LIGHT_NONE || (drawLight.type == LIGHT_SPOT && drawLight.limit <= 0)) continue;
+		if (drawLight.type == LIGHT_SUN || (drawLight.type == LIGHT_SPHERE && drawLight.limit <= 0)) {
+			for (uint32_t cluster = 0; cluster < clusterCount; cluster++) {
+				clusterLightLists[cluster].push_back(light);
+			}
+			continue;
+		}
+
+		mat44<float> lightToView = worldToView * mat44<float>::inverse(worldTolightPool[light]);
+		float_3 center = lightToView * float_3(0, 0, 0);
+		float range = drawLight.limit + drawLight.radius;
+		float depthMin = -center.z - range;
+		float depthMax = -center.z + range;
+		if (depthMax < nearP || depthMin > farP) continue;
+		uint32_t sliceStart = depthMin <= nearP ? 0 :
+			(uint32_t)(log(depthMin / nearP) / depthRatio * CLUSTER_SLICES);
+		uint32_t sliceEnd = (uint32_t)(log(depthMax / nearP) / depthRatio * CLUSTER_SLICES);
+		if (sliceEnd >= CLUSTER_SLICES) sliceEnd = CLUSTER_SLICES - 1;
+
+		//Spot cone, the shaders light fragments along the light's local +z
+		bool testCone = drawLight.type == LIGHT_SPOT && drawLight.fov < 3.14159f;
+		float_3 axis = float_3(lightToView * float_4(0, 0, 1, 0)).normalize();
+		float cosAngle = cos(drawLight.fov / 2);
+		float sinAngle = sin(drawLight.fov / 2);
+
+		for (uint32_t slice = sliceStart; slice <= sliceEnd; slice++) {
+			for (uint32_t tile = 0; tile < CLUSTER_TILES_X * CLUSTER_TILES_Y; tile++) {
+				uint32_t cluster = slice * CLUSTER_TILES_X * CLUSTER_TILES_Y + tile;
+				float_3 minBound = clusterBounds[cluster].first;
+				float_3 maxBound = clusterBounds[cluster].second;
+				//Sphere against box, using the closest point in the box
+				float_3 closest = float_3(
+					fminf(fmaxf(center.x, minBound.x), maxBound.x),
+					fminf(fmaxf(center.y, minBound.y), maxBound.y),
+					fminf(fmaxf(center.z, minBound.z), maxBound.z));
+				if ((closest - center).norm() > range) continue;
+				if (testCone) {
+					//Cone against the cluster's bounding sphere
+					float_3 clusterCenter = (minBound + maxBound) * 0.5f;
+					float clusterRadius = (maxBound - minBound).norm() * 0.5f;
+					float_3 toCluster = clusterCenter - center;
+					float alongAxis = toCluster.dot(axis);
+					float fromAxis = sqrt(fmaxf(toCluster.dot(toCluster) - alongAxis * alongAxis, 0));
+					if (cosAngle * fromAxis - sinAngle * alongAxis > clusterRadius ||
+						alongAxis > clusterRadius + range || alongAxis < -clusterRadius) continue;
+				}
+				clusterLightLists[cluster].push_back(light);
+			}
+		}
+	}
+
+	//Header, then an offset and count per cluster, then the light indices
+	ClusterHeader header;
+	header.worldToView = worldToView;
+	header.tilesX = CLUSTER_TILES_X;
+	header.tilesY = CLUSTER_TILES_Y;
+	header.slices = CLUSTER_SLICES;
+	header.lightCount = (uint32_t)lightPool.size();
+	header.tileWidth = (float)swapChainExtent.width / CLUSTER_TILES_X;
+	header.tileHeight = (float)swapChainExtent.height / CLUSTER_TILES_Y;
+	header.nearP = nearP;
+	header.farP = farP;
+	memcpy(clusterBuffersMapped[frame], &header, sizeof(ClusterHeader));
+	uint32_t* clusterData = (uint32_t*)((char*)clusterBuffersMapped[frame] + sizeof(ClusterHeader));
+	uint32_t offset = 2 * clusterCount;
+	for (uint32_t cluster = 0; cluster < clusterCount; cluster++) {
+		uint32_t count = (uint32_t)clusterLightLists[cluster].size();
+		clusterData[2 * cluster] = offset;
+		clusterData[2 * cluster + 1] = count;
+		if (count > 0) memcpy(clusterData + offset, clusterLightLists[cluster].data(), sizeof(uint32_t) * count);
+		offset += count;
+	}
+	frameStats.uniformBytes += sizeof(ClusterHeader) + sizeof(uint32_t) * offset;
+}
+
 void VulkanSystem::updateUniformBuffers(uint32_t frame) {
+	TRACE_SCOPE("updateUniformBuffers");
 
 
 	cullInstances();
@@ -3397,6 +4802,7 @@ void VulkanSystem::updateUniformBuffers(uint32_t frame) {
 	float_3 useDirVec = movementMode == MOVE_DEBUG ? debugDirVec : dirVec;
 	mat44<float> local = getCameraSpace(cameras[currentCamera], useMoveVec, useDirVec);
 	float_3 cameraPos = useMoveVec + cameras[currentCamera].forAnimate.translate;
+	buildLightClusters(frame, local);
 	local = cameras[currentCamera].perspective * local;
 	pushConstHDR.numLights = (int)lightPool.size();
 	pushConstHDR.camPosX = cameraPos.x;
@@ -3406,68 +4812,87 @@ void VulkanSystem::updateUniformBuffers(uint32_t frame) {
 	size_t pool = 0;
 	size_t matsize = sizeof(DrawMaterial);
 	for (; pool < transformPools.size() && useVertexBuffer; pool++) {
-		memcpy(uniformBuffersMappedTransformsPools[pool][frame],
-			transformPools[pool].data(), sizeof(mat44<float>) *
+		const mat44<float>* transforms = transformPools[pool].data();
+		if (packVertices) {
+			//Packed positions are relative to their mesh's bounds
+			packedTransforms.resize(transformPools[pool].size());
+			for (size_t node = 0; node < transformPools[pool].size(); node++) {
+				packedTransforms[node] = transformPools[pool][node] * dequantizePools[pool][node];
+			}
+			transforms = packedTransforms.data();
+		}
+		uploadUniform(uniformBuffersMappedTransformsPools[pool][frame],
+			transforms, sizeof(mat44<float>) *
 			transformPools[pool].size());
 		for (int i = 0; i < lightPool.size(); i++) {
-			memcpy(uniformBuffersMappedModelsPools[i][pool][frame],
-				transformPools[pool].data(), sizeof(mat44<float>) *
+			uploadUniform(uniformBuffersMappedModelsPools[i][pool][frame],
+				transforms, sizeof(mat44<float>) *
 				transformPools[pool].size());
 		}
 		if (rawEnvironment.has_value()) {
-			memcpy(uniformBuffersMappedNormalTransformsPools[pool][frame],
+			uploadUniform(uniformBuffersMappedNormalTransformsPools[pool][frame],
 				transformNormalPools[pool].data(), sizeof(mat44<float>) *
 				transformNormalPools[pool].size());
-			memcpy(uniformBuffersMappedEnvironmentTransformsPools[pool][frame],
+			uploadUniform(uniformBuffersMappedEnvironmentTransformsPools[pool][frame],
 				transformEnvironmentPools[pool].data(), sizeof(mat44<float>) *
 				transformEnvironmentPools[pool].size());
 		}
-		memcpy(uniformBuffersMappedCamerasPools[pool][frame], &(local),
+		uploadUniform(uniformBuffersMappedCamerasPools[pool][frame], &(local),
 			sizeof(mat44<float>));
-		memcpy(uniformBuffersMappedLightsPools[pool][frame], lightPool.data(),
+		uploadUniform(uniformBuffersMappedLightsPools[pool][frame], lightPool.data(),
 			sizeof(DrawLight) * lightPool.size());
-		memcpy(uniformBuffersMappedLightTransformsPools[pool][frame], worldTolightPool.data(),
+		uploadUniform(uniformBuffersMappedLightTransformsPools[pool][frame], worldTolightPool.data(),
 			sizeof(mat44<float>) * worldTolightPool.size());
-		memcpy(uniformBuffersMappedLightPerspectivePools[pool][frame], worldTolightPerspPool.data(),
+		uploadUniform(uniformBuffersMappedLightPerspectivePools[pool][frame], worldTolightPerspPool.data(),
 			sizeof(mat44<float>) * worldTolightPool.size());
-		memcpy(uniformBuffersMappedMaterialsPools[pool][frame], 
+		uploadUniform(uniformBuffersMappedMaterialsPools[pool][frame], 
 			materialPools[pool].data(), matsize * materialPools[pool].size());
 	}
 	if (!useInstancing) return;
 	for (; pool < transformPools.size() + transformInstPools.size(); pool++) {
 		size_t poolAdjusted = pool - transformPools.size();
+		//Shadow casters are culled per light, independent of the camera
+		for (int i = 0; i < lightPool.size(); i++) {
+			if (shadowInstPools[i].size() <= poolAdjusted) continue;
+			uploadUniform(uniformBuffersMappedModelsPools[i][pool][frame],
+				shadowInstPools[i][poolAdjusted].data(), sizeof(mat44<float>) *
+				shadowInstPools[i][poolAdjusted].size());
+		}
 		if (transformInstPools[poolAdjusted].size() == 0) continue;
-		memcpy(uniformBuffersMappedTransformsPools[pool][frame],
+		uploadUniform(uniformBuffersMappedTransformsPools[pool][frame],
 			transformInstPools[poolAdjusted].data(), sizeof(mat44<float>) *
 			transformInstPools[poolAdjusted].size());
-		for (int i = 0; i < lightPool.size(); i++) {
-			memcpy(uniformBuffersMappedModelsPools[i][pool][frame],
-				transformInstPools[poolAdjusted].data(), sizeof(mat44<float>) *
-				transformInstPools[poolAdjusted].size());
-		}
 		if (rawEnvironment.has_value()) {
-			memcpy(uniformBuffersMappedNormalTransformsPools[pool][frame],
+			uploadUniform(uniformBuffersMappedNormalTransformsPools[pool][frame],
 				transformNormalInstPools[poolAdjusted].data(), sizeof(mat44<float>) *
 				transformNormalInstPools[poolAdjusted].size());
-			memcpy(uniformBuffersMappedEnvironmentTransformsPools[pool][frame],
+			uploadUniform(uniformBuffersMappedEnvironmentTransformsPools[pool][frame],
 				transformEnvironmentInstPools[poolAdjusted].data(), sizeof(mat44<float>) *
 				transformEnvironmentInstPools[poolAdjusted].size());
 		}
-		memcpy(uniformBuffersMappedCamerasPools[pool][frame], &(local),
+		uploadUniform(uniformBuffersMappedCamerasPools[pool][frame], &(local),
 			sizeof(mat44<float>));
-		memcpy(uniformBuffersMappedLightsPools[pool][frame], lightPool.data(),
+		uploadUniform(uniformBuffersMappedLightsPools[pool][frame], lightPool.data(),
 			sizeof(DrawLight)* lightPool.size());
-		memcpy(uniformBuffersMappedLightTransformsPools[pool][frame], worldTolightPool.data(),
+		uploadUniform(uniformBuffersMappedLightTransformsPools[pool][frame], worldTolightPool.data(),
 			sizeof(mat44<float>) * worldTolightPool.size());
-		memcpy(uniformBuffersMappedLightPerspectivePools[pool][frame], worldTolightPerspPool.data(),
+		uploadUniform(uniformBuffersMappedLightPerspectivePools[pool][frame], worldTolightPerspPool.data(),
 			sizeof(mat44<float>) * worldTolightPool.size());
-		memcpy(uniformBuffersMappedMaterialsPools[pool][frame],
-			&instancedMaterials[poolAdjusted], matsize);
+		uploadUniform(uniformBuffersMappedMaterialsPools[pool][frame],
+			&instancedMaterials[transformInstIndexPools[poolAdjusted]], matsize);
 	}
 }
 
 
+//Wait until this frame's resources are free again, lets callers sample input after the wait
+void VulkanSystem::waitForFrame() {
+	if (!renderToWindow) return;
+	TRACE_SCOPE("wait for frame");
+	vkWaitForFences(device, 1, inFlightFences.data() + currentFrame, VK_TRUE, UINT64_MAX);
+}
+
 void VulkanSystem::drawFrame() {
+	TRACE_SCOPE("drawFrame");
 
 
 
@@ -3475,8 +4900,7 @@ void VulkanSystem::drawFrame() {
 
 	uint32_t imageIndex;
 	if (renderToWindow) {
-		vkWaitForFences(device, 1, inFlightFences.data() + currentFrame, VK_TRUE, UINT64_MAX);
-	
+		//The main loop already waited on this frame's fence through waitForFrame
 		if (!*activeP) { return; }
 		result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
 		if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) {
@@ -3494,16 +4918,37 @@ void VulkanSystem::drawFrame() {
 		if (headlessGuard) return;
 		headlessGuard = true;
 		imageIndex = currentFrame % MAX_FRAMES_IN_FLIGHT;
+		//Only waits on the frame submitted MAX_FRAMES_IN_FLIGHT frames ago
+		{
+			TRACE_SCOPE("wait for frame");
+			vkWaitForFences(device, 1, inFlightFences.data() + currentFrame, VK_TRUE, UINT64_MAX);
+		}
+		collectReadbacks(currentFrame);
+		vkResetFences(device, 1, inFlightFences.data() + currentFrame);
 	}
 
 
 
-	createVertexBuffer(false);
-	createIndexBuffers(true, true);
+	frameStats = FrameStats();
+	frameStats.frame = statsFrameCount++;
+
+	//Results from the last use of this frame's queries, a frame or two late
+	readTimestampQueries(currentFrame);
+	uploadStreamedTextures(currentFrame);
+
+	if (useVertexBuffer) cullDrawPools();
+	if (useVertexBuffer && useMeshlets) cullMeshlets(currentFrame);
+	for (int i = 0; i < lightPool.size(); i++) {
+		if (shadowDirty[i]) cullShadowCasters(i);
+	}
 	updateUniformBuffers(currentFrame);
 
 
 	for (int i = 0; i < lightPool.size(); i++) {
+		//Cached shadow maps are left as is from the last time they were rendered
+		if (!shadowDirty[i]) continue;
+		shadowDirty[i] = false;
+		shadowRenders[i]++;
 
 		size_t commandBufferIndex = (lightPool.size() + 1) * currentFrame + i;
 
@@ -3559,6 +5004,7 @@ void VulkanSystem::drawFrame() {
 	vkResetCommandBuffer(commandBuffers[commandBufferIndex], 0);
 	recordCommandBufferMain(commandBuffers[commandBufferIndex], imageIndex);
 
+	TRACE_SCOPE("submit and present");
 	VkSubmitInfo submitInfo{};
 	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 	if (renderToWindow) {
@@ -3605,17 +5051,18 @@ void VulkanSystem::drawFrame() {
 		submitInfo.commandBufferCount = 1;
 		submitInfo.pCommandBuffers = commandBuffers.data() + (commandBufferIndex);
 
-		if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+		if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS) {
 			throw std::runtime_error("failed to submit draw command buffer!");
 		}
+		lastRenderedFrame = currentFrame;
+		pendingSaves[currentFrame].insert(pendingSaves[currentFrame].end(), nextFrameSaves.begin(), nextFrameSaves.end());
+		nextFrameSaves.clear();
+		if (headlessFrames == 0) headlessStart = std::chrono::high_resolution_clock::now();
+		headlessFrames++;
 	}
 
+	finishFrameStats();
 	currentFrame++; currentFrame %= MAX_FRAMES_IN_FLIGHT;
-	//Headless benchmarking
-	if (!renderToWindow) {
-		headlessFrames++;
-		std::cout << "Frames rendered: " << headlessFrames << std::endl;
-	}
 }
 
 
@@ -3640,5 +5087,13 @@ void VulkanSystem::cleanupSwapChain() {
 	for (size_t i = 0; i < swapChainImageViews.size(); i++) {
 		vkDestroyImageView(device, swapChainImageViews[i], nullptr);
 	}
-	vkDestroySwapchainKHR(device, swapChain, nullptr);
+	if (renderToWindow) {
+		vkDestroySwapchainKHR(device, swapChain, nullptr);
+		return;
+	}
+	for (size_t i = 0; i < swapChainImages.size(); i++) {
+		vkDestroyImage(device, swapChainImages[i], nullptr);
+		vkFreeMemory(device, offscreenImageMemorys[i], nullptr);
+	}
+	swapChainImages.clear();
 }
\ No newline at end of file
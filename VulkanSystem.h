@@ -3,6 +3,14 @@
 #include "WindowManager_win.h"
 #include "vulkan/vulkan.h"
 #include <optional>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <memory>
+#include <atomic>
 #include "MathHelpers.h"
 #include "Vertex.h"
 #include "SceneGraph.h"
@@ -11,6 +19,27 @@ enum Platform {PLAT_WIN, PLAT_LIN};
 enum  MovementMode { MOVE_STATIC, MOVE_USER, MOVE_DEBUG };
 
 const uint32_t MAX_FRAMES_IN_FLIGHT = 2;
+//Offset of the instance group placement in the main pass push constants, after PushConst.
+//Must match shaderInst.vert, shadow passes keep it right after the light transform.
+const uint32_t PLACEMENT_PUSH_OFFSET = 32;
+//Clustered light culling grid, screen tiles by exponential depth slices
+const uint32_t CLUSTER_TILES_X = 16;
+const uint32_t CLUSTER_TILES_Y = 9;
+const uint32_t CLUSTER_SLICES = 24;
+
+struct frustumInfo;
+
+//Everything the simulation thread hands to rendering for one frame, never modified once published
+struct FrameSnapshot {
+	float_3 moveVec;
+	float_3 dirVec;
+	float_3 debugMoveVec;
+	float_3 debugDirVec;
+	MovementMode movementMode;
+	//Shared with later snapshots until the graph is navigated again
+	std::shared_ptr<const DrawList> scene;
+	uint64_t sceneVersion = 0;
+};
 
 struct QueueFamilyIndices {
 	std::optional<uint32_t> graphicsFamily;
@@ -35,16 +64,22 @@ public:
 	VulkanSystem() {};
 
 	MasterWindow* mainWindow;
-	void initVulkan(DrawList drawList, std::string cameraName);
+	void initDevice();
+	void initScene(DrawList drawList, std::string cameraName);
 	void cleanup();
 
 	//main loop
 	void drawFrame();
 	void runDrivers(float frameTime, SceneGraph* sceneGraphP, bool loop = false);
+	bool advanceDrivers(float frameTime, SceneGraph* sceneGraphP, bool loop = false);
+	void applySceneTransforms(const DrawList& drawList);
+	void applySnapshot(const FrameSnapshot& snapshot);
 	void idle() {
 		vkDeviceWaitIdle(device);
 	};
 	void listPhysicalDevices();
+	void savePipelineCache();
+	void stopTextureStreaming();
 	uint32_t currentFrame = 0;
 	uint32_t currentPool = 0;
 	Platform platform;
@@ -59,6 +94,10 @@ public:
 	bool forwardAnimation = true;
 	bool useInstancing = false;
 	bool useCulling = false;
+	bool packVertices = false; //Quantize vertices into the packed layouts on upload
+	bool useMeshlets = false; //Cull meshlets and draw the survivors indirectly
+	bool useLods = false; //Draw simplified levels of meshes that cover little of the screen
+	bool verbose = false;
 	int poolSize;
 
 	//Directories
@@ -66,17 +105,32 @@ public:
 
 	//Headless mode
 	bool headlessGuard = true;
+	VkPresentModeKHR preferredPresentMode = VK_PRESENT_MODE_MAILBOX_KHR;
 	bool renderToWindow = true; //false = headless
 	float playbackSpeed = 1;
 	void setDriverRuntime(float time);
+	void waitForFrame();
+	void requestSave(std::string fileName);
+	void finishHeadless();
 
 	//Vertex shader
 	std::vector<Vertex> vertices;
+	std::vector<SimpleVertex> verticesSimple;
 	std::vector<Vertex> verticesInst;
-	std::vector<std::vector<uint32_t>> indexPoolsStore;
-	std::vector<std::vector<uint32_t>> indexPools;
+	std::vector<uint32_t> indexPool; //Every mesh once, draw nodes reference their range
+	std::vector<uint16_t> shortIndexPool; //The same for meshes with at most 2^16 vertices
+	std::vector<std::vector<uint32_t>> visibleNodePools; //Nodes in each pool that survived culling
+	std::vector<Meshlet> meshlets;
 	std::vector<std::vector<uint32_t>> indexInstPools;
+	std::vector<std::vector<std::pair<uint32_t, uint32_t>>> lodRangesInst; //Start and count of each level in indexInstPools
+	std::vector<std::vector<uint32_t>> instanceLodCounts; //Visible instances per level, stored in level order
+	std::vector<std::vector<mat44<float>>> placementInstPoolsStore; //Placements of grouped pools, empty otherwise
+	std::vector<std::pair<float_3, float>> groupBoundsInst;
+	std::vector<float> memberRadiiInst;
+	std::vector<std::vector<std::pair<mat44<float>, int>>> visiblePlacementPools; //Visible placements and their LOD
 	std::vector<std::vector<mat44<float>>> transformPools;
+	std::vector<std::vector<mat44<float>>> dequantizePools; //Packed position bounds of each node's mesh
+	std::vector<mat44<float>> packedTransforms; //Scratch for transforms with the bounds folded in
 	std::vector<std::vector<mat44<float>>> transformInstPools;
 	std::vector<std::vector<mat44<float>>> transformInstPoolsStore;
 	std::vector<std::vector<mat44<float>>> transformNormalPools;
@@ -95,6 +149,33 @@ public:
 	std::vector<std::vector<DrawMaterial>> materialPools;
 	std::vector<DrawMaterial> instancedMaterials;
 	Texture defaultShadowTex;
+	//Per frame counters, summed into a rolling window and written per frame to csv when headless
+	struct FrameStats {
+		uint64_t frame = 0;
+		uint32_t drawCalls = 0;
+		uint64_t indicesDrawn = 0;
+		uint32_t nodesVisible = 0;
+		uint32_t nodesCulled = 0;
+		uint32_t instancesVisible = 0;
+		uint32_t instancesCulled = 0;
+		uint32_t meshletsVisible = 0;
+		uint32_t meshletsCulled = 0;
+		uint64_t uniformBytes = 0;
+		uint64_t stagedBytes = 0;
+	};
+	FrameStats frameStats;
+	void reportFrameStats();
+	std::string statsFile = "frameStats.csv";
+
+	//GPU pass timings in ms, shadow passes per light then main, instanced and final
+	std::vector<std::string> gpuPassNames;
+	std::vector<std::vector<float>> gpuPassTimes;
+	void reportGpuTimings(std::string dumpFile = "gpuTimings.csv");
+
+	//Shadow map caching, maps are only re-rendered when dirty
+	std::vector<bool> shadowDirty;
+	std::vector<int> shadowRenders;
+	std::vector<int> shadowCasters;
 	//Animation and culling
 	std::vector<std::vector<DrawNode>> drawPools;
 	std::vector<std::pair<float_3, float>> boundingSpheresInst;
@@ -122,8 +203,14 @@ private:
 		VkImageViewType viewType = VK_IMAGE_VIEW_TYPE_2D, int levels = 1);
 	void createImageViews();
 	void createDescriptorSetLayout();
-	void createGraphicsPipeline(std::string vertShader, std::string fragShader, VkPipeline& pipeline, VkPipelineLayout& layout, int subpass, VkRenderPass inRenderPass);
+	void createGraphicsPipeline(std::string vertShader, std::string fragShader, VkPipeline& pipeline, VkPipelineLayout& layout, int subpass, VkRenderPass inRenderPass, VertexInput vertexInput);
 	void createGraphicsPipelines();
+	void buildGraphicsPipelines();
+	void createPipelineCache();
+	void createTimestampQueries();
+	void uploadUniform(void* mapped, const void* data, size_t size);
+	void finishFrameStats();
+	void readTimestampQueries(uint32_t frame);
 	void createRenderPasses();
 	VkShaderModule createShaderModule(const std::vector<char>& shader);
 	void createFramebuffers();
@@ -134,13 +221,22 @@ private:
 		VkMemoryPropertyFlags properties, VkBuffer& buffer, 
 		VkDeviceMemory& bufferMemory, bool realloc);
 	void createVertexBuffer(bool realloc = true);
+	void uploadVertices(const void* source, VkDeviceSize bufferSize, VkBuffer& buffer, VkDeviceMemory& bufferMemory, bool realloc);
+	template <typename P, typename V>
+	std::vector<P> packVertexLayout(const std::vector<V>& source);
 	mat44<float> getCameraSpace(DrawCamera camera, float_3 useMoveVec, float_3 useDirVec);
 	void cullInstances();
-	void cullIndexPools();
+	void cullPlacements(size_t pool, const frustumInfo& info, mat44<float> cameraSpace, float_3 cameraPos, float tanHalfFov);
+	void cullDrawPools();
+	void cullMeshlets(uint32_t frame);
+	void markShadowsDirty(const DrawList& drawList);
+	void cullShadowCasters(int light);
 	void transitionImageLayout(VkImage image, VkFormat format,
 		VkImageLayout oldLayout, VkImageLayout newLayout, int layers = 1, int levels = 1);
 	void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height, int level = 0, int face = 0);
-	void createIndexBuffers(bool realloc = true, bool andFree = false);
+	void createIndexBuffers();
+	void uploadIndices(const void* source, VkDeviceSize bufferSize, VkBuffer& buffer, VkDeviceMemory& bufferMemory);
+	void bindNodeIndices(VkCommandBuffer commandBuffer, const DrawNode& drawNode, int& boundIndices);
 	void generateMipmaps(VkImage image, int32_t x, int32_t y, uint32_t mipLevels, int face = 0);
 	void createEnvironmentImage(Texture env, VkImage& image,
 		VkDeviceMemory& memory, VkImageView& imageViews, VkSampler& sampler);
@@ -148,6 +244,9 @@ private:
 		VkDeviceMemory& memory, VkImageView& imageView, VkSampler& sampler);
 	void createTextureImages();
 	void createUniformBuffers(bool realoc = true);
+	void createClusterBuffers();
+	void createMeshletBuffers();
+	void buildLightClusters(uint32_t frame, mat44<float> worldToView);
 	void createDescriptorPool();
 	void createDepthResources();
 	void createDescriptorSets();
@@ -179,6 +278,19 @@ private:
 	};
 	PushConst pushConstHDR;
 
+	//Matches the Clusters storage buffer header in shader.frag
+	struct ClusterHeader {
+		mat44<float> worldToView;
+		uint32_t tilesX;
+		uint32_t tilesY;
+		uint32_t slices;
+		uint32_t lightCount;
+		float tileWidth;
+		float tileHeight;
+		float nearP;
+		float farP;
+	};
+
 	//Vulkan data
 	VkInstance instance;
 	VkDebugUtilsMessengerEXT debugMessenger;
@@ -192,19 +304,104 @@ private:
 	std::vector<VkImageView> attachmentImageViews;
 	std::vector< std::vector<VkDeviceMemory>> shadowMemorys;
 	std::vector< std::vector<VkImageView>> shadowImageViews;
+	FrameStats statsWindow;
+	uint32_t statsWindowFrames = 0;
+	uint64_t statsFrameCount = 0;
+	std::ofstream statsCsv;
+
+	//Timestamp queries, two per shadow pass and four for the main pass each frame
+	VkQueryPool timestampQueryPool = VK_NULL_HANDLE;
+	bool useTimestamps = false;
+	float timestampPeriod = 1;
+	uint64_t timestampMask = ~0ull;
+	uint32_t timestampsPerFrame = 0;
+	std::vector<std::vector<bool>> timestampsWritten;
+	int gpuTimingReports = 0;
+
+	//Pipeline cache, persisted to disk between runs
+	struct PipelineCachePrefix {
+		uint32_t magic;
+		uint32_t driverVersion;
+		uint32_t vendorID;
+		uint32_t deviceID;
+		uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+		uint64_t dataSize;
+	};
+	VkPipelineCache pipelineCache = VK_NULL_HANDLE;
+	std::string pipelineCacheFile;
+	bool pipelineCacheLoaded = false;
 	VkPipelineLayout pipelineLayoutHDR;
 	VkPipelineLayout pipelineLayoutFinal;
 	std::vector<VkPipelineLayout> pipelineLayoutShadows;
+	//Pipelines are queued by createGraphicsPipeline and built together
+	struct PipelineRequest {
+		std::string vertShader;
+		std::string fragShader;
+		VkPipeline* pipeline;
+		VkPipelineLayout layout;
+		int subpass;
+		VkRenderPass renderPass;
+		VertexInput vertexInput;
+	};
+	std::vector<PipelineRequest> pipelineRequests;
 	VkPipeline graphicsPipeline;
+	VkPipeline graphicsSimplePipeline = VK_NULL_HANDLE;
 	VkPipeline graphicsInstPipeline;
 	VkPipeline graphicsPipelineFinal;
 	std::vector<VkPipeline> graphicsPipelineShadows;
+	std::vector<VkPipeline> graphicsSimplePipelineShadows;
 	std::vector<VkPipeline> graphicsInstPipelineShadows;
 	//Rendering
 	VkQueue graphicsQueue;
 	VkQueue presentQueue;
 	VkSwapchainKHR swapChain;
 	std::vector<VkImage> swapChainImages;
+
+	//Offscreen targets standing in for the swapchain in headless mode, each frame
+	//in flight copies its image into a host visible buffer guarded by its fence
+	std::vector<VkDeviceMemory> offscreenImageMemorys;
+	std::vector<VkBuffer> readbackBuffers;
+	std::vector<VkDeviceMemory> readbackBufferMemorys;
+	std::vector<void*> readbackBuffersMapped;
+	std::vector<std::vector<std::string>> pendingSaves;
+	std::vector<std::string> nextFrameSaves;
+	int lastRenderedFrame = -1;
+	uint64_t headlessFrames = 0;
+	std::chrono::high_resolution_clock::time_point headlessStart;
+	void createReadbackBuffers();
+	void collectReadbacks(uint32_t frame);
+	std::vector<const char*> requiredDeviceExtensions();
+
+	//Deferred 2D textures are decoded on a worker thread and uploaded between frames
+	struct StreamedTexture {
+		size_t index;
+		Texture texture;
+	};
+	std::thread textureStreamThread;
+	std::mutex textureStreamMutex;
+	std::vector<StreamedTexture> streamedTextures;
+	std::atomic<bool> textureStreamStop{ false };
+	std::atomic<size_t> textureStreamRemaining{ 0 };
+	uint64_t textureGeneration = 0;
+	std::vector<uint64_t> textureDescriptorGenerations;
+	void textureStreamMain(std::vector<size_t> deferredTextures);
+	void uploadStreamedTextures(uint32_t frame);
+	VkDescriptorImageInfo textureDescriptor(size_t tex);
+
+	//PPM files are written on a worker thread
+	struct SaveJob {
+		std::string fileName;
+		uint32_t width;
+		uint32_t height;
+		bool bgra;
+		std::vector<uint8_t> pixels;
+	};
+	std::thread saveThread;
+	std::mutex saveMutex;
+	std::condition_variable saveCondition;
+	std::deque<SaveJob> saveJobs;
+	bool saveThreadStop = false;
+	void saveThreadMain();
 	std::vector<VkImage> attachmentImages;
 	std::vector<std::vector<VkImage>> shadowImages;
 	VkFormat swapChainImageFormat;
@@ -223,16 +420,22 @@ private:
 	std::vector<VkDeviceMemory> shadowDepthImageMemorys;
 	std::vector<VkImageView> shadowDepthImageViews;
 	//Vertices
-	VkBuffer vertexBuffer;
+	VkBuffer vertexBuffer = VK_NULL_HANDLE;
 	bool useVertexBuffer;
-	VkDeviceMemory vertexBufferMemory;
-	std::vector<VkBuffer> indexBuffers;
-	std::vector<bool> indexBuffersValid;
-	std::vector<VkDeviceMemory> indexBufferMemorys;
+	VkDeviceMemory vertexBufferMemory = VK_NULL_HANDLE;
+	VkBuffer vertexSimpleBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory vertexSimpleBufferMemory = VK_NULL_HANDLE;
+	VkBuffer indexBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory indexBufferMemory = VK_NULL_HANDLE;
+	VkBuffer shortIndexBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory shortIndexBufferMemory = VK_NULL_HANDLE;
 	VkBuffer vertexInstBuffer;
 	VkDeviceMemory vertexInstBufferMemory;
 	std::vector<VkBuffer> indexInstBuffers;
 	std::vector<VkDeviceMemory> indexInstBufferMemorys;
+	std::vector<std::vector<std::vector<uint32_t>>> shadowNodePools; //[light][pool], visible casters
+	std::vector<std::vector<std::vector<mat44<float>>>> shadowInstPools; //[light][pool]
+	std::vector<std::vector<std::vector<mat44<float>>>> shadowPlacementPools; //[light][pool], grouped pools only
 	//Images
 	bool initialFrame = true;
 	std::vector<Texture> rawTextures;
@@ -301,6 +504,26 @@ private:
 	std::vector< std::vector<VkBuffer>> uniformBuffersMaterialsPools;
 	std::vector< std::vector<VkDeviceMemory >> uniformBuffersMemoryMaterialsPools;
 	std::vector< std::vector<void*>> uniformBuffersMappedMaterialsPools;
+
+	//Cluster light lists, one storage buffer per frame shared by all pools
+	std::vector<VkBuffer> clusterBuffers;
+	std::vector<VkDeviceMemory> clusterBufferMemorys;
+	std::vector<void*> clusterBuffersMapped;
+	std::vector<std::vector<uint32_t>> clusterLightLists;
+
+	//Indirect draws of the meshlets that survived culling, one buffer per frame. Each group
+	//is a run of draws sharing a layout, pool and index width
+	struct MeshletDrawGroup {
+		int layout;
+		size_t pool;
+		bool shortIndices;
+		uint32_t first;
+		uint32_t count;
+	};
+	std::vector<MeshletDrawGroup> meshletDrawGroups;
+	std::vector<VkBuffer> meshletCommandBuffers;
+	std::vector<VkDeviceMemory> meshletCommandBufferMemorys;
+	std::vector<void*> meshletCommandsMapped;
 	VkDescriptorPool descriptorPoolHDR;
 	std::vector<VkDescriptorSet> descriptorSetsHDR;
 	VkDescriptorPool descriptorPoolFinal;
@@ -311,9 +534,7 @@ private:
 	
 	//Camera
 	int currentCamera = 0;
-
-	//Headless debug
-	int headlessFrames = 0;
+	uint64_t appliedSceneVersion = 0;
 
 
 